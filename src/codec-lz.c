@@ -0,0 +1,226 @@
+/*
+ * Dynoc is a minimalistic C client library for the dynomite.
+ * Copyright (C) 2016-2017 huya.com, Lampman Yao
+ */
+
+/*
+ * Dynomite - A thin, distributed replication layer for multi non-distributed storages.
+ * Copyright (C) 2014 Netflix, Inc.
+ */
+
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * A small LZ77 codec producing LZ4 block format: greedy matching through a
+ * 4K entry hash table, 64K window, the last 5 bytes always literals.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define LZ_HASH_LOG       12
+#define LZ_MIN_MATCH      4
+#define LZ_LAST_LITERALS  5
+#define LZ_MFLIMIT        12
+#define LZ_MAX_OFFSET     65535
+
+static inline uint32_t
+read32(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t
+lz_hash(uint32_t v) {
+	return (v * 2654435761U) >> (32 - LZ_HASH_LOG);
+}
+
+static inline uint8_t *
+put_length(uint8_t *op, size_t len) {
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+size_t
+codec_lz_bound(size_t len) {
+	return len + len / 255 + 16;
+}
+
+int
+codec_lz_compress(const char *source, size_t len, char *dest, size_t cap) {
+	const uint8_t *src = (const uint8_t *)source;
+	const uint8_t *ip = src, *anchor = src, *end = src + len;
+	uint8_t *op = (uint8_t *)dest, *oend = op + cap;
+	uint32_t table[1 << LZ_HASH_LOG];
+	size_t lit;
+
+	if (len > INT32_MAX) {
+		return -1;
+	}
+
+	memset(table, 0, sizeof(table));
+
+	if (len > LZ_MFLIMIT) {
+		const uint8_t *mflimit = end - LZ_MFLIMIT;
+		const uint8_t *matchlimit = end - LZ_LAST_LITERALS;
+
+		while (ip < mflimit) {
+			uint32_t seq = read32(ip);
+			uint32_t h = lz_hash(seq);
+			const uint8_t *ref = src + table[h];
+			const uint8_t *mp;
+			size_t mlen, off;
+			uint8_t *token;
+
+			table[h] = (uint32_t)(ip - src);
+			if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != seq) {
+				ip++;
+				continue;
+			}
+
+			while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+			}
+
+			mp = ip + LZ_MIN_MATCH;
+			ref += LZ_MIN_MATCH;
+			while (mp < matchlimit && *mp == *ref) {
+				mp++;
+				ref++;
+			}
+
+			lit = ip - anchor;
+			mlen = mp - ip - LZ_MIN_MATCH;
+			off = mp - ref;
+			if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1) {
+				return -1;
+			}
+
+			token = op++;
+			if (lit >= 15) {
+				*token = 15 << 4;
+				op = put_length(op, lit - 15);
+			} else {
+				*token = (uint8_t)(lit << 4);
+			}
+			memcpy(op, anchor, lit);
+			op += lit;
+
+			*op++ = (uint8_t)(off & 0xff);
+			*op++ = (uint8_t)(off >> 8);
+
+			if (mlen >= 15) {
+				*token |= 15;
+				op = put_length(op, mlen - 15);
+			} else {
+				*token |= (uint8_t)mlen;
+			}
+
+			ip = anchor = mp;
+		}
+	}
+
+	lit = end - anchor;
+	if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit) {
+		return -1;
+	}
+	if (lit >= 15) {
+		*op++ = 15 << 4;
+		op = put_length(op, lit - 15);
+	} else {
+		*op++ = (uint8_t)(lit << 4);
+	}
+	memcpy(op, anchor, lit);
+	op += lit;
+
+	return (int)(op - (uint8_t *)dest);
+}
+
+int
+codec_lz_decompress(const char *source, size_t len, char *dest, size_t cap) {
+	const uint8_t *ip = (const uint8_t *)source, *iend = ip + len;
+	uint8_t *op = (uint8_t *)dest, *oend = op + cap;
+
+	while (ip < iend) {
+		uint8_t token = *ip++;
+		size_t lit = token >> 4, mlen, off;
+		const uint8_t *match;
+		uint8_t b;
+
+		if (lit == 15) {
+			do {
+				if (ip >= iend) {
+					return -1;
+				}
+				b = *ip++;
+				lit += b;
+			} while (b == 255);
+		}
+
+		if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) {
+			return -1;
+		}
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+
+		if (ip == iend) {
+			break;
+		}
+
+		if (iend - ip < 2) {
+			return -1;
+		}
+		off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (off == 0 || off > (size_t)(op - (uint8_t *)dest)) {
+			return -1;
+		}
+
+		mlen = token & 15;
+		if (mlen == 15) {
+			do {
+				if (ip >= iend) {
+					return -1;
+				}
+				b = *ip++;
+				mlen += b;
+			} while (b == 255);
+		}
+		mlen += LZ_MIN_MATCH;
+
+		if (mlen > (size_t)(oend - op)) {
+			return -1;
+		}
+
+		/* Matches may overlap the bytes they produce, copy forward. */
+		match = op - off;
+		while (mlen--) {
+			*op++ = *match++;
+		}
+	}
+
+	return (int)(op - (uint8_t *)dest);
+}
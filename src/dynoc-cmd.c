@@ -26,193 +26,435 @@
  */
 
 #include "dynoc-debug.h"
-#include "dynoc-core.h"
+#include "dynoc-conn.h"
 
+#include <stdarg.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 
+/*
+ * Swap a compressed value for the original one. The hiredis reply buffers
+ * come from the default allocator, so the payload can be replaced in place.
+ */
+static redisReply *
+decode_reply(struct dynoc *dynoc, redisReply *reply) {
+	char *buf;
+	size_t len;
+
+	if (reply->type != REDIS_REPLY_STRING || !value_header(dynoc->codec, reply->str, reply->len, &len)) {
+		return reply;
+	}
+
+	if (value_decode(dynoc->codec, reply->str, reply->len, &buf, &len) < 0) {
+		log_debug("corrupt compressed value");
+		freeReplyObject(reply);
+		return NULL;
+	}
+
+	free(reply->str);
+	reply->str = buf;
+	reply->len = len;
+	return reply;
+}
+
+static __thread struct redis_connection *thread_node;
+
+struct redis_connection *
+command_node(void) {
+	return thread_node;
+}
+
+/*
+ * Run a single-key command on the node owning `key`, failing over rack by
+ * rack and then to the remote datacenter. A node that is down costs
+ * nothing, but every attempt that failed after the command was sent is a
+ * retry and has to pass the retry policy. Returns the reply, or NULL.
+ */
+redisReply *
+command_run(struct dynoc *dynoc, const char *key, int flags, command_attempt_t attempt, void *arg) {
+	struct token token;
+	struct redis_connection *shared, *redis_conn;
+	redisReply *reply;
+	dc_type_t dc_type = LOCAL_DC;
+	uint32_t rc_idx = 0;
+	int retries = 0, ambiguous;
+
+	token_init(&token);
+	retry_budget_deposit(dynoc);
+	thread_node = NULL;
+
+	while ((shared = select_connection(dynoc, key, &token, &dc_type, &rc_idx))) {
+		redis_conn = connection_acquire(dynoc, shared);
+		if (!redis_conn || !connection_ready(dynoc, redis_conn)) {
+			connection_release(shared, redis_conn);
+			log_debug("dynomite is downed");
+			continue;
+		}
+
+		reply = attempt(redis_conn, arg);
+
+		if (reply && redis_conn->ctx->err == 0 &&
+		    (reply->type != REDIS_REPLY_ERROR || (flags & COMMAND_ERROR_REPLY))) {
+			connection_release(shared, redis_conn);
+			thread_node = shared;
+			return reply;
+		}
+
+		/* No reply at all: the command may or may not have been applied. */
+		ambiguous = !reply;
+		if (reply) {
+			freeReplyObject(reply);
+		}
+		reset_redis_connection(redis_conn);
+		connection_failed(shared, redis_conn);
+		connection_release(shared, redis_conn);
+		log_debug("redis is downed");
+
+		if (!select_remaining(dynoc, dc_type, rc_idx) ||
+		    !retry_allowed(dynoc, ++retries, flags & COMMAND_IDEMPOTENT, ambiguous)) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+struct format_args {
+	const char *format;
+	va_list *ap;
+};
+
+static redisReply *
+format_attempt(struct redis_connection *redis_conn, void *arg) {
+	struct format_args *args = arg;
+	redisReply *reply;
+	va_list aq;
+
+	va_copy(aq, *args->ap);
+	reply = redisvCommand(redis_conn->ctx, args->format, aq);
+	va_end(aq);
+	return reply;
+}
+
+static redisReply *
+command_vexec(struct dynoc *dynoc, const char *key, int idempotent, const char *format, va_list ap) {
+	struct format_args args;
+	va_list aq;
+	redisReply *reply;
+
+	va_copy(aq, ap);
+	args.format = format;
+	args.ap = &aq;
+	reply = command_run(dynoc, key, idempotent ? COMMAND_IDEMPOTENT : 0, format_attempt, &args);
+	va_end(aq);
+	return reply;
+}
+
+static redisReply *
+command_exec(struct dynoc *dynoc, const char *key, int idempotent, const char *format, ...) {
+	redisReply *reply;
+	va_list ap;
+
+	va_start(ap, format);
+	reply = command_vexec(dynoc, key, idempotent, format, ap);
+	va_end(ap);
+	return reply;
+}
+
+/*
+ * A command sent to the owner of its key in every local rack at once, for
+ * the consistency levels above CONSISTENCY_DC_ONE.
+ */
+struct rack_fanout {
+	struct conn_request *reqs;
+	uint32_t nrack;
+	char *cmd;
+};
+
+static int
+rack_fanout_init(struct dynoc *dynoc, struct rack_fanout *fan, const char *key, const char *format, va_list ap) {
+	struct redis_connection **conns;
+	uint32_t nrack = dynoc->local_dc->rack_count, i;
+	int len;
+
+	fan->reqs = malloc(nrack * (sizeof(*fan->reqs) + sizeof(*conns)));
+	if (!fan->reqs) {
+		return -1;
+	}
+	conns = (struct redis_connection **)(fan->reqs + nrack);
+
+	len = redisvFormatCommand(&fan->cmd, format, ap);
+	if (len < 0) {
+		free(fan->reqs);
+		return -1;
+	}
+
+	fan->nrack = select_rack_connections(dynoc, key, conns);
+	for (i = 0; i < fan->nrack; i++) {
+		fan->reqs[i].redis_conn = conns[i];
+		fan->reqs[i].cmd = fan->cmd;
+		fan->reqs[i].len = len;
+	}
+	return 0;
+}
+
 static void
-reset_redis_connection(struct redis_connection *redis_conn) {
-	redis_conn->status = INVALID;
-	redisFree(redis_conn->ctx);
-	redis_conn->ctx = NULL;
+rack_fanout_deinit(struct rack_fanout *fan) {
+	uint32_t i;
+
+	for (i = 0; i < fan->nrack; i++) {
+		if (fan->reqs[i].reply) {
+			freeReplyObject(fan->reqs[i].reply);
+		}
+	}
+	free(fan->cmd);
+	free(fan->reqs);
 }
 
-static uint32_t
-select_continuum(struct continuum *continuum, uint32_t ncontinuum, struct token *token) {
-	struct continuum *left, *right, *middle;
+static int
+write_acked(const struct conn_request *reqs, uint32_t nreq, void *arg) {
+	uint32_t need = *(uint32_t *)arg, acks = 0, i;
 
-	left = continuum;
-	right = continuum + ncontinuum - 1;
+	for (i = 0; i < nreq; i++) {
+		if (reqs[i].reply && reqs[i].reply->type != REDIS_REPLY_ERROR) {
+			acks++;
+		}
+	}
+	return acks >= need;
+}
 
-	if (token_cmp(right->token, token) < 0 || token_cmp(left->token, token) >= 0) {
-		return left->index;
+static int
+quorum_write(struct dynoc *dynoc, const char *key, consistency_t level, const char *format, va_list ap) {
+	struct rack_fanout fan;
+	uint32_t need;
+	int ret;
+
+	if (rack_fanout_init(dynoc, &fan, key, format, ap) < 0) {
+		return -1;
+	}
+
+	need = consistency_acks(level, fan.nrack);
+	conn_pipeline_until(dynoc, fan.reqs, fan.nrack, write_acked, &need);
+	ret = write_acked(fan.reqs, fan.nrack, &need) ? 0 : -1;
+	if (ret < 0) {
+		log_debug("write of %s not acknowledged by %u racks", key, need);
 	}
 
-	while (left < right) {
-		middle = left + (right - left) / 2;
-		int32_t cmp = token_cmp(middle->token, token);
-		if (cmp == 0) {
-			return middle->index;
-		} else if (cmp < 0) {
-			left = middle + 1;
-		} else {
-			right = middle;
+	rack_fanout_deinit(&fan);
+	return ret;
+}
+
+/*
+ * Idempotent writes honour the write consistency. Every node also
+ * replicates what it receives, which is why non-idempotent commands must
+ * not be fanned out.
+ */
+static int
+write_exec(struct dynoc *dynoc, const char *key, const char *format, ...) {
+	consistency_t level = write_consistency(dynoc);
+	redisReply *reply;
+	va_list ap;
+	int ret;
+
+	va_start(ap, format);
+	if (level == CONSISTENCY_DC_ONE || !dynoc->local_dc) {
+		reply = command_vexec(dynoc, key, 1, format, ap);
+		ret = reply ? 0 : -1;
+		if (reply) {
+			freeReplyObject(reply);
 		}
+	} else {
+		ret = quorum_write(dynoc, key, level, format, ap);
 	}
+	va_end(ap);
+	return ret;
+}
 
-	return right->index;
+/*
+ * Votes of a fanned out read. Each reply is hashed once, when it first
+ * shows up; `best` is the reply the most racks agree with so far.
+ */
+struct read_digest {
+	int hashed;
+	int type;
+	size_t len;
+	uint32_t hash;
+};
+
+struct read_votes {
+	uint32_t need;
+	uint32_t best;
+	uint32_t votes;
+	hash_func_t digest;
+	struct read_digest *digests;
+};
+
+static int
+read_valid(const redisReply *reply) {
+	return reply && (reply->type == REDIS_REPLY_STRING || reply->type == REDIS_REPLY_NIL);
 }
 
-static struct redis_connection*
-select_connection(struct dynoc *dynoc, const char *key,
-                  struct token *token, dc_type_t *dc_type, uint32_t *rc_idx) {
-	uint32_t index, hash;
-	struct datacenter *dc;
-	struct rack *rack;
+static int
+read_same(const struct read_votes *rv, uint32_t i, uint32_t j) {
+	const struct read_digest *d1 = &rv->digests[i], *d2 = &rv->digests[j];
+	return d1->type == d2->type && d1->len == d2->len && d1->hash == d2->hash;
+}
 
-	token_parse(key, strlen(key), token);
-	hash = dynoc->hash_func(key, strlen(key));
-	token_size(token, 1);
-	token_set_int(token, hash);
+static int
+read_agreed(const struct conn_request *reqs, uint32_t nreq, void *arg) {
+	struct read_votes *rv = arg;
+	uint32_t i, j, votes;
+
+	for (i = 0; i < nreq; i++) {
+		const redisReply *reply = reqs[i].reply;
+		if (read_valid(reply) && !rv->digests[i].hashed) {
+			rv->digests[i].type = reply->type;
+			rv->digests[i].len = reply->len;
+			rv->digests[i].hash = reply->type == REDIS_REPLY_STRING ? (uint32_t)rv->digest(reply->str, reply->len) : 0;
+			rv->digests[i].hashed = 1;
+		}
+	}
 
-	dc = dc_type ? dynoc->local_dc : dynoc->remote_dc;
+	rv->votes = 0;
+	for (i = 0; i < nreq; i++) {
+		if (!read_valid(reqs[i].reply)) {
+			continue;
+		}
+		for (j = 0, votes = 0; j < nreq; j++) {
+			if (read_valid(reqs[j].reply) && read_same(rv, i, j)) {
+				votes++;
+			}
+		}
+		if (votes > rv->votes) {
+			rv->votes = votes;
+			rv->best = i;
+		}
+	}
+	return rv->votes >= rv->need;
+}
 
-	if (!dc) {
+static redisReply *
+quorum_read(struct dynoc *dynoc, const char *key, const char *field, consistency_t level,
+            const char *format, va_list ap) {
+	struct rack_fanout fan;
+	struct read_votes rv;
+	redisReply *reply = NULL;
+	uint32_t i;
+
+	if (rack_fanout_init(dynoc, &fan, key, format, ap) < 0) {
 		return NULL;
 	}
 
-	if (*rc_idx >= dc->rack_count) {
-		if (*dc_type == LOCAL_DC) {
-			*dc_type = REMOTE_DC;
-			*rc_idx = 0;
-			dc = dynoc->remote_dc;
-		} else {
-			return NULL;
+	rv.digests = calloc(fan.nrack, sizeof(*rv.digests));
+	if (!rv.digests) {
+		rack_fanout_deinit(&fan);
+		return NULL;
+	}
+	rv.need = consistency_acks(level, fan.nrack);
+	rv.digest = get_hash_func(HASH_MURMUR3);
+
+	conn_pipeline_until(dynoc, fan.reqs, fan.nrack, read_agreed, &rv);
+
+	if (read_agreed(fan.reqs, fan.nrack, &rv)) {
+		reply = fan.reqs[rv.best].reply;
+		fan.reqs[rv.best].reply = NULL;
+	} else {
+		log_debug("read of %s not agreed by %u racks", key, rv.need);
+	}
+
+	/* The winning reply has been taken, but its digest is still there. */
+	if (rv.votes && dynoc->read_mismatch) {
+		for (i = 0; i < fan.nrack; i++) {
+			if (i != rv.best && read_valid(fan.reqs[i].reply) && !read_same(&rv, i, rv.best)) {
+				dynoc->read_mismatch(key, field, dynoc->local_dc->rack[i].name, dynoc->read_mismatch_arg);
+			}
 		}
 	}
 
-	if (!dc) {
-		return NULL;
+	free(rv.digests);
+	rack_fanout_deinit(&fan);
+	return reply;
+}
+
+/* Reads honour the read consistency and return the decoded value. */
+static redisReply *
+read_exec(struct dynoc *dynoc, const char *key, const char *field, const char *format, ...) {
+	consistency_t level = read_consistency(dynoc);
+	redisReply *reply;
+	va_list ap;
+
+	va_start(ap, format);
+	if (level == CONSISTENCY_DC_ONE || !dynoc->local_dc) {
+		reply = command_vexec(dynoc, key, 1, format, ap);
+	} else {
+		reply = quorum_read(dynoc, key, field, level, format, ap);
 	}
+	va_end(ap);
+	return reply ? decode_reply(dynoc, reply) : NULL;
+}
 
-	rack = &dc->rack[(*rc_idx)++];
-	index = select_continuum(rack->continuum, rack->ncontinuum, token);
-	return &rack->redis_conn_pool[index];
+static int
+command_status(redisReply *reply) {
+	if (!reply) {
+		return -1;
+	}
+	freeReplyObject(reply);
+	return 0;
 }
 
 int
 dynoc_set(struct dynoc *dynoc, const char *key, const char *value) {
+	struct value encoded;
+	int ret;
+
 	if (!key || !value) {
 		return -1;
 	}
 
-	struct token token;
-	struct redis_connection *redis_conn;
-	redisReply *reply;
-	dc_type_t dc_type = LOCAL_DC;
-	uint32_t rc_idx = 0;
-
-	token_init(&token);
-
-	while ((redis_conn = select_connection(dynoc, key, &token, &dc_type, &rc_idx))) {
-		pthread_mutex_lock(&redis_conn->lock);
-		if (redis_conn->status) {
-			reply = redisCommand(redis_conn->ctx, "SET %s %s", key, value);
-			if (reply && reply->type != REDIS_REPLY_ERROR && redis_conn->ctx->err == 0) {
-				freeReplyObject(reply);
-				pthread_mutex_unlock(&redis_conn->lock);
-				return 0;
-			} else {
-				if (reply) {
-					freeReplyObject(reply);
-				}
-				reset_redis_connection(redis_conn);
-				pthread_mutex_unlock(&redis_conn->lock);
-			}
-		} else {
-			pthread_mutex_unlock(&redis_conn->lock);
-		}
+	if (value_encode(dynoc->codec, dynoc->codec_threshold, value, strlen(value), &encoded) < 0) {
+		return -1;
 	}
 
-	return -1;
+	ret = write_exec(dynoc, key, "SET %s %b", key, encoded.data, encoded.len);
+	value_free(&encoded);
+	return ret;
 }
 
 int
 dynoc_setex(struct dynoc *dynoc, const char *key, const char *value, int seconds) {
+	struct value encoded;
+	int ret;
+
 	if (!key || !value) {
 		return -1;
 	}
 
-	struct token token;
-	struct redis_connection *redis_conn;
-	redisReply *reply;
-	dc_type_t dc_type = LOCAL_DC;
-	uint32_t rc_idx = 0;
-
-	token_init(&token);
-
-	while ((redis_conn = select_connection(dynoc, key, &token, &dc_type, &rc_idx))) {
-		pthread_mutex_lock(&redis_conn->lock);
-		if (redis_conn->status) {
-			reply = redisCommand(redis_conn->ctx, "SETEX %s %d %s", key, seconds, value);
-			if (reply && reply->type != REDIS_REPLY_ERROR && redis_conn->ctx->err == 0) {
-				freeReplyObject(reply);
-				pthread_mutex_unlock(&redis_conn->lock);
-				return 0;
-			} else {
-				if (reply) {
-					freeReplyObject(reply);
-				}
-				reset_redis_connection(redis_conn);
-				pthread_mutex_unlock(&redis_conn->lock);
-				log_debug("redis is downed");
-			}
-		} else {
-			pthread_mutex_unlock(&redis_conn->lock);
-			log_debug("dynomite is downed");
-		}
+	if (value_encode(dynoc->codec, dynoc->codec_threshold, value, strlen(value), &encoded) < 0) {
+		return -1;
 	}
 
-	return -1;
+	ret = write_exec(dynoc, key, "SETEX %s %d %b", key, seconds, encoded.data, encoded.len);
+	value_free(&encoded);
+	return ret;
 }
 
 int
 dynoc_psetex(struct dynoc *dynoc, const char *key, const char *value, int milliseconds) {
+	struct value encoded;
+	int ret;
+
 	if (!key || !value) {
 		return -1;
 	}
 
-	struct token token;
-	struct redis_connection *redis_conn;
-	redisReply *reply;
-	dc_type_t dc_type = LOCAL_DC;
-	uint32_t rc_idx = 0;
-
-	token_init(&token);
-
-	while ((redis_conn = select_connection(dynoc, key, &token, &dc_type, &rc_idx))) {
-		pthread_mutex_lock(&redis_conn->lock);
-		if (redis_conn->status) {
-			reply = redisCommand(redis_conn->ctx, "PSETEX %s %d %s", key, milliseconds, value);
-			if (reply && reply->type != REDIS_REPLY_ERROR && redis_conn->ctx->err == 0) {
-				freeReplyObject(reply);
-				pthread_mutex_unlock(&redis_conn->lock);
-				return 0;
-			} else {
-				if (reply) {
-					freeReplyObject(reply);
-				}
-				reset_redis_connection(redis_conn);
-				pthread_mutex_unlock(&redis_conn->lock);
-			}
-		} else {
-			pthread_mutex_unlock(&redis_conn->lock);
-		}
+	if (value_encode(dynoc->codec, dynoc->codec_threshold, value, strlen(value), &encoded) < 0) {
+		return -1;
 	}
 
-	return -1;
+	ret = write_exec(dynoc, key, "PSETEX %s %d %b", key, milliseconds, encoded.data, encoded.len);
+	value_free(&encoded);
+	return ret;
 }
 
 redisReply *
@@ -221,35 +463,7 @@ dynoc_get(struct dynoc *dynoc, const char *key) {
 		return NULL;
 	}
 
-	struct token token;
-	struct redis_connection *redis_conn;
-	redisReply *reply = NULL;
-	dc_type_t dc_type = LOCAL_DC;
-	uint32_t rc_idx = 0;
-
-	token_init(&token);
-
-	while ((redis_conn = select_connection(dynoc, key, &token, &dc_type, &rc_idx))) {
-		pthread_mutex_lock(&redis_conn->lock);
-
-		if (redis_conn->status) {
-			reply = redisCommand(redis_conn->ctx, "GET %s", key);
-			if (reply && reply->type != REDIS_REPLY_ERROR && redis_conn->ctx->err == 0) {
-				pthread_mutex_unlock(&redis_conn->lock);
-				return reply;
-			} else {
-				if (reply) {
-					freeReplyObject(reply);
-				}
-				reset_redis_connection(redis_conn);
-				pthread_mutex_unlock(&redis_conn->lock);
-			}
-		} else {
-			pthread_mutex_unlock(&redis_conn->lock);
-		}
-	}
-
-	return NULL;
+	return read_exec(dynoc, key, NULL, "GET %s", key);
 }
 
 int
@@ -258,74 +472,25 @@ dynoc_del(struct dynoc *dynoc, const char *key) {
 		return -1;
 	}
 
-	struct token token;
-	struct redis_connection *redis_conn;
-	redisReply *reply = NULL;
-	dc_type_t dc_type = LOCAL_DC;
-	uint32_t rc_idx = 0;
-
-	token_init(&token);
-
-	while ((redis_conn = select_connection(dynoc, key, &token, &dc_type, &rc_idx))) {
-		pthread_mutex_lock(&redis_conn->lock);
-
-		if (redis_conn->status) {
-			reply = redisCommand(redis_conn->ctx, "DEL %s", key);
-			if (reply && reply->type != REDIS_REPLY_ERROR && redis_conn->ctx->err == 0) {
-				freeReplyObject(reply);
-				pthread_mutex_unlock(&redis_conn->lock);
-				return 0;
-			} else {
-				if (reply) {
-					freeReplyObject(reply);
-				}
-				reset_redis_connection(redis_conn);
-				pthread_mutex_unlock(&redis_conn->lock);
-			}
-		} else {
-			pthread_mutex_unlock(&redis_conn->lock);
-		}
-	}
-
-	return -1;
+	return write_exec(dynoc, key, "DEL %s", key);
 }
 
 int
 dynoc_hset(struct dynoc *dynoc, const char *key, const char *field, const char *value) {
+	struct value encoded;
+	int ret;
+
 	if (!key || !field || !value) {
 		return -1;
 	}
 
-	struct token token;
-	struct redis_connection *redis_conn;
-	redisReply *reply;
-	dc_type_t dc_type = LOCAL_DC;
-	uint32_t rc_idx = 0;
-
-	token_init(&token);
-
-	while ((redis_conn = select_connection(dynoc, key, &token, &dc_type, &rc_idx))) {
-		pthread_mutex_lock(&redis_conn->lock);
-
-		if (redis_conn->status) {
-			reply = redisCommand(redis_conn->ctx, "HSET %s %s %s", key, field, value);
-			if (reply && reply->type != REDIS_REPLY_ERROR && redis_conn->ctx->err == 0) {
-				freeReplyObject(reply);
-				pthread_mutex_unlock(&redis_conn->lock);
-				return 0;
-			} else {
-				if (reply) {
-					freeReplyObject(reply);
-				}
-				reset_redis_connection(redis_conn);
-				pthread_mutex_unlock(&redis_conn->lock);
-			}
-		} else {
-			pthread_mutex_unlock(&redis_conn->lock);
-		}
+	if (value_encode(dynoc->codec, dynoc->codec_threshold, value, strlen(value), &encoded) < 0) {
+		return -1;
 	}
 
-	return -1;
+	ret = write_exec(dynoc, key, "HSET %s %s %b", key, field, encoded.data, encoded.len);
+	value_free(&encoded);
+	return ret;
 }
 
 redisReply *
@@ -334,35 +499,7 @@ dynoc_hget(struct dynoc *dynoc, const char *key, const char *field) {
 		return NULL;
 	}
 
-	struct token token;
-	struct redis_connection *redis_conn;
-	redisReply *reply;
-	dc_type_t dc_type = LOCAL_DC;
-	uint32_t rc_idx = 0;
-
-	token_init(&token);
-
-	while ((redis_conn = select_connection(dynoc, key, &token, &dc_type, &rc_idx))) {
-		pthread_mutex_lock(&redis_conn->lock);
-
-		if (redis_conn->status) {
-			reply = redisCommand(redis_conn->ctx, "HGET %s %s", key, field);
-			if (reply && reply->type != REDIS_REPLY_ERROR && redis_conn->ctx->err == 0) {
-				pthread_mutex_unlock(&redis_conn->lock);
-				return reply;
-			} else {
-				if (reply) {
-					freeReplyObject(reply);
-				}
-				reset_redis_connection(redis_conn);
-				pthread_mutex_unlock(&redis_conn->lock);
-			}
-		} else {
-			pthread_mutex_unlock(&redis_conn->lock);
-		}
-	}
-
-	return NULL;
+	return read_exec(dynoc, key, field, "HGET %s %s", key, field);
 }
 
 int
@@ -371,35 +508,7 @@ dynoc_incr(struct dynoc *dynoc, const char *key) {
 		return -1;
 	}
 
-	struct token token;
-	struct redis_connection *redis_conn;
-	redisReply *reply;
-	dc_type_t dc_type = LOCAL_DC;
-	uint32_t rc_idx = 0;
-
-	token_init(&token);
-
-	while ((redis_conn = select_connection(dynoc, key, &token, &dc_type, &rc_idx))) {
-		pthread_mutex_lock(&redis_conn->lock);
-		if (redis_conn->status) {
-			reply = redisCommand(redis_conn->ctx, "INCR %s", key);
-			if (reply && reply->type != REDIS_REPLY_ERROR && redis_conn->ctx->err == 0) {
-				freeReplyObject(reply);
-				pthread_mutex_unlock(&redis_conn->lock);
-				return 0;
-			} else {
-				if (reply) {
-					freeReplyObject(reply);
-				}
-				reset_redis_connection(redis_conn);
-				pthread_mutex_unlock(&redis_conn->lock);
-			}
-		} else {
-			pthread_mutex_unlock(&redis_conn->lock);
-		}
-	}
-
-	return -1;
+	return command_status(command_exec(dynoc, key, 0, "INCR %s", key));
 }
 
 int
@@ -408,35 +517,7 @@ dynoc_incrby(struct dynoc *dynoc, const char *key, int val) {
 		return -1;
 	}
 
-	struct token token;
-	struct redis_connection *redis_conn;
-	redisReply *reply;
-	dc_type_t dc_type = LOCAL_DC;
-	uint32_t rc_idx = 0;
-
-	token_init(&token);
-
-	while ((redis_conn = select_connection(dynoc, key, &token, &dc_type, &rc_idx))) {
-		pthread_mutex_lock(&redis_conn->lock);
-		if (redis_conn->status) {
-			reply = redisCommand(redis_conn->ctx, "INCRBY %s %d", key, val);
-			if (reply && reply->type != REDIS_REPLY_ERROR && redis_conn->ctx->err == 0) {
-				freeReplyObject(reply);
-				pthread_mutex_unlock(&redis_conn->lock);
-				return 0;
-			} else {
-				if (reply) {
-					freeReplyObject(reply);
-				}
-				reset_redis_connection(redis_conn);
-				pthread_mutex_unlock(&redis_conn->lock);
-			}
-		} else {
-			pthread_mutex_unlock(&redis_conn->lock);
-		}
-	}
-
-	return -1;
+	return command_status(command_exec(dynoc, key, 0, "INCRBY %s %d", key, val));
 }
 
 int
@@ -445,35 +526,7 @@ dynoc_decr(struct dynoc *dynoc, const char *key) {
 		return -1;
 	}
 
-	struct token token;
-	struct redis_connection *redis_conn;
-	redisReply *reply;
-	dc_type_t dc_type = LOCAL_DC;
-	uint32_t rc_idx = 0;
-
-	token_init(&token);
-
-	while ((redis_conn = select_connection(dynoc, key, &token, &dc_type, &rc_idx))) {
-		pthread_mutex_lock(&redis_conn->lock);
-		if (redis_conn->status) {
-			reply = redisCommand(redis_conn->ctx, "DECR %s", key);
-			if (reply && reply->type != REDIS_REPLY_ERROR && redis_conn->ctx->err == 0) {
-				freeReplyObject(reply);
-				pthread_mutex_unlock(&redis_conn->lock);
-				return 0;
-			} else {
-				if (reply) {
-					freeReplyObject(reply);
-				}
-				reset_redis_connection(redis_conn);
-				pthread_mutex_unlock(&redis_conn->lock);
-			}
-		} else {
-			pthread_mutex_unlock(&redis_conn->lock);
-		}
-	}
-
-	return -1;
+	return command_status(command_exec(dynoc, key, 0, "DECR %s", key));
 }
 
 int
@@ -482,34 +535,5 @@ dynoc_decrby(struct dynoc *dynoc, const char *key, int val) {
 		return -1;
 	}
 
-	struct token token;
-	struct redis_connection *redis_conn;
-	redisReply *reply;
-	dc_type_t dc_type = LOCAL_DC;
-	uint32_t rc_idx = 0;
-
-	token_init(&token);
-
-	while ((redis_conn = select_connection(dynoc, key, &token, &dc_type, &rc_idx))) {
-		pthread_mutex_lock(&redis_conn->lock);
-		if (redis_conn->status) {
-			reply = redisCommand(redis_conn->ctx, "DECRBY %s %d", key, val);
-			if (reply && reply->type != REDIS_REPLY_ERROR && redis_conn->ctx->err == 0) {
-				freeReplyObject(reply);
-				pthread_mutex_unlock(&redis_conn->lock);
-				return 0;
-			} else {
-				if (reply) {
-					freeReplyObject(reply);
-				}
-				reset_redis_connection(redis_conn);
-				pthread_mutex_unlock(&redis_conn->lock);
-			}
-		} else {
-			pthread_mutex_unlock(&redis_conn->lock);
-		}
-	}
-
-	return -1;
+	return command_status(command_exec(dynoc, key, 0, "DECRBY %s %d", key, val));
 }
-
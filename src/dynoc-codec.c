@@ -0,0 +1,176 @@
+/*
+ * Dynoc is a minimalistic C client library for the dynomite.
+ * Copyright (C) 2016-2017 huya.com, Lampman Yao
+ */
+
+/*
+ * Dynomite - A thin, distributed replication layer for multi non-distributed storages.
+ * Copyright (C) 2014 Netflix, Inc.
+ */
+
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "dynoc-codec.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFINE_ACTION(_id, _name)                                                   \
+	size_t codec_##_name##_bound(size_t len);                                   \
+	int codec_##_name##_compress(const char *src, size_t len, char *dst, size_t cap); \
+	int codec_##_name##_decompress(const char *src, size_t len, char *dst, size_t cap);
+VALUE_CODEC(DEFINE_ACTION)
+#undef DEFINE_ACTION
+
+#define DEFINE_ACTION(_id, _name) \
+	{ _id, #_name, codec_##_name##_bound, codec_##_name##_compress, codec_##_name##_decompress },
+static const struct value_codec codecs[] = {
+	VALUE_CODEC(DEFINE_ACTION)
+	{ 0, NULL, NULL, NULL, NULL }
+};
+#undef DEFINE_ACTION
+
+const struct value_codec *
+get_codec(const char *codec_name) {
+	const struct value_codec *codec;
+
+	for (codec = codecs; codec->name; codec++) {
+		if (strcmp(codec->name, codec_name) == 0) {
+			return codec;
+		}
+	}
+	return NULL;
+}
+
+const struct value_codec *
+get_codec_by_id(uint8_t id) {
+	const struct value_codec *codec;
+
+	for (codec = codecs; codec->name; codec++) {
+		if (codec->id == id) {
+			return codec;
+		}
+	}
+	return NULL;
+}
+
+int
+value_encode(const struct value_codec *codec, size_t threshold,
+             const char *data, size_t len, struct value *value) {
+	size_t cap;
+	int n;
+
+	value->data = data;
+	value->len = len;
+	value->buf = NULL;
+
+	if (!codec || len < threshold || len > CODEC_MAX_LEN) {
+		return 0;
+	}
+
+	cap = CODEC_HEADER_LEN + codec->bound(len);
+	value->buf = malloc(cap);
+	if (!value->buf) {
+		return -1;
+	}
+
+	n = codec->compress(data, len, value->buf + CODEC_HEADER_LEN, cap - CODEC_HEADER_LEN);
+	if (n < 0 || (size_t)n + CODEC_HEADER_LEN >= len) {
+		/* Not worth it, store the value as is. */
+		free(value->buf);
+		value->buf = NULL;
+		return 0;
+	}
+
+	value->buf[0] = CODEC_MAGIC;
+	value->buf[1] = (char)CODEC_MAGIC2;
+	value->buf[2] = codec->id;
+	value->buf[3] = len & 0xff;
+	value->buf[4] = (len >> 8) & 0xff;
+	value->buf[5] = (len >> 16) & 0xff;
+	value->buf[6] = (len >> 24) & 0xff;
+
+	value->data = value->buf;
+	value->len = CODEC_HEADER_LEN + n;
+	return 0;
+}
+
+void
+value_free(struct value *value) {
+	if (value->buf) {
+		free(value->buf);
+		value->buf = NULL;
+	}
+}
+
+const struct value_codec *
+value_header(const struct value_codec *codec, const char *data, size_t len, size_t *rawlen) {
+	const uint8_t *p = (const uint8_t *)data;
+	const struct value_codec *c;
+	size_t n;
+
+	if (len < CODEC_HEADER_LEN || p[0] != CODEC_MAGIC || p[1] != CODEC_MAGIC2) {
+		return NULL;
+	}
+
+	c = get_codec_by_id(p[2]);
+	if (!c && codec && codec->id == p[2]) {
+		c = codec;
+	}
+	if (!c) {
+		return NULL;
+	}
+
+	/* value_encode() only keeps payloads that shrank the value. */
+	n = p[3] | (p[4] << 8) | (p[5] << 16) | ((size_t)p[6] << 24);
+	if (n > CODEC_MAX_LEN || len >= n || len - CODEC_HEADER_LEN > c->bound(n)) {
+		return NULL;
+	}
+
+	*rawlen = n;
+	return c;
+}
+
+int
+value_decode(const struct value_codec *codec, const char *data, size_t len, char **out, size_t *outlen) {
+	const struct value_codec *c;
+	size_t rawlen;
+	char *buf;
+	int n;
+
+	c = value_header(codec, data, len, &rawlen);
+	if (!c) {
+		return -1;
+	}
+
+	buf = malloc(rawlen + 1);
+	if (!buf) {
+		return -1;
+	}
+
+	n = c->decompress(data + CODEC_HEADER_LEN, len - CODEC_HEADER_LEN, buf, rawlen);
+	if (n < 0 || (size_t)n != rawlen) {
+		free(buf);
+		return -1;
+	}
+
+	buf[rawlen] = '\0';
+	*out = buf;
+	*outlen = rawlen;
+	return 0;
+}
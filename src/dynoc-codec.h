@@ -0,0 +1,93 @@
+/*
+ * Dynoc is a minimalistic C client library for the dynomite.
+ * Copyright (C) 2016-2017 huya.com, Lampman Yao
+ */
+
+/*
+ * Dynomite - A thin, distributed replication layer for multi non-distributed storages.
+ * Copyright (C) 2014 Netflix, Inc.
+ */
+
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Value codecs.
+ * A compressed value is stored as a 7 byte header followed by the codec
+ * payload: two magic bytes (a zero byte, which values written through the
+ * C string API can never start with, then 0xdc), the codec id and the
+ * original length as 32 bit little endian. Values below the threshold or
+ * that do not shrink are stored verbatim, so compressed and plain values
+ * can be mixed freely. Binary values written through the iov/stream API
+ * are never compressed; value_header() tells the two apart.
+ *
+ * compress() and decompress() return the number of bytes written to `dst`,
+ * or -1 if it does not fit in `cap` (or the input is corrupt).
+ */
+#define CODEC_MAGIC      0x00
+#define CODEC_MAGIC2     0xdc
+#define CODEC_HEADER_LEN 7
+#define CODEC_MAX_LEN    (512 * 1024 * 1024)
+
+struct value_codec {
+	uint8_t id;
+	const char *name;
+	size_t (*bound)(size_t len);
+	int (*compress)(const char *src, size_t len, char *dst, size_t cap);
+	int (*decompress)(const char *src, size_t len, char *dst, size_t cap);
+};
+
+/* Built in codecs: ACTION(id, name), implemented in codec-<name>.c */
+#define VALUE_CODEC(ACTION) \
+	ACTION(1, lz)       \
+
+const struct value_codec *get_codec(const char *codec_name);
+const struct value_codec *get_codec_by_id(uint8_t id);
+
+/*
+ * An encoded value ready to be sent with "%b". `data` points either at the
+ * caller's value or at `buf`, which value_free() releases.
+ */
+struct value {
+	const char *data;
+	size_t len;
+	char *buf;
+};
+
+/* `codec` may be NULL to store values verbatim. */
+int value_encode(const struct value_codec *codec, size_t threshold, const char *data, size_t len, struct value *value);
+void value_free(struct value *value);
+
+/*
+ * Return the codec of a stored value if it starts with a well formed codec
+ * header: both magic bytes, a known codec id and an original length within
+ * CODEC_MAX_LEN that `len` bytes could have been compressed from. Returns
+ * NULL for anything else, which is a plain value. `codec` is as below.
+ */
+const struct value_codec *value_header(const struct value_codec *codec, const char *data, size_t len, size_t *rawlen);
+
+/*
+ * Decode a stored value carrying a codec header into a new NUL terminated
+ * buffer. `codec` is consulted besides the built in codecs so values
+ * written with a registered codec can be read back.
+ */
+int value_decode(const struct value_codec *codec, const char *data, size_t len, char **out, size_t *outlen);
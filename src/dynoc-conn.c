@@ -0,0 +1,1491 @@
+/*
+ * Dynoc is a minimalistic C client library for the dynomite.
+ * Copyright (C) 2016-2017 huya.com, Lampman Yao
+ */
+
+/*
+ * Dynomite - A thin, distributed replication layer for multi non-distributed storages.
+ * Copyright (C) 2014 Netflix, Inc.
+ */
+
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "dynoc-debug.h"
+#include "dynoc-conn.h"
+#include "dynoc-uring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+void
+reset_redis_connection(struct redis_connection *redis_conn) {
+	redis_conn->status = INVALID;
+	redis_conn->pending = 0;
+	redis_conn->nscripts = 0;
+	redisFree(redis_conn->ctx);
+	redis_conn->ctx = NULL;
+}
+
+int
+connection_drain(struct redis_connection *redis_conn) {
+	void *reply;
+
+	while (redis_conn->pending) {
+		if (redisGetReply(redis_conn->ctx, &reply) == REDIS_ERR) {
+			log_debug("drain failed: %s", redis_conn->ctx->errstr);
+			reset_redis_connection(redis_conn);
+			return -1;
+		}
+		freeReplyObject(reply);
+		redis_conn->pending--;
+	}
+	return 0;
+}
+
+enum attempt_state {
+	ATTEMPT_CONNECTING,
+	ATTEMPT_AUTH_WRITE,
+	ATTEMPT_AUTH_READ,
+	ATTEMPT_DONE,
+	ATTEMPT_FAILED
+};
+
+int64_t
+now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int
+set_blocking(int fd, int blocking) {
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags < 0) {
+		return -1;
+	}
+	flags = blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+	return fcntl(fd, F_SETFL, flags);
+}
+
+static void
+attempt_fail(struct conn_attempt *attempt) {
+	log_debug("connect to %s:%d failed", attempt->endpoint->host, attempt->endpoint->port);
+	if (attempt->fd >= 0) {
+		close(attempt->fd);
+		attempt->fd = -1;
+	}
+	attempt->state = ATTEMPT_FAILED;
+}
+
+static void
+set_option(int fd, int level, int name, int value, const char *what) {
+	if (setsockopt(fd, level, name, &value, sizeof(value)) < 0) {
+		log_debug("setsockopt %s=%d failed: %s", what, value, strerror(errno));
+	}
+}
+
+/* Applied before connect() so the buffer sizes shape the TCP window. */
+static void
+socket_options_apply(int fd, const struct socket_options *opts, int tcp) {
+	if (opts->rcvbuf) {
+		set_option(fd, SOL_SOCKET, SO_RCVBUF, opts->rcvbuf, "SO_RCVBUF");
+	}
+	if (opts->sndbuf) {
+		set_option(fd, SOL_SOCKET, SO_SNDBUF, opts->sndbuf, "SO_SNDBUF");
+	}
+	if (!tcp) {
+		return;
+	}
+
+	if (opts->nodelay) {
+		set_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+	}
+	if (opts->keepalive) {
+		set_option(fd, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+		if (opts->keepidle) {
+			set_option(fd, IPPROTO_TCP, TCP_KEEPIDLE, opts->keepidle, "TCP_KEEPIDLE");
+		}
+		if (opts->keepintvl) {
+			set_option(fd, IPPROTO_TCP, TCP_KEEPINTVL, opts->keepintvl, "TCP_KEEPINTVL");
+		}
+		if (opts->keepcnt) {
+			set_option(fd, IPPROTO_TCP, TCP_KEEPCNT, opts->keepcnt, "TCP_KEEPCNT");
+		}
+	}
+	if (opts->user_timeout) {
+		set_option(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, opts->user_timeout, "TCP_USER_TIMEOUT");
+	}
+	if (opts->busy_poll) {
+		set_option(fd, SOL_SOCKET, SO_BUSY_POLL, opts->busy_poll, "SO_BUSY_POLL");
+	}
+	if (opts->incoming_cpu >= 0) {
+		set_option(fd, SOL_SOCKET, SO_INCOMING_CPU, opts->incoming_cpu, "SO_INCOMING_CPU");
+	}
+}
+
+static int
+get_option(int fd, int level, int name) {
+	socklen_t len;
+	int value = 0;
+
+	len = sizeof(value);
+	if (getsockopt(fd, level, name, &value, &len) < 0) {
+		return 0;
+	}
+	return value;
+}
+
+/* What the kernel actually uses, for dynoc_stats(). */
+static void
+socket_options_read(int fd, struct socket_options *opts, int tcp) {
+	memset(opts, 0, sizeof(*opts));
+	opts->rcvbuf = get_option(fd, SOL_SOCKET, SO_RCVBUF);
+	opts->sndbuf = get_option(fd, SOL_SOCKET, SO_SNDBUF);
+	opts->incoming_cpu = -1;
+	if (!tcp) {
+		return;
+	}
+
+	opts->nodelay = get_option(fd, IPPROTO_TCP, TCP_NODELAY);
+	opts->keepalive = get_option(fd, SOL_SOCKET, SO_KEEPALIVE);
+	opts->keepidle = get_option(fd, IPPROTO_TCP, TCP_KEEPIDLE);
+	opts->keepintvl = get_option(fd, IPPROTO_TCP, TCP_KEEPINTVL);
+	opts->keepcnt = get_option(fd, IPPROTO_TCP, TCP_KEEPCNT);
+	opts->user_timeout = get_option(fd, IPPROTO_TCP, TCP_USER_TIMEOUT);
+	opts->busy_poll = get_option(fd, SOL_SOCKET, SO_BUSY_POLL);
+	opts->incoming_cpu = get_option(fd, SOL_SOCKET, SO_INCOMING_CPU);
+}
+
+static int
+unix_connect(const char *path, const struct socket_options *opts) {
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	socket_options_apply(fd, opts, 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * A lookup runs on a detached thread so that waiting for it can time out.
+ * The job is shared by that thread and its endpoint and freed by the last
+ * of the two to let go, both under resolve_lock; only the caller of
+ * resolve_endpoints() copies a result into the endpoint.
+ */
+struct resolve_job {
+	int refs;
+	int done;
+	int ok;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	char *host;
+	int port;
+};
+
+static pthread_mutex_t resolve_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolve_cond = PTHREAD_COND_INITIALIZER;
+
+static void
+resolve_job_release(struct resolve_job *job) {
+	if (--job->refs == 0) {
+		free(job->host);
+		free(job);
+	}
+}
+
+static void *
+resolve_thread(void *arg) {
+	struct resolve_job *job = arg;
+	struct addrinfo hints, *res = NULL;
+	char port[8];
+	int rv;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(port, sizeof(port), "%d", job->port);
+	rv = getaddrinfo(job->host, port, &hints, &res);
+
+	pthread_mutex_lock(&resolve_lock);
+	if (rv == 0) {
+		memcpy(&job->addr, res->ai_addr, res->ai_addrlen);
+		job->addrlen = res->ai_addrlen;
+		job->ok = 1;
+	} else {
+		log_debug("cannot resolve %s:%d", job->host, job->port);
+	}
+	job->done = 1;
+	pthread_cond_broadcast(&resolve_cond);
+	resolve_job_release(job);
+	pthread_mutex_unlock(&resolve_lock);
+
+	if (res) {
+		freeaddrinfo(res);
+	}
+	return NULL;
+}
+
+static void
+resolve_start(struct endpoint *endpoint) {
+	struct resolve_job *job;
+	pthread_attr_t attr;
+	pthread_t tid;
+
+	job = calloc(1, sizeof(*job));
+	if (!job) {
+		return;
+	}
+	job->host = strdup(endpoint->host);
+	if (!job->host) {
+		free(job);
+		return;
+	}
+	job->port = endpoint->port;
+	job->refs = 2;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&tid, &attr, resolve_thread, job) != 0) {
+		/* A failed lookup, tried again next time. */
+		job->refs = 1;
+		job->done = 1;
+	}
+	pthread_attr_destroy(&attr);
+	endpoint->job = job;
+}
+
+/* Copies a finished lookup into its endpoint; resolve_lock is held. */
+static void
+resolve_finish(struct endpoint *endpoint) {
+	struct resolve_job *job = endpoint->job;
+
+	if (!job || !job->done) {
+		return;
+	}
+
+	if (job->ok) {
+		memcpy(&endpoint->addr, &job->addr, job->addrlen);
+		endpoint->addrlen = job->addrlen;
+		__atomic_store_n(&endpoint->resolved, 1, __ATOMIC_RELEASE);
+	}
+	endpoint->job = NULL;
+	resolve_job_release(job);
+}
+
+uint32_t
+resolve_endpoints(struct endpoint **endpoints, uint32_t nendpoint, int timeout_ms) {
+	struct timespec until;
+	uint32_t i, pending, resolved = 0;
+
+	for (i = 0; i < nendpoint; i++) {
+		if (!endpoints[i]->job) {
+			resolve_start(endpoints[i]);
+		}
+	}
+
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += timeout_ms / 1000;
+	until.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+	if (until.tv_nsec >= 1000000000) {
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&resolve_lock);
+	while (timeout_ms > 0) {
+		pending = 0;
+		for (i = 0; i < nendpoint; i++) {
+			if (endpoints[i]->job && !endpoints[i]->job->done) {
+				pending++;
+			}
+		}
+		if (!pending || pthread_cond_timedwait(&resolve_cond, &resolve_lock, &until) == ETIMEDOUT) {
+			break;
+		}
+	}
+	for (i = 0; i < nendpoint; i++) {
+		resolve_finish(endpoints[i]);
+		resolved += endpoints[i]->resolved;
+	}
+	pthread_mutex_unlock(&resolve_lock);
+	return resolved;
+}
+
+void
+resolve_cancel(struct endpoint *endpoint) {
+	if (endpoint->job) {
+		pthread_mutex_lock(&resolve_lock);
+		resolve_job_release(endpoint->job);
+		pthread_mutex_unlock(&resolve_lock);
+		endpoint->job = NULL;
+	}
+}
+
+static void
+attempt_start(struct conn_attempt *attempt) {
+	const struct endpoint *endpoint = attempt->endpoint;
+	int fd, rv;
+
+	attempt->fd = -1;
+	attempt->state = ATTEMPT_FAILED;
+
+	if (endpoint->path) {
+		attempt->fd = unix_connect(endpoint->path, attempt->sockopts);
+		if (attempt->fd < 0) {
+			attempt_fail(attempt);
+			return;
+		}
+		attempt->state = ATTEMPT_CONNECTING;
+		return;
+	}
+
+	/* Not resolved yet: the health check resolves it before its next round. */
+	if (!__atomic_load_n(&endpoint->resolved, __ATOMIC_ACQUIRE)) {
+		attempt_fail(attempt);
+		return;
+	}
+
+	fd = socket(endpoint->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		attempt_fail(attempt);
+		return;
+	}
+
+	attempt->fd = fd;
+	socket_options_apply(fd, attempt->sockopts, 1);
+	rv = connect(fd, (const struct sockaddr *)&endpoint->addr, endpoint->addrlen);
+
+	if (rv < 0 && errno != EINPROGRESS) {
+		attempt_fail(attempt);
+		return;
+	}
+	attempt->state = ATTEMPT_CONNECTING;
+}
+
+/* Advance one attempt as far as its socket allows without blocking. */
+static void
+attempt_drive(struct conn_attempt *attempt) {
+	char buf[256];
+	void *reply;
+	socklen_t len;
+	ssize_t n;
+	int err;
+
+	switch (attempt->state) {
+	case ATTEMPT_CONNECTING:
+		err = 0;
+		len = sizeof(err);
+		if (getsockopt(attempt->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+			attempt_fail(attempt);
+			return;
+		}
+		if (!attempt->endpoint->pass) {
+			attempt->state = ATTEMPT_DONE;
+			return;
+		}
+		attempt->auth_len = redisFormatCommand(&attempt->auth, "AUTH %s", attempt->endpoint->pass);
+		attempt->auth_off = 0;
+		if (attempt->auth_len < 0) {
+			attempt->auth = NULL;
+			attempt_fail(attempt);
+			return;
+		}
+		attempt->state = ATTEMPT_AUTH_WRITE;
+		/* fall through */
+
+	case ATTEMPT_AUTH_WRITE:
+		while (attempt->auth_off < attempt->auth_len) {
+			n = write(attempt->fd, attempt->auth + attempt->auth_off, attempt->auth_len - attempt->auth_off);
+			if (n < 0) {
+				if (errno == EAGAIN || errno == EINTR) {
+					return;
+				}
+				attempt_fail(attempt);
+				return;
+			}
+			attempt->auth_off += n;
+		}
+		attempt->reader = redisReaderCreate();
+		if (!attempt->reader) {
+			attempt_fail(attempt);
+			return;
+		}
+		attempt->state = ATTEMPT_AUTH_READ;
+		return;
+
+	case ATTEMPT_AUTH_READ:
+		n = read(attempt->fd, buf, sizeof(buf));
+		if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+			return;
+		}
+		if (n <= 0 || redisReaderFeed(attempt->reader, buf, n) != REDIS_OK) {
+			attempt_fail(attempt);
+			return;
+		}
+		reply = NULL;
+		if (redisReaderGetReply(attempt->reader, &reply) != REDIS_OK) {
+			attempt_fail(attempt);
+			return;
+		}
+		if (!reply) {
+			return;
+		}
+		if (((redisReply *)reply)->type == REDIS_REPLY_ERROR) {
+			log_debug("auth %s:%d failed", attempt->endpoint->host, attempt->endpoint->port);
+			attempt_fail(attempt);
+		} else {
+			attempt->state = ATTEMPT_DONE;
+		}
+		freeReplyObject(reply);
+		return;
+
+	default:
+		return;
+	}
+}
+
+static uint32_t
+attempt_events(struct conn_attempt *attempt) {
+	return attempt->state == ATTEMPT_AUTH_READ ? EPOLLIN : EPOLLOUT;
+}
+
+static int
+attempt_install(struct conn_attempt *attempt, int lock) {
+	struct redis_connection *redis_conn = attempt->redis_conn;
+	redisContext *ctx;
+
+	if (set_blocking(attempt->fd, 1) < 0) {
+		attempt_fail(attempt);
+		return -1;
+	}
+
+	ctx = redisConnectFd(attempt->fd);
+	if (!ctx || ctx->err) {
+		if (ctx) {
+			redisFree(ctx);
+			attempt->fd = -1;
+		}
+		attempt_fail(attempt);
+		return -1;
+	}
+	attempt->fd = -1;
+
+	if (lock) {
+		pthread_mutex_lock(&redis_conn->lock);
+	}
+	if (redis_conn->status) {
+		/* Someone else got there first. */
+		redisFree(ctx);
+	} else {
+		if (redis_conn->ctx) {
+			redisFree(redis_conn->ctx);
+		}
+		redis_conn->ctx = ctx;
+		socket_options_read(ctx->fd, &redis_conn->sockopts, !attempt->endpoint->path);
+		redis_conn->status = VALID;
+		redis_conn->cold = 0;
+		redis_conn->last_used = time(NULL);
+		redis_conn->timeout_ms = 0;
+	}
+	if (lock) {
+		pthread_mutex_unlock(&redis_conn->lock);
+	}
+
+	log_debug("connect to %s:%d ok", attempt->endpoint->host, attempt->endpoint->port);
+	return 0;
+}
+
+static uint32_t
+run_attempts(struct conn_attempt *attempts, uint32_t nattempt, int timeout_ms, int lock) {
+	struct epoll_event events[64], ev;
+	struct dynoc *pinned = NULL;
+	int64_t deadline = now_ms() + timeout_ms, left;
+	uint32_t pending = 0, nconnected = 0, i;
+	int epfd, n, j;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		return 0;
+	}
+
+	for (i = 0; i < nattempt; i++) {
+		struct conn_attempt *attempt = &attempts[i];
+
+		attempt->auth = NULL;
+		attempt->reader = NULL;
+		attempt_start(attempt);
+		if (attempt->state == ATTEMPT_FAILED) {
+			continue;
+		}
+
+		ev.events = attempt_events(attempt);
+		ev.data.ptr = attempt;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, attempt->fd, &ev) < 0) {
+			attempt_fail(attempt);
+			continue;
+		}
+		pending++;
+	}
+
+	while (pending && (left = deadline - now_ms()) > 0) {
+		n = epoll_wait(epfd, events, 64, (int)left);
+		if (n < 0 && errno != EINTR) {
+			break;
+		}
+
+		for (j = 0; j < n; j++) {
+			struct conn_attempt *attempt = events[j].data.ptr;
+			int fd = attempt->fd;
+			uint32_t before = attempt_events(attempt);
+
+			attempt_drive(attempt);
+
+			if (attempt->state == ATTEMPT_DONE || attempt->state == ATTEMPT_FAILED) {
+				if (attempt->fd >= 0) {
+					epoll_ctl(epfd, EPOLL_CTL_DEL, attempt->fd, NULL);
+				}
+				pending--;
+			} else if (attempt_events(attempt) != before) {
+				ev.events = attempt_events(attempt);
+				ev.data.ptr = attempt;
+				epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+			}
+		}
+	}
+
+	close(epfd);
+
+	for (i = 0; i < nattempt; i++) {
+		struct conn_attempt *attempt = &attempts[i];
+
+		if (attempt->state == ATTEMPT_DONE) {
+			if (attempt->dynoc) {
+				numa_run_on(attempt->dynoc, attempt->shard);
+				pinned = attempt->dynoc;
+			}
+			if (attempt_install(attempt, lock) == 0) {
+				nconnected++;
+			}
+		} else if (attempt->state != ATTEMPT_FAILED) {
+			log_debug("connect to %s:%d timed out", attempt->endpoint->host, attempt->endpoint->port);
+			attempt_fail(attempt);
+		}
+
+		if (attempt->auth) {
+			free(attempt->auth);
+			attempt->auth = NULL;
+		}
+		if (attempt->reader) {
+			redisReaderFree(attempt->reader);
+			attempt->reader = NULL;
+		}
+	}
+	if (pinned) {
+		numa_run_anywhere(pinned);
+	}
+
+	return nconnected;
+}
+
+uint32_t
+connect_nodes(struct conn_attempt *attempts, uint32_t nattempt, int timeout_ms) {
+	return run_attempts(attempts, nattempt, timeout_ms, 1);
+}
+
+/*
+ * Commands are synchronous, so the deadline of the command a thread is
+ * running can live in thread local storage; select_connection() starts
+ * it on the first attempt and checks it on every failover.
+ */
+static __thread struct {
+	const struct dynoc *dynoc;
+	int64_t deadline;
+	int64_t cmd_deadline;
+} thread_deadline;
+
+int
+dynoc_set_deadline(struct dynoc *dynoc, int timeout_ms) {
+	if (timeout_ms < 0) {
+		return -1;
+	}
+
+	thread_deadline.dynoc = dynoc;
+	thread_deadline.deadline = timeout_ms ? now_ms() + timeout_ms : 0;
+	return 0;
+}
+
+static void
+command_begin(struct dynoc *dynoc) {
+	int64_t deadline = 0;
+
+	if (dynoc->command_timeout) {
+		deadline = now_ms() + dynoc->command_timeout;
+	}
+
+	if (thread_deadline.dynoc == dynoc && thread_deadline.deadline &&
+	    (!deadline || thread_deadline.deadline < deadline)) {
+		deadline = thread_deadline.deadline;
+	}
+
+	thread_deadline.cmd_deadline = deadline;
+}
+
+int64_t
+command_remaining(void) {
+	int64_t left;
+
+	if (!thread_deadline.cmd_deadline) {
+		return -1;
+	}
+
+	left = thread_deadline.cmd_deadline - now_ms();
+	return left > 0 ? left : 0;
+}
+
+/*
+ * Per thread override of the consistency levels, scoped to one client like
+ * the deadline above.
+ */
+static __thread struct {
+	const struct dynoc *dynoc;
+	consistency_t write;
+	consistency_t read;
+} thread_consistency;
+
+static int
+set_thread_consistency(struct dynoc *dynoc, consistency_t level, int write) {
+	if (level < CONSISTENCY_DEFAULT || level > CONSISTENCY_ALL) {
+		return -1;
+	}
+
+	if (thread_consistency.dynoc != dynoc) {
+		thread_consistency.dynoc = dynoc;
+		thread_consistency.write = CONSISTENCY_DEFAULT;
+		thread_consistency.read = CONSISTENCY_DEFAULT;
+	}
+
+	if (write) {
+		thread_consistency.write = level;
+	} else {
+		thread_consistency.read = level;
+	}
+	return 0;
+}
+
+int
+dynoc_set_write_consistency(struct dynoc *dynoc, consistency_t level) {
+	return set_thread_consistency(dynoc, level, 1);
+}
+
+int
+dynoc_set_read_consistency(struct dynoc *dynoc, consistency_t level) {
+	return set_thread_consistency(dynoc, level, 0);
+}
+
+consistency_t
+write_consistency(struct dynoc *dynoc) {
+	if (thread_consistency.dynoc == dynoc && thread_consistency.write != CONSISTENCY_DEFAULT) {
+		return thread_consistency.write;
+	}
+	return dynoc->write_consistency;
+}
+
+consistency_t
+read_consistency(struct dynoc *dynoc) {
+	if (thread_consistency.dynoc == dynoc && thread_consistency.read != CONSISTENCY_DEFAULT) {
+		return thread_consistency.read;
+	}
+	return dynoc->read_consistency;
+}
+
+uint32_t
+consistency_acks(consistency_t level, uint32_t nrack) {
+	switch (level) {
+	case CONSISTENCY_ALL:
+		return nrack;
+	case CONSISTENCY_QUORUM:
+		return nrack / 2 + 1;
+	default:
+		return 1;
+	}
+}
+
+void
+connection_set_timeout(struct redis_connection *redis_conn, int timeout_ms) {
+	struct timeval tv;
+
+	if (redis_conn->timeout_ms == timeout_ms) {
+		return;
+	}
+
+	tv.tv_sec = timeout_ms / 1000;
+	tv.tv_usec = (timeout_ms % 1000) * 1000;
+	if (redisSetTimeout(redis_conn->ctx, tv) == REDIS_OK) {
+		redis_conn->timeout_ms = timeout_ms;
+	}
+}
+
+static int
+connection_open(struct dynoc *dynoc, struct redis_connection *redis_conn) {
+	struct conn_attempt attempt;
+	int64_t left = command_remaining();
+	int timeout;
+
+	if (redis_conn->status) {
+		if (dynoc->idle_timeout) {
+			redis_conn->last_used = time(NULL);
+		}
+		/* A spent deadline still gets 1ms rather than "no timeout". */
+		connection_set_timeout(redis_conn, left < 0 ? 0 : (left ? (int)left : 1));
+		return 1;
+	}
+
+	if (!redis_conn->cold) {
+		return 0;
+	}
+
+	/*
+	 * Cold -> warm happens once, under the lock. If it fails the node is
+	 * handed to the reconnect thread like any other broken node.
+	 */
+	redis_conn->cold = 0;
+	attempt.redis_conn = redis_conn;
+	attempt.endpoint = redis_conn->endpoint;
+	attempt.sockopts = &dynoc->sockopts;
+	attempt.dynoc = NULL;
+	timeout = dynoc->connect_timeout;
+	if (left >= 0 && left < timeout) {
+		timeout = (int)left;
+	}
+	if (run_attempts(&attempt, 1, timeout, 0) != 1) {
+		return 0;
+	}
+
+	connection_set_timeout(redis_conn, left < 0 ? 0 : (left ? (int)left : 1));
+	return 1;
+}
+
+int
+connection_ready(struct dynoc *dynoc, struct redis_connection *redis_conn) {
+	return connection_open(dynoc, redis_conn) && connection_drain(redis_conn) == 0;
+}
+
+static uint32_t
+select_continuum(struct continuum *continuum, uint32_t ncontinuum, struct token *token) {
+	struct continuum *left, *right, *middle;
+
+	left = continuum;
+	right = continuum + ncontinuum - 1;
+
+	if (token_cmp(&right->token, token) < 0 || token_cmp(&left->token, token) >= 0) {
+		return left->index;
+	}
+
+	while (left < right) {
+		middle = left + (right - left) / 2;
+		int32_t cmp = token_cmp(&middle->token, token);
+		if (cmp == 0) {
+			return middle->index;
+		} else if (cmp < 0) {
+			left = middle + 1;
+		} else {
+			right = middle;
+		}
+	}
+
+	return right->index;
+}
+
+size_t
+key_hash_tag(struct dynoc *dynoc, const char *key, size_t len, const char **tag) {
+	const char *start, *end;
+
+	if (!dynoc->hash_tag[0]) {
+		return 0;
+	}
+
+	start = memchr(key, dynoc->hash_tag[0], len);
+	if (!start) {
+		return 0;
+	}
+	start++;
+
+	end = memchr(start, dynoc->hash_tag[1], len - (start - key));
+	if (!end || end == start) {
+		return 0;
+	}
+
+	if (tag) {
+		*tag = start;
+	}
+	return end - start;
+}
+
+static uint32_t
+key_hash_len(struct dynoc *dynoc, const char *key, size_t len) {
+	size_t taglen;
+	const char *tag;
+
+	taglen = key_hash_tag(dynoc, key, len, &tag);
+	if (taglen) {
+		return dynoc->hash_func(tag, taglen);
+	}
+	return dynoc->hash_func(key, len);
+}
+
+static uint32_t
+key_hash(struct dynoc *dynoc, const char *key) {
+	return key_hash_len(dynoc, key, strlen(key));
+}
+
+/*
+ * The `nth` rack to try for `token`. The first rack whose owner of the
+ * token is co-located (a unix socket endpoint) is moved to the front, the
+ * others keep their order.
+ */
+static uint32_t
+rack_order(struct datacenter *dc, struct token *token, uint32_t nth) {
+	struct rack *rack;
+	uint32_t first, index;
+
+	for (first = 0; first < dc->rack_count; first++) {
+		rack = &dc->rack[first];
+		if (rack->nunix) {
+			index = select_continuum(rack->continuum, rack->ncontinuum, token);
+			if (rack->endpoints[index].path) {
+				break;
+			}
+		}
+	}
+
+	if (first == dc->rack_count || nth > first) {
+		return nth;
+	}
+	return nth == 0 ? first : nth - 1;
+}
+
+struct redis_connection*
+select_connection(struct dynoc *dynoc, const char *key,
+                  struct token *token, dc_type_t *dc_type, uint32_t *rc_idx) {
+	return select_shard_connection(dynoc, numa_current(dynoc), key, token, dc_type, rc_idx);
+}
+
+struct redis_connection*
+select_shard_connection(struct dynoc *dynoc, uint32_t shard, const char *key,
+                        struct token *token, dc_type_t *dc_type, uint32_t *rc_idx) {
+	uint32_t index, hash;
+	struct datacenter *dc;
+	struct rack *rack;
+
+	if (*dc_type == LOCAL_DC && *rc_idx == 0) {
+		command_begin(dynoc);
+	}
+
+	if (command_remaining() == 0) {
+		log_debug("deadline exceeded for %s", key);
+		return NULL;
+	}
+
+	token_parse(key, strlen(key), token);
+	hash = key_hash(dynoc, key);
+	token_size(token, 1);
+	token_set_int(token, hash);
+
+	dc = *dc_type ? dynoc->local_dc : dynoc->remote_dc;
+
+	if (!dc) {
+		return NULL;
+	}
+
+	if (*rc_idx >= dc->rack_count) {
+		if (*dc_type == LOCAL_DC) {
+			*dc_type = REMOTE_DC;
+			*rc_idx = 0;
+			dc = dynoc->remote_dc;
+		} else {
+			return NULL;
+		}
+	}
+
+	if (!dc) {
+		return NULL;
+	}
+
+	rack = &dc->rack[rack_order(dc, token, (*rc_idx)++)];
+	index = select_continuum(rack->continuum, rack->ncontinuum, token);
+	return &rack->shards[shard][index];
+}
+
+int
+select_remaining(struct dynoc *dynoc, dc_type_t dc_type, uint32_t rc_idx) {
+	if (dc_type == LOCAL_DC) {
+		if (!dynoc->local_dc) {
+			return 0;
+		}
+		if (rc_idx < dynoc->local_dc->rack_count) {
+			return 1;
+		}
+		rc_idx = 0;
+	}
+	return dynoc->remote_dc && rc_idx < dynoc->remote_dc->rack_count;
+}
+
+uint32_t
+select_rack_connections(struct dynoc *dynoc, const char *key, struct redis_connection **conns) {
+	struct datacenter *dc = dynoc->local_dc;
+	struct token token;
+	struct rack *rack;
+	uint32_t i, index, shard;
+
+	command_begin(dynoc);
+
+	if (!dc) {
+		return 0;
+	}
+
+	token_init(&token);
+	token_size(&token, 1);
+	token_set_int(&token, key_hash(dynoc, key));
+	shard = numa_current(dynoc);
+
+	for (i = 0; i < dc->rack_count; i++) {
+		rack = &dc->rack[i];
+		index = select_continuum(rack->continuum, rack->ncontinuum, &token);
+		conns[i] = &rack->shards[shard][index];
+	}
+
+	return dc->rack_count;
+}
+
+struct redis_connection *
+rack_owner(struct dynoc *dynoc, struct rack *rack, const char *key, size_t len) {
+	struct token token;
+
+	token_init(&token);
+	token_size(&token, 1);
+	token_set_int(&token, key_hash_len(dynoc, key, len));
+	return &rack->redis_conn_pool[select_continuum(rack->continuum, rack->ncontinuum, &token)];
+}
+
+int
+conn_request_format(struct conn_request *req, const char *format, ...) {
+	va_list ap;
+
+	va_start(ap, format);
+	req->len = redisvFormatCommand(&req->cmd, format, ap);
+	va_end(ap);
+
+	req->reply = NULL;
+	if (req->len < 0) {
+		req->cmd = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+void
+conn_request_reset(struct conn_request *req) {
+	if (req->cmd) {
+		free(req->cmd);
+		req->cmd = NULL;
+	}
+	if (req->reply) {
+		freeReplyObject(req->reply);
+		req->reply = NULL;
+	}
+}
+
+static int
+slot_cmp(const void *p1, const void *p2) {
+	const struct redis_connection *c1 = ((const struct pipeline_slot *)p1)->redis_conn;
+	const struct redis_connection *c2 = ((const struct pipeline_slot *)p2)->redis_conn;
+	return c1 < c2 ? -1 : (c1 > c2 ? 1 : 0);
+}
+
+struct pipeline_slot *
+pipeline_slot_find(struct pipeline_slot *slots, uint32_t nslot, const struct redis_connection *redis_conn) {
+	struct pipeline_slot key;
+
+	key.redis_conn = (struct redis_connection *)redis_conn;
+	return bsearch(&key, slots, nslot, sizeof(*slots), slot_cmp);
+}
+
+void
+pipeline_slot_fail(struct pipeline_slot *slot, const char *what) {
+	log_debug("pipeline %s failed: %s", what, slot->redis_conn->ctx->errstr);
+	reset_redis_connection(slot->redis_conn);
+	slot->stale = 0;
+	slot->inflight = 0;
+}
+
+uint32_t
+pipeline_slot_replies(struct pipeline_slot *slot, struct conn_request *reqs) {
+	redisContext *ctx = slot->redis_conn->ctx;
+	uint32_t nreply = 0;
+	void *reply;
+
+	while (slot->inflight) {
+		reply = NULL;
+		if (redisGetReplyFromReader(ctx, &reply) == REDIS_ERR) {
+			pipeline_slot_fail(slot, "read");
+			break;
+		}
+		if (!reply) {
+			break;
+		}
+
+		slot->inflight--;
+		if (slot->stale) {
+			slot->stale--;
+			freeReplyObject(reply);
+			continue;
+		}
+
+		while (reqs[slot->next].redis_conn != slot->redis_conn || !reqs[slot->next].sent) {
+			slot->next++;
+		}
+		reqs[slot->next++].reply = reply;
+		nreply++;
+	}
+	return nreply;
+}
+
+/* Flush the output buffers with write() and wait for replies with poll(). */
+static uint32_t
+poll_pipeline_io(struct pipeline_slot *slots, uint32_t nslot, struct conn_request *reqs, uint32_t nreq,
+                 pipeline_done_t done, void *arg) {
+	struct pollfd *pfds;
+	uint32_t nreply = 0, npfd, i;
+	int64_t left;
+	int flushed, rv;
+
+	pfds = malloc(nslot * sizeof(*pfds));
+	if (!pfds) {
+		for (i = 0; i < nslot; i++) {
+			if (slots[i].inflight) {
+				pipeline_slot_fail(&slots[i], "setup");
+			}
+		}
+		return 0;
+	}
+
+	for (i = 0; i < nslot; i++) {
+		if (slots[i].inflight == slots[i].stale) {
+			continue;
+		}
+		do {
+			if (redisBufferWrite(slots[i].redis_conn->ctx, &flushed) == REDIS_ERR) {
+				pipeline_slot_fail(&slots[i], "write");
+				break;
+			}
+		} while (!flushed);
+	}
+
+	while (!done || !done(reqs, nreq, arg)) {
+		for (i = 0, npfd = 0; i < nslot; i++) {
+			if (slots[i].inflight) {
+				pfds[npfd].fd = slots[i].redis_conn->ctx->fd;
+				pfds[npfd].events = POLLIN;
+				pfds[npfd].revents = 0;
+				npfd++;
+			}
+		}
+		if (!npfd) {
+			break;
+		}
+
+		left = command_remaining();
+		rv = poll(pfds, npfd, left < 0 ? -1 : (int)left);
+		if (rv < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rv <= 0) {
+			log_debug("pipeline deadline exceeded");
+			break;
+		}
+
+		for (i = 0, npfd = 0; i < nslot; i++) {
+			if (!slots[i].inflight || !pfds[npfd++].revents) {
+				continue;
+			}
+			if (redisBufferRead(slots[i].redis_conn->ctx) == REDIS_ERR) {
+				pipeline_slot_fail(&slots[i], "read");
+				continue;
+			}
+			nreply += pipeline_slot_replies(&slots[i], reqs);
+		}
+	}
+
+	free(pfds);
+	return nreply;
+}
+
+uint32_t
+conn_pipeline_until(struct dynoc *dynoc, struct conn_request *reqs, uint32_t nreq,
+                    pipeline_done_t done, void *arg) {
+	struct pipeline_slot *slots, *slot;
+	struct uring *ring = NULL;
+	uint32_t nslot = 0, nreply, i, j;
+
+	slots = malloc(nreq * sizeof(*slots));
+	if (!slots) {
+		return 0;
+	}
+
+	for (i = 0; i < nreq; i++) {
+		reqs[i].reply = NULL;
+		reqs[i].sent = 0;
+		if (reqs[i].redis_conn && reqs[i].cmd) {
+			slots[nslot++].redis_conn = reqs[i].redis_conn;
+		}
+	}
+
+	/* Lock in address order so concurrent pipelines cannot deadlock. */
+	qsort(slots, nslot, sizeof(*slots), slot_cmp);
+	for (i = 0, j = 0; i < nslot; i++) {
+		if (j == 0 || slots[j - 1].redis_conn != slots[i].redis_conn) {
+			slots[j].redis_conn = slots[i].redis_conn;
+			slots[j].next = 0;
+			j++;
+		}
+	}
+	nslot = j;
+
+	/* Stale replies are not waited for here, a slow node must not hold up the rest. */
+	for (i = 0; i < nslot; i++) {
+		struct redis_connection *redis_conn = slots[i].redis_conn;
+		pthread_mutex_lock(&redis_conn->lock);
+		connection_open(dynoc, redis_conn);
+		slots[i].stale = redis_conn->pending;
+		slots[i].inflight = redis_conn->pending;
+		redis_conn->pending = 0;
+	}
+
+	if (dynoc->io_backend == IO_BACKEND_URING) {
+		ring = uring_thread_ring();
+	}
+
+	/* The io_uring backend sends the formatted commands as they are. */
+	for (i = 0; i < nreq; i++) {
+		struct redis_connection *redis_conn = reqs[i].redis_conn;
+		if (redis_conn && reqs[i].cmd && redis_conn->status) {
+			slot = pipeline_slot_find(slots, nslot, redis_conn);
+			if (!ring) {
+				redisAppendFormattedCommand(redis_conn->ctx, reqs[i].cmd, reqs[i].len);
+			}
+			reqs[i].sent = 1;
+			slot->inflight++;
+		}
+	}
+
+	/*
+	 * Wait for replies in whatever order the nodes send them, until all
+	 * are in, `done` is satisfied or the command deadline passes.
+	 */
+	if (ring) {
+		nreply = uring_pipeline_io(ring, slots, nslot, reqs, nreq, done, arg);
+	} else {
+		nreply = poll_pipeline_io(slots, nslot, reqs, nreq, done, arg);
+	}
+
+	/* Replies still on the way are discarded by the next user. */
+	for (i = 0; i < nslot; i++) {
+		slots[i].redis_conn->pending += slots[i].inflight;
+		pthread_mutex_unlock(&slots[i].redis_conn->lock);
+	}
+
+	free(slots);
+	return nreply;
+}
+
+uint32_t
+conn_pipeline_exec(struct dynoc *dynoc, struct conn_request *reqs, uint32_t nreq) {
+	return conn_pipeline_until(dynoc, reqs, nreq, NULL, NULL);
+}
+
+int
+key_request_format(struct key_request *req, const char *key, const char *format, ...) {
+	va_list ap;
+
+	va_start(ap, format);
+	req->len = redisvFormatCommand(&req->cmd, format, ap);
+	va_end(ap);
+
+	req->key = key;
+	req->unsafe = 0;
+	req->reply = NULL;
+	req->redis_conn = NULL;
+	if (req->len < 0) {
+		req->cmd = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+void
+key_request_reset(struct key_request *req) {
+	if (req->cmd) {
+		free(req->cmd);
+		req->cmd = NULL;
+	}
+	if (req->reply) {
+		freeReplyObject(req->reply);
+		req->reply = NULL;
+	}
+	req->redis_conn = NULL;
+}
+
+/* The deposit of `nreq` requests. */
+static void
+budget_deposit(struct dynoc *dynoc, int64_t *tokens, uint32_t nreq) {
+	int64_t cap = (int64_t)dynoc->retry.budget_reserve * RETRY_TOKEN;
+	int64_t room = cap - *tokens;
+	int64_t amount = (int64_t)nreq * dynoc->retry.budget_percent * RETRY_TOKEN / 100;
+
+	/* A full bucket, the normal case, costs a plain read. */
+	if (room > 0) {
+		__sync_fetch_and_add(tokens, amount < room ? amount : room);
+	}
+}
+
+static int
+budget_withdraw(int64_t *bucket) {
+	int64_t tokens;
+
+	while ((tokens = *bucket) >= RETRY_TOKEN) {
+		if (__sync_bool_compare_and_swap(bucket, tokens, tokens - RETRY_TOKEN)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+struct fanout_route {
+	struct token token;
+	dc_type_t dc_type;
+	uint32_t rc_idx;
+	/* Given up: out of racks or retry budget, or unsafe to resend. */
+	int lost;
+};
+
+int
+fanout_exec(struct dynoc *dynoc, struct key_request *reqs, uint32_t nreq) {
+	return fanout_exec_on(dynoc, reqs, nreq, numa_current(dynoc), &dynoc->retry_tokens);
+}
+
+int
+fanout_exec_on(struct dynoc *dynoc, struct key_request *reqs, uint32_t nreq, uint32_t shard, int64_t *tokens) {
+	struct fanout_route *routes;
+	struct conn_request *creqs;
+	uint32_t *creq_idx;
+	uint32_t remaining = 0, ncreq, i;
+	int ret = 0, lost = 0, round = 0;
+
+	routes = calloc(nreq, sizeof(*routes));
+	creqs = calloc(nreq, sizeof(*creqs));
+	creq_idx = calloc(nreq, sizeof(*creq_idx));
+	if (!routes || !creqs || !creq_idx) {
+		ret = -1;
+		goto out;
+	}
+
+	for (i = 0; i < nreq; i++) {
+		token_init(&routes[i].token);
+		routes[i].dc_type = LOCAL_DC;
+		if (reqs[i].cmd && !reqs[i].reply) {
+			remaining++;
+		}
+	}
+
+	budget_deposit(dynoc, tokens, remaining);
+
+	while (remaining) {
+		if (round++) {
+			if (dynoc->retry.max_retries >= 0 && round - 1 > dynoc->retry.max_retries) {
+				ret = -1;
+				goto out;
+			}
+			retry_backoff(dynoc, round - 1);
+		}
+
+		ncreq = 0;
+		for (i = 0; i < nreq; i++) {
+			struct fanout_route *route = &routes[i];
+			struct redis_connection *redis_conn;
+
+			if (!reqs[i].cmd || reqs[i].reply || route->lost) {
+				continue;
+			}
+
+			redis_conn = select_shard_connection(dynoc, shard, reqs[i].key, &route->token,
+			                                     &route->dc_type, &route->rc_idx);
+			if (!redis_conn) {
+				log_debug("no node left for %s", reqs[i].key);
+				route->lost = 1;
+				lost = 1;
+				remaining--;
+				continue;
+			}
+
+			creqs[ncreq].redis_conn = redis_conn;
+			creqs[ncreq].cmd = reqs[i].cmd;
+			creqs[ncreq].len = reqs[i].len;
+			creq_idx[ncreq++] = i;
+		}
+
+		conn_pipeline_exec(dynoc, creqs, ncreq);
+
+		for (i = 0; i < ncreq; i++) {
+			redisReply *reply = creqs[i].reply;
+			struct key_request *req = &reqs[creq_idx[i]];
+
+			if (reply && reply->type != REDIS_REPLY_ERROR) {
+				req->reply = reply;
+				req->redis_conn = creqs[i].redis_conn;
+				remaining--;
+			} else if (!reply && creqs[i].sent && req->unsafe && !dynoc->retry.retry_unsafe) {
+				/* It may have been applied, resending could apply it twice. */
+				log_debug("not retrying a non-idempotent command for %s", req->key);
+				routes[creq_idx[i]].lost = 1;
+				lost = 1;
+				remaining--;
+			} else {
+				if (reply) {
+					freeReplyObject(reply);
+				}
+				/* Otherwise only the budget applies, to this request alone. */
+				if (creqs[i].sent && !budget_withdraw(tokens)) {
+					log_debug("retry budget exhausted for %s", req->key);
+					routes[creq_idx[i]].lost = 1;
+					lost = 1;
+					remaining--;
+				}
+			}
+			creqs[i].reply = NULL;
+		}
+	}
+
+out:
+	free(creq_idx);
+	free(creqs);
+	free(routes);
+	return lost ? -1 : ret;
+}
+
+void
+retry_budget_deposit(struct dynoc *dynoc) {
+	budget_deposit(dynoc, &dynoc->retry_tokens, 1);
+}
+
+int
+retry_budget_withdraw(struct dynoc *dynoc) {
+	return budget_withdraw(&dynoc->retry_tokens);
+}
+
+void
+retry_backoff(struct dynoc *dynoc, int retries) {
+	struct timespec ts;
+	int64_t cap, left;
+	int shift = retries > 16 ? 16 : retries - 1;
+
+	if (!dynoc->retry.backoff_base) {
+		return;
+	}
+
+	cap = (int64_t)dynoc->retry.backoff_base << shift;
+	if (cap > dynoc->retry.backoff_max) {
+		cap = dynoc->retry.backoff_max;
+	}
+	cap = random_index((uint32_t)cap + 1);
+
+	left = command_remaining();
+	if (left >= 0 && cap > left) {
+		cap = left;
+	}
+
+	ts.tv_sec = cap / 1000;
+	ts.tv_nsec = (cap % 1000) * 1000000;
+	nanosleep(&ts, NULL);
+}
+
+int
+retry_allowed(struct dynoc *dynoc, int retries, int idempotent, int ambiguous) {
+	if (!idempotent && ambiguous && !dynoc->retry.retry_unsafe) {
+		log_debug("not retrying a non-idempotent command");
+		return 0;
+	}
+
+	if (dynoc->retry.max_retries >= 0 && retries > dynoc->retry.max_retries) {
+		return 0;
+	}
+
+	if (!retry_budget_withdraw(dynoc)) {
+		log_debug("retry budget exhausted");
+		return 0;
+	}
+
+	retry_backoff(dynoc, retries);
+	return 1;
+}
+
+static __thread uint32_t random_seed;
+
+uint32_t
+random_index(uint32_t n) {
+	uint32_t x = random_seed;
+
+	if (x == 0) {
+		x = ((uint32_t)(uintptr_t)&random_seed ^ (uint32_t)time(NULL)) | 1;
+	}
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	random_seed = x;
+
+	return x % n;
+}
@@ -0,0 +1,299 @@
+/*
+ * Dynoc is a minimalistic C client library for the dynomite.
+ * Copyright (C) 2016-2017 huya.com, Lampman Yao
+ */
+
+/*
+ * Dynomite - A thin, distributed replication layer for multi non-distributed storages.
+ * Copyright (C) 2014 Netflix, Inc.
+ */
+
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "dynoc-core.h"
+
+/*
+ * One command of a multi-node pipeline. The command is formatted up front
+ * with conn_request_format(); conn_pipeline_exec() fills `reply`, which is
+ * NULL if the connection was down or failed while the request was in flight.
+ */
+struct conn_request {
+	struct redis_connection *redis_conn;
+	char *cmd;
+	int len;
+	int sent;
+	redisReply *reply;
+};
+
+/*
+ * One keyed command of a fan-out. fanout_exec() routes it by `key` and,
+ * like the single-key commands, moves on to the next rack when the owner
+ * is down. An `unsafe` command (INCR and the like) is not resent once it
+ * may have been applied, unless the retry policy says so. `reply` is owned
+ * by the request once set; `redis_conn` is then the node that sent it.
+ */
+struct key_request {
+	const char *key;
+	char *cmd;
+	int len;
+	int unsafe;
+	redisReply *reply;
+	struct redis_connection *redis_conn;
+};
+
+/*
+ * Looks up the TCP endpoints given concurrently, each on a thread of its
+ * own, and waits at most `timeout_ms` for them. A lookup still running
+ * then is left to finish in the background and its result is picked up
+ * by the next call, which does not start a second one for that endpoint.
+ * The address is kept in the endpoint for every later connect:
+ * attempt_start() never waits on DNS and fails an endpoint that is not
+ * resolved yet. Only dynoc_start() and the health check call it, and
+ * resolve_cancel() before the endpoint is freed. Returns how many of them
+ * are resolved.
+ */
+uint32_t resolve_endpoints(struct endpoint **endpoints, uint32_t nendpoint, int timeout_ms);
+void resolve_cancel(struct endpoint *endpoint);
+
+/*
+ * One node to (re)connect. connect_nodes() drives every attempt of a batch
+ * concurrently through a single epoll loop, TCP connect and AUTH alike,
+ * and installs the resulting context in `redis_conn` on success. With
+ * `dynoc` set the context is allocated from the CPUs of NUMA shard
+ * `shard`, so one batch can connect every shard; NULL allocates it from
+ * wherever the calling thread runs.
+ */
+struct conn_attempt {
+	struct redis_connection *redis_conn;
+	const struct endpoint *endpoint;
+	const struct socket_options *sockopts;
+	struct dynoc *dynoc;
+	uint32_t shard;
+	int fd;
+	int state;
+	char *auth;
+	int auth_len;
+	int auth_off;
+	redisReader *reader;
+};
+
+/* Returns how many nodes were connected before `timeout_ms` ran out. */
+uint32_t connect_nodes(struct conn_attempt *attempts, uint32_t nattempt, int timeout_ms);
+
+/*
+ * Must be called with redis_conn->lock held before using the connection.
+ * Returns non-zero if it is usable. A cold connection (lazy mode, or reaped
+ * while idle) is opened here by the first thread to need it; the others
+ * wait on the lock and then see the result.
+ */
+int connection_ready(struct dynoc *dynoc, struct redis_connection *redis_conn);
+
+/*
+ * Discard the replies of requests a pipeline stopped waiting for. Must be
+ * called with the lock held; resets the connection and returns -1 if that
+ * fails.
+ */
+int connection_drain(struct redis_connection *redis_conn);
+
+/* Socket timeout of the connection in milliseconds, 0 for none. */
+void connection_set_timeout(struct redis_connection *redis_conn, int timeout_ms);
+
+void reset_redis_connection(struct redis_connection *redis_conn);
+struct redis_connection *select_connection(struct dynoc *dynoc, const char *key,
+                                           struct token *token, dc_type_t *dc_type, uint32_t *rc_idx);
+
+/* select_connection() in NUMA shard `shard` rather than the caller's. */
+struct redis_connection *select_shard_connection(struct dynoc *dynoc, uint32_t shard, const char *key,
+                                                 struct token *token, dc_type_t *dc_type, uint32_t *rc_idx);
+
+/* Whether select_connection() has another rack left to offer. */
+int select_remaining(struct dynoc *dynoc, dc_type_t dc_type, uint32_t rc_idx);
+
+/*
+ * Length of the hash tag of `key`, 0 if it has none or hash tags are off.
+ * `tag` (may be NULL) is set to its first character.
+ */
+size_t key_hash_tag(struct dynoc *dynoc, const char *key, size_t len, const char **tag);
+
+/*
+ * Owner of `key` in every local rack, in rack order, for commands fanned
+ * out to all replicas. Starts the command deadline like the first
+ * select_connection() does. Returns the number of racks.
+ */
+uint32_t select_rack_connections(struct dynoc *dynoc, const char *key, struct redis_connection **conns);
+
+/* Effective consistency levels of the calling thread. */
+consistency_t write_consistency(struct dynoc *dynoc);
+consistency_t read_consistency(struct dynoc *dynoc);
+
+/* Acknowledgements `level` needs out of `nrack` racks. */
+uint32_t consistency_acks(consistency_t level, uint32_t nrack);
+
+int conn_request_format(struct conn_request *req, const char *format, ...);
+void conn_request_reset(struct conn_request *req);
+
+/*
+ * Send every request to its node before reading any reply, so the whole
+ * batch costs about one round trip however many nodes it touches.
+ * Returns the number of requests that got a reply.
+ */
+uint32_t conn_pipeline_exec(struct dynoc *dynoc, struct conn_request *reqs, uint32_t nreq);
+
+/*
+ * Like conn_pipeline_exec(), but replies are taken in arrival order and
+ * the wait ends as soon as `done` returns non-zero. The connections of
+ * requests left without a reply then discard it when next used.
+ */
+typedef int (*pipeline_done_t)(const struct conn_request *reqs, uint32_t nreq, void *arg);
+
+uint32_t conn_pipeline_until(struct dynoc *dynoc, struct conn_request *reqs, uint32_t nreq,
+                             pipeline_done_t done, void *arg);
+
+/*
+ * A locked connection taking part in a pipeline, for the I/O backends.
+ * Its `inflight` replies are read in order: first the `stale` ones left
+ * over by an earlier pipeline, which are thrown away, then those of its
+ * requests, `next` being the first request that may still await one.
+ */
+struct pipeline_slot {
+	struct redis_connection *redis_conn;
+	uint32_t next;
+	uint32_t stale;
+	uint32_t inflight;
+};
+
+struct pipeline_slot *pipeline_slot_find(struct pipeline_slot *slots, uint32_t nslot,
+                                         const struct redis_connection *redis_conn);
+void pipeline_slot_fail(struct pipeline_slot *slot, const char *what);
+
+/* Hand the complete replies in the reader to their requests, returns how many. */
+uint32_t pipeline_slot_replies(struct pipeline_slot *slot, struct conn_request *reqs);
+
+/* Milliseconds left for the current command, -1 if unbounded. */
+int64_t command_remaining(void);
+
+/*
+ * Retry budget: each request deposits budget_percent / 100 of a token,
+ * each retry withdraws one (RETRY_TOKEN units) from a bucket holding at
+ * most budget_reserve tokens.
+ */
+#define RETRY_TOKEN 1000
+
+void retry_budget_deposit(struct dynoc *dynoc);
+int retry_budget_withdraw(struct dynoc *dynoc);
+void retry_backoff(struct dynoc *dynoc, int retries);
+
+/*
+ * Decide whether a command may be retried after its `retries`-th failed
+ * attempt, and back off if so. `ambiguous` means the node may have
+ * applied the command.
+ */
+int retry_allowed(struct dynoc *dynoc, int retries, int idempotent, int ambiguous);
+
+/*
+ * The connection a single-key command uses for the node of `shared`: the
+ * calling thread's own one if it has a thread context for `dynoc` (NULL if
+ * the node is known down), else `shared` itself, locked.
+ * connection_release() undoes it; connection_failed() is called after
+ * resetting a connection that failed.
+ */
+struct redis_connection *connection_acquire(struct dynoc *dynoc, struct redis_connection *shared);
+void connection_release(struct redis_connection *shared, struct redis_connection *redis_conn);
+void connection_failed(struct redis_connection *shared, struct redis_connection *redis_conn);
+
+/* Whether the health check or a thread found the node of `shared` down. */
+int node_down(struct redis_connection *shared);
+
+/*
+ * One attempt of a single-key command on a locked, ready connection, see
+ * command_run(). Returns the reply, NULL if the connection failed.
+ */
+typedef redisReply *(*command_attempt_t)(struct redis_connection *redis_conn, void *arg);
+
+#define COMMAND_IDEMPOTENT  0x1
+#define COMMAND_ERROR_REPLY 0x2    /* error replies are results, not node failures */
+
+redisReply *command_run(struct dynoc *dynoc, const char *key, int flags, command_attempt_t attempt, void *arg);
+
+/* The node that answered the calling thread's last command_run(), NULL if it failed. */
+struct redis_connection *command_node(void);
+
+/* The rack called `name` in either datacenter, the first local one if NULL. */
+struct rack *rack_find(struct dynoc *dynoc, const char *name);
+
+/*
+ * Called by scan_node() with the keys of every SCAN reply; returning -1
+ * ends the walk. Strings may be taken from `keys` by setting them NULL.
+ */
+typedef int (*scan_batch_t)(struct redis_connection *redis_conn, redisReply *keys, void *arg);
+
+/*
+ * Walk every key of one node with SCAN until done or `*stopped` is set.
+ * Returns -1 if the node could not be walked to the end.
+ */
+int scan_node(struct dynoc *dynoc, struct redis_connection *redis_conn, const char *match, int count,
+              const int *stopped, scan_batch_t cb, void *arg);
+
+/*
+ * The node of `rack` owning `key`, which need not be NUL terminated, in
+ * the first NUMA shard: the one bulk jobs and stats work on.
+ */
+struct redis_connection *rack_owner(struct dynoc *dynoc, struct rack *rack, const char *key, size_t len);
+
+int script_preload(struct dynoc *dynoc, struct redis_connection *redis_conn);
+
+/*
+ * NUMA shards, see dynoc_numa_init(). Without it there is one shard and
+ * these do nothing. numa_current() is the shard of the calling thread's
+ * CPU; numa_run_on() pins the calling thread to a shard's CPUs until
+ * numa_run_anywhere() restores the affinity it had before.
+ */
+uint32_t numa_shards(struct dynoc *dynoc);
+uint32_t numa_current(struct dynoc *dynoc);
+void numa_run_on(struct dynoc *dynoc, uint32_t node);
+void numa_run_anywhere(struct dynoc *dynoc);
+struct redis_connection *numa_pool_alloc(struct dynoc *dynoc, uint32_t node, uint32_t count);
+void numa_pool_free(struct redis_connection *pool, uint32_t count);
+void numa_destroy(struct dynoc *dynoc);
+
+int key_request_format(struct key_request *req, const char *key, const char *format, ...);
+void key_request_reset(struct key_request *req);
+
+/*
+ * Run all requests in pipelined rounds until each has a non-error reply,
+ * has run out of racks or retry budget, or is an unsafe command that
+ * cannot be resent; one request giving up leaves the others running.
+ * Every request deposits into the retry budget like a single command.
+ * Returns 0 if every request succeeded.
+ */
+int fanout_exec(struct dynoc *dynoc, struct key_request *reqs, uint32_t nreq);
+
+/*
+ * fanout_exec() for bulk work: routes on NUMA shard `shard` and takes its
+ * retries from the bucket `*tokens` (RETRY_TOKEN units) instead of the
+ * one production commands share.
+ */
+int fanout_exec_on(struct dynoc *dynoc, struct key_request *reqs, uint32_t nreq, uint32_t shard, int64_t *tokens);
+
+/* Monotonic clock in milliseconds. */
+int64_t now_ms(void);
+
+/* Thread local xorshift, returns a value in [0, n). */
+uint32_t random_index(uint32_t n);
@@ -25,7 +25,8 @@
  * limitations under the License.
  */
 
-#include "dynoc-core.h"
+#include "dynoc-conn.h"
+#include "dynoc-uring.h"
 #include "dynoc-debug.h"
 
 #include <unistd.h>
@@ -35,91 +36,225 @@
 
 static void datacenter_destroy(struct datacenter *);
 static void rack_destroy(struct rack *);
-static void continuum_init(struct continuum *, const char *host, int port, const char *pass, const char *token_str, uint32_t idx);
-static void continuum_destroy(struct continuum *);
+static void continuum_init(struct continuum *, const char *token_str, uint32_t idx);
+static void endpoint_init(struct endpoint *, const char *host, int port, const char *pass);
+static void endpoint_destroy(struct endpoint *);
+
+static int
+dc_idle_expired(int idle_timeout, struct redis_connection *redis_conn) {
+	return idle_timeout && time(NULL) - redis_conn->last_used >= idle_timeout;
+}
 
 static void
-reconnect_datacenter(struct datacenter *dc) {
+reconnect_datacenter(struct dynoc *dynoc, struct datacenter *dc, uint32_t shard) {
 	struct rack *rack;
 	struct redis_connection *redis_conn;
-	struct continuum *continuum;
-	redisContext *ctx;
 	uint32_t i, j;
-	int status = VALID;
 
 	for (i = 0; i < dc->rack_count; i++) {
 		rack = &dc->rack[i];
-		for (j = 0; j < rack->node_count; j++) {
-			redis_conn = &rack->redis_conn_pool[j];
-			continuum = &rack->continuum[j];
+		for (j = 0; j < rack->ncontinuum; j++) {
+			redis_conn = &rack->shards[shard][j];
 			pthread_mutex_lock(&redis_conn->lock);
 
+			if (redis_conn->status && dc_idle_expired(dynoc->idle_timeout, redis_conn)) {
+				log_debug("%s:%s:%s:%d idle, closing", dc->name, rack->name,
+					rack->endpoints[j].host, rack->endpoints[j].port);
+				reset_redis_connection(redis_conn);
+				redis_conn->cold = 1;
+			}
+
+			if (redis_conn->status) {
+				/* A hung node must not stall the health check. */
+				connection_set_timeout(redis_conn, dynoc->connect_timeout);
+				connection_drain(redis_conn);
+			}
+
 			if (redis_conn->status) {
 				redisReply *reply = redisCommand(redis_conn->ctx, "PING");
 				if (reply) {
-					log_debug("%s:%s:%s:%d alive",
-						dc->name, rack->name, continuum->endpoint.host, continuum->endpoint.port);
+					log_debug("%s:%s:%s:%d alive", dc->name, rack->name,
+						rack->endpoints[j].host, rack->endpoints[j].port);
 					freeReplyObject(reply);
 				} else {
-					redis_conn->status = INVALID;
-					redisFree(redis_conn->ctx);
-					redis_conn->ctx = NULL;
+					reset_redis_connection(redis_conn);
 				}
 			}
 
-			if (!redis_conn->status) {
-				struct timeval tv;
-				tv.tv_sec = 3;
-				tv.tv_usec = 0;
-				ctx = redisConnectWithTimeout(continuum->endpoint.host, continuum->endpoint.port, tv);
-				if (ctx == NULL || ctx->err) {
-					if (ctx) {
-						redisFree(ctx);
-					}
-					log_debug("%s:%s:%s:%d reconnect failed",
-						dc->name, rack->name, continuum->endpoint.host, continuum->endpoint.port);
-				} else {
-					log_debug("%s:%s:%s:%d reconnect ok",
-						dc->name, rack->name, continuum->endpoint.host, continuum->endpoint.port);
-					if (continuum->endpoint.pass) {
-						redisReply *reply = redisCommand(ctx, "AUTH %s", continuum->endpoint.pass);
-						if (reply && reply->type != REDIS_REPLY_ERROR && ctx->err == 0) {
-							status = VALID;
-							log_debug("auth ok");
-						} else {
-							status = INVALID;
-							if (reply) {
-								freeReplyObject(reply);
-							}
-							log_debug("auth failed");
-						}
-					}
-					redis_conn->status = status;
-					redis_conn->ctx = ctx;
-				}
+			if (redis_conn->status && script_preload(dynoc, redis_conn) < 0) {
+				reset_redis_connection(redis_conn);
+			}
+
+			/* A node that failed on a thread context is trusted again once it answers. */
+			if (redis_conn->status) {
+				__atomic_store_n(&redis_conn->suspect, 0, __ATOMIC_RELAXED);
+			} else if (redis_conn->suspect && redis_conn->cold) {
+				redis_conn->cold = 0;
 			}
 			pthread_mutex_unlock(&redis_conn->lock);
 		}
 	}
 }
 
+static uint32_t
+collect_invalid(struct datacenter *dc, uint32_t shard, struct conn_attempt *attempts) {
+	struct rack *rack;
+	struct redis_connection *redis_conn;
+	uint32_t i, j, n = 0;
+
+	if (!dc) {
+		return 0;
+	}
+
+	for (i = 0; i < dc->rack_count; i++) {
+		rack = &dc->rack[i];
+		for (j = 0; j < rack->ncontinuum; j++) {
+			redis_conn = &rack->shards[shard][j];
+			pthread_mutex_lock(&redis_conn->lock);
+			if (!redis_conn->status && !redis_conn->cold) {
+				attempts[n].redis_conn = redis_conn;
+				attempts[n].endpoint = &rack->endpoints[j];
+				attempts[n].shard = shard;
+				n++;
+			}
+			pthread_mutex_unlock(&redis_conn->lock);
+		}
+	}
+	return n;
+}
+
+static uint32_t
+datacenter_nodes(struct datacenter *dc) {
+	uint32_t i, n = 0;
+
+	if (dc) {
+		for (i = 0; i < dc->rack_count; i++) {
+			n += dc->rack[i].ncontinuum;
+		}
+	}
+	return n;
+}
+
+/*
+ * Connect every node that is down, in every NUMA shard, all at once: a
+ * batch takes as long as its slowest node, bounded by `timeout_ms`,
+ * instead of the sum. Each context is still allocated from the CPUs of
+ * its shard, see dynoc_numa_init().
+ */
+static void
+connect_datacenters(struct dynoc *dynoc, int timeout_ms) {
+	struct conn_attempt *attempts;
+	uint32_t total, shard, n = 0, i;
+
+	total = datacenter_nodes(dynoc->local_dc) + datacenter_nodes(dynoc->remote_dc);
+	if (total == 0) {
+		return;
+	}
+
+	attempts = calloc((size_t)total * numa_shards(dynoc), sizeof(*attempts));
+	if (!attempts) {
+		return;
+	}
+
+	for (shard = 0; shard < numa_shards(dynoc); shard++) {
+		n += collect_invalid(dynoc->local_dc, shard, attempts + n);
+		n += collect_invalid(dynoc->remote_dc, shard, attempts + n);
+	}
+	for (i = 0; i < n; i++) {
+		attempts[i].sockopts = &dynoc->sockopts;
+		if (numa_shards(dynoc) > 1) {
+			attempts[i].dynoc = dynoc;
+		}
+	}
+	if (n) {
+		n = connect_nodes(attempts, n, timeout_ms);
+		log_debug("%u nodes connected", n);
+	}
+	free(attempts);
+}
+
+static uint32_t
+collect_unresolved(struct datacenter *dc, struct endpoint **endpoints) {
+	struct rack *rack;
+	uint32_t i, j, n = 0;
+
+	if (!dc) {
+		return 0;
+	}
+
+	for (i = 0; i < dc->rack_count; i++) {
+		rack = &dc->rack[i];
+		for (j = 0; j < rack->ncontinuum; j++) {
+			if (!rack->endpoints[j].path && !rack->endpoints[j].resolved) {
+				endpoints[n++] = &rack->endpoints[j];
+			}
+		}
+	}
+	return n;
+}
+
+/*
+ * Look up every TCP node that has no address yet, once for all shards,
+ * so that connecting does not wait on DNS; a node whose lookup takes
+ * longer than `timeout_ms` is tried by the next health check.
+ */
+static void
+resolve_datacenters(struct dynoc *dynoc, int timeout_ms) {
+	struct endpoint **endpoints;
+	uint32_t total, n;
+
+	total = datacenter_nodes(dynoc->local_dc) + datacenter_nodes(dynoc->remote_dc);
+	if (total == 0) {
+		return;
+	}
+
+	endpoints = malloc(total * sizeof(*endpoints));
+	if (!endpoints) {
+		return;
+	}
+
+	n = collect_unresolved(dynoc->local_dc, endpoints);
+	n += collect_unresolved(dynoc->remote_dc, endpoints + n);
+	if (n) {
+		n = resolve_endpoints(endpoints, n, timeout_ms);
+		log_debug("%u nodes resolved", n);
+	}
+	free(endpoints);
+}
+
 static void *
 reconnect_thread(void *arg) {
 	struct dynoc *dynoc = arg;
 	struct datacenter *dc;
+	uint32_t shard;
 
 	while (1) {
-		dc = dynoc->local_dc;
-		if (dc) {
-			reconnect_datacenter(dc);
-		}
+		/* Only the sleep is a cancellation point, see dynoc_destroy(). */
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		resolve_datacenters(dynoc, dynoc->connect_timeout / 2);
+
+		/* Reconnect first, so nodes that come back get their scripts now. */
+		connect_datacenters(dynoc, dynoc->connect_timeout);
 
-		dc = dynoc->remote_dc;
-		if (dc) {
-			reconnect_datacenter(dc);
+		/* Each NUMA shard is checked from its own CPUs, see dynoc_numa_init(). */
+		for (shard = 0; shard < numa_shards(dynoc); shard++) {
+			numa_run_on(dynoc, shard);
+
+			dc = dynoc->local_dc;
+			if (dc) {
+				reconnect_datacenter(dynoc, dc, shard);
+			}
+
+			dc = dynoc->remote_dc;
+			if (dc) {
+				reconnect_datacenter(dynoc, dc, shard);
+			}
 		}
+		numa_run_anywhere(dynoc);
 
-		sleep(30);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		sleep(dynoc->health_interval);
 	}
 	return NULL;
 }
@@ -128,8 +263,37 @@ int
 dynoc_init(struct dynoc *dynoc) {
 	dynoc->local_dc = NULL;
 	dynoc->remote_dc = NULL;
+	dynoc->counters = NULL;
+	dynoc->hotkeys = NULL;
+	dynoc->scripts = NULL;
+	dynoc->codec = NULL;
+	dynoc->codec_threshold = 0;
+	dynoc->connect_timeout = DEFAULT_CONNECT_TIMEOUT;
+	dynoc->command_timeout = 0;
+	dynoc->health_interval = DEFAULT_HEALTH_INTERVAL;
+	dynoc->retry.max_retries = -1;
+	dynoc->retry.budget_percent = 10;
+	dynoc->retry.budget_reserve = 10;
+	dynoc->retry.retry_unsafe = 0;
+	dynoc->retry.backoff_base = 0;
+	dynoc->retry.backoff_max = 0;
+	dynoc->retry_tokens = dynoc->retry.budget_reserve * RETRY_TOKEN;
+	dynoc->write_consistency = CONSISTENCY_DC_ONE;
+	dynoc->read_consistency = CONSISTENCY_DC_ONE;
+	dynoc->read_mismatch = NULL;
+	dynoc->read_mismatch_arg = NULL;
+	dynoc->io_backend = IO_BACKEND_POLL;
+	memset(&dynoc->sockopts, 0, sizeof(dynoc->sockopts));
+	dynoc->sockopts.nodelay = 1;
+	dynoc->sockopts.incoming_cpu = -1;
+	dynoc->nslots = 0;
+	dynoc->numa = NULL;
+	dynoc->lazy = 0;
+	dynoc->idle_timeout = 0;
 
 	dynoc->hash_type = DEFAULT_HASH;
+	dynoc->hash_tag[0] = '\0';
+	dynoc->hash_tag[1] = '\0';
 	return 0;
 }
 
@@ -148,6 +312,220 @@ dynoc_hash_type_init(struct dynoc *dynoc, const char *hash_name) {
 	return 0;
 }
 
+int
+dynoc_hash_tag_init(struct dynoc *dynoc, const char *hash_tag) {
+	struct counter *counter;
+	struct hotkey *hotkey;
+	char saved[2];
+
+	if (!hash_tag || strlen(hash_tag) != 2) {
+		return -1;
+	}
+
+	saved[0] = dynoc->hash_tag[0];
+	saved[1] = dynoc->hash_tag[1];
+	dynoc->hash_tag[0] = hash_tag[0];
+	dynoc->hash_tag[1] = hash_tag[1];
+
+	for (counter = dynoc->counters; counter; counter = counter->next) {
+		if (counter->nshards > 1 && key_hash_tag(dynoc, counter->name, strlen(counter->name), NULL)) {
+			goto clash;
+		}
+	}
+	for (hotkey = dynoc->hotkeys; hotkey; hotkey = hotkey->next) {
+		if (hotkey->ncopies > 1 && key_hash_tag(dynoc, hotkey->key, strlen(hotkey->key), NULL)) {
+			goto clash;
+		}
+	}
+	return 0;
+
+clash:
+	log_debug("a sharded counter or hot key carries a hash tag");
+	dynoc->hash_tag[0] = saved[0];
+	dynoc->hash_tag[1] = saved[1];
+	return -1;
+}
+
+int
+dynoc_connect_timeout_init(struct dynoc *dynoc, int timeout_ms) {
+	if (timeout_ms <= 0) {
+		return -1;
+	}
+
+	dynoc->connect_timeout = timeout_ms;
+	return 0;
+}
+
+int
+dynoc_command_timeout_init(struct dynoc *dynoc, int timeout_ms) {
+	if (timeout_ms < 0) {
+		return -1;
+	}
+
+	dynoc->command_timeout = timeout_ms;
+	return 0;
+}
+
+int
+dynoc_retry_policy_init(struct dynoc *dynoc, const struct retry_policy *policy) {
+	if (!policy || policy->budget_percent < 0 || policy->budget_reserve < 0 ||
+	    policy->backoff_base < 0 || policy->backoff_max < policy->backoff_base) {
+		return -1;
+	}
+
+	dynoc->retry = *policy;
+	dynoc->retry_tokens = policy->budget_reserve * RETRY_TOKEN;
+	return 0;
+}
+
+int
+dynoc_write_consistency_init(struct dynoc *dynoc, consistency_t level) {
+	if (level <= CONSISTENCY_DEFAULT || level > CONSISTENCY_ALL) {
+		return -1;
+	}
+
+	dynoc->write_consistency = level;
+	return 0;
+}
+
+int
+dynoc_read_consistency_init(struct dynoc *dynoc, consistency_t level, read_mismatch_t mismatch, void *arg) {
+	if (level <= CONSISTENCY_DEFAULT || level > CONSISTENCY_ALL) {
+		return -1;
+	}
+
+	dynoc->read_consistency = level;
+	dynoc->read_mismatch = mismatch;
+	dynoc->read_mismatch_arg = arg;
+	return 0;
+}
+
+int
+dynoc_health_check_init(struct dynoc *dynoc, int interval) {
+	if (interval <= 0) {
+		return -1;
+	}
+
+	dynoc->health_interval = interval;
+	return 0;
+}
+
+int
+dynoc_lazy_init(struct dynoc *dynoc, int idle_timeout) {
+	if (idle_timeout < 0) {
+		return -1;
+	}
+
+	dynoc->lazy = 1;
+	dynoc->idle_timeout = idle_timeout;
+	return 0;
+}
+
+int
+dynoc_socket_options_init(struct dynoc *dynoc, const struct socket_options *opts) {
+	if (!opts || opts->keepidle < 0 || opts->keepintvl < 0 || opts->keepcnt < 0 ||
+	    opts->user_timeout < 0 || opts->busy_poll < 0 || opts->rcvbuf < 0 || opts->sndbuf < 0 ||
+	    opts->incoming_cpu < -1) {
+		return -1;
+	}
+
+	dynoc->sockopts = *opts;
+	return 0;
+}
+
+static void
+datacenter_stats(struct datacenter *dc, node_stats_t cb, void *arg) {
+	struct node_stats stats;
+	struct redis_connection *redis_conn;
+	struct rack *rack;
+	uint32_t i, j;
+
+	if (!dc) {
+		return;
+	}
+
+	stats.dc = dc->name;
+	for (i = 0; i < dc->rack_count; i++) {
+		rack = &dc->rack[i];
+		stats.rack = rack->name;
+		for (j = 0; j < rack->ncontinuum; j++) {
+			redis_conn = &rack->redis_conn_pool[j];
+			pthread_mutex_lock(&redis_conn->lock);
+			stats.endpoint = &rack->endpoints[j];
+			stats.connected = redis_conn->status == VALID;
+			stats.sockopts = redis_conn->sockopts;
+			pthread_mutex_unlock(&redis_conn->lock);
+			cb(&stats, arg);
+		}
+	}
+}
+
+int
+dynoc_stats(struct dynoc *dynoc, node_stats_t cb, void *arg) {
+	if (!cb) {
+		return -1;
+	}
+
+	datacenter_stats(dynoc->local_dc, cb, arg);
+	datacenter_stats(dynoc->remote_dc, cb, arg);
+	return 0;
+}
+
+int
+dynoc_io_backend_init(struct dynoc *dynoc, const char *name) {
+	if (!name) {
+		return -1;
+	}
+
+	if (strcmp(name, "poll") == 0) {
+		dynoc->io_backend = IO_BACKEND_POLL;
+		return 0;
+	}
+
+	if (strcmp(name, "uring") == 0) {
+		if (!uring_thread_ring()) {
+			log_debug("io_uring is not available");
+			return -1;
+		}
+		dynoc->io_backend = IO_BACKEND_URING;
+		return 0;
+	}
+
+	log_debug("invalid io backend: %s", name);
+	return -1;
+}
+
+int
+dynoc_codec_init(struct dynoc *dynoc, const char *codec_name, size_t threshold) {
+	const struct value_codec *codec;
+
+	if (!codec_name) {
+		return -1;
+	}
+
+	codec = get_codec(codec_name);
+	if (!codec) {
+		log_debug("invalid codec name: %s", codec_name);
+		return -1;
+	}
+
+	dynoc->codec = codec;
+	dynoc->codec_threshold = threshold;
+	return 0;
+}
+
+int
+dynoc_codec_register(struct dynoc *dynoc, const struct value_codec *codec, size_t threshold) {
+	if (!codec || codec->id == CODEC_MAGIC || get_codec_by_id(codec->id) ||
+	    !codec->bound || !codec->compress || !codec->decompress) {
+		return -1;
+	}
+
+	dynoc->codec = codec;
+	dynoc->codec_threshold = threshold;
+	return 0;
+}
+
 void
 dynoc_destroy(struct dynoc *dynoc) {
 	if (!dynoc) {
@@ -155,6 +533,7 @@ dynoc_destroy(struct dynoc *dynoc) {
 	}
 
 	pthread_cancel(dynoc->tid);
+	pthread_join(dynoc->tid, NULL);
 	if (dynoc->local_dc) {
 		datacenter_destroy(dynoc->local_dc);
 		free(dynoc->local_dc);
@@ -164,6 +543,30 @@ dynoc_destroy(struct dynoc *dynoc) {
 		datacenter_destroy(dynoc->remote_dc);
 		free(dynoc->remote_dc);
 	}
+
+	while (dynoc->counters) {
+		struct counter *counter = dynoc->counters;
+		dynoc->counters = counter->next;
+		free(counter->name);
+		free(counter);
+	}
+
+	while (dynoc->hotkeys) {
+		struct hotkey *hotkey = dynoc->hotkeys;
+		dynoc->hotkeys = hotkey->next;
+		pthread_mutex_destroy(&hotkey->lock);
+		free(hotkey->key);
+		free(hotkey);
+	}
+
+	while (dynoc->scripts) {
+		struct script *script = dynoc->scripts;
+		dynoc->scripts = script->next;
+		free(script->body);
+		free(script);
+	}
+
+	numa_destroy(dynoc);
 }
 
 int
@@ -183,8 +586,12 @@ dynoc_add_node(struct dynoc *dynoc, const char *ip, int port,
 		index = rack->ncontinuum;
 		if (rack->name && strcmp(rack->name, rc_name) == 0) {
 			continuum = &rack->continuum[index];
-			continuum_init(continuum, ip, port, pass, token_str, index);
+			continuum_init(continuum, token_str, index);
+			endpoint_init(&rack->endpoints[index], ip, port, pass);
 			rack->ncontinuum++;
+			if (rack->endpoints[index].path) {
+				rack->nunix++;
+			}
 		}
 	}
 	return 0;
@@ -193,54 +600,123 @@ dynoc_add_node(struct dynoc *dynoc, const char *ip, int port,
 static inline int
 cmp(const void *t1, const void *t2) {
 	const struct continuum *ct1 = t1, *ct2 = t2;
-	return token_cmp(ct1->token, ct2->token);
+	return token_cmp((struct token *)&ct1->token, (struct token *)&ct2->token);
+}
+
+static void
+redis_connection_init(struct redis_connection *redis_conn) {
+	pthread_mutex_init(&redis_conn->lock, NULL);
+	redis_conn->status = INVALID;
+	redis_conn->cold = 0;
+	redis_conn->pending = 0;
+	redis_conn->nscripts = 0;
+	redis_conn->slot = 0;
+	redis_conn->suspect = 0;
+	redis_conn->last_used = 0;
+	redis_conn->timeout_ms = 0;
+	redis_conn->endpoint = NULL;
+	redis_conn->ctx = NULL;
 }
 
 static void
-redis_connection_pool_init(struct rack *rack) {
+redis_connection_pool_destroy(struct redis_connection *pool, uint32_t count) {
 	uint32_t i;
-	int status = VALID;
+
+	for (i = 0; i < count; i++) {
+		if (pool[i].ctx) {
+			redisFree(pool[i].ctx);
+		}
+		pthread_mutex_destroy(&pool[i].lock);
+	}
+}
+
+/*
+ * With NUMA placement every shard, the first included, is a fresh pool
+ * allocated on its node; nothing is connected yet, so the pool made by
+ * dynoc_rack_init() can simply be replaced.
+ */
+static int
+redis_connection_shards_init(struct dynoc *dynoc, struct rack *rack) {
+	uint32_t nshards = numa_shards(dynoc), i, j;
+
+	rack->shards = calloc(nshards, sizeof(*rack->shards));
+	if (!rack->shards) {
+		return -1;
+	}
+	if (nshards == 1) {
+		rack->shards[0] = rack->redis_conn_pool;
+		rack->nshards = 1;
+		return 0;
+	}
+
+	for (i = 0; i < nshards; i++) {
+		rack->shards[i] = numa_pool_alloc(dynoc, i, rack->node_count);
+		if (!rack->shards[i]) {
+			while (i--) {
+				redis_connection_pool_destroy(rack->shards[i], rack->node_count);
+				numa_pool_free(rack->shards[i], rack->node_count);
+			}
+			free(rack->shards);
+			rack->shards = NULL;
+			return -1;
+		}
+		for (j = 0; j < rack->node_count; j++) {
+			redis_connection_init(&rack->shards[i][j]);
+		}
+	}
+	rack->nshards = nshards;
+	redis_connection_pool_destroy(rack->redis_conn_pool, rack->node_count);
+	free(rack->redis_conn_pool);
+	rack->redis_conn_pool = rack->shards[0];
+	return 0;
+}
+
+static int
+redis_connection_pool_init(struct dynoc *dynoc, struct rack *rack) {
+	struct endpoint endpoint;
+	struct redis_connection *redis_conn;
+	uint32_t i, j, k;
 
 	qsort(rack->continuum, rack->ncontinuum, sizeof(*rack->continuum), cmp);
+
+	/*
+	 * Endpoints follow the ring order, index i is continuum[i]'s node.
+	 * Permute them in place, one cycle at a time.
+	 */
 	for (i = 0; i < rack->ncontinuum; i++) {
-		struct continuum *continuum = &rack->continuum[i];
-		struct redis_connection *redis_conn = &rack->redis_conn_pool[i];
-		continuum->index = i;
-		struct timeval tv;
-		tv.tv_sec = 3;
-		tv.tv_usec = 0;
-		redisContext *ctx = redisConnectWithTimeout(continuum->endpoint.host, continuum->endpoint.port, tv);
-		if (ctx == NULL || ctx->err) {
-			if (ctx) {
-				redisFree(ctx);
-			}
-			log_debug("connect to %s:%d failed", continuum->endpoint.host, continuum->endpoint.port);
-		} else {
-			log_debug("connect to %s:%d ok", continuum->endpoint.host, continuum->endpoint.port);
-			if (continuum->endpoint.pass) {
-				redisReply *reply = redisCommand(ctx, "AUTH %s", continuum->endpoint.pass);
-				if (reply && reply->type != REDIS_REPLY_ERROR && ctx->err == 0) {
-					status = VALID;
-					log_debug("auth ok");
-				} else {
-					if (reply) {
-						freeReplyObject(reply);
-					}
-					status = INVALID;
-					log_debug("auth failed");
-				}
-			}
+		if (rack->continuum[i].index == i) {
+			continue;
+		}
+		endpoint = rack->endpoints[i];
+		for (j = i; (k = rack->continuum[j].index) != i; j = k) {
+			rack->endpoints[j] = rack->endpoints[k];
+			rack->continuum[j].index = j;
+		}
+		rack->endpoints[j] = endpoint;
+		rack->continuum[j].index = j;
+	}
+
+	if (redis_connection_shards_init(dynoc, rack) < 0) {
+		return -1;
+	}
 
-			redis_conn->status = status;
-			redis_conn->ctx = ctx;
+	for (i = 0; i < rack->ncontinuum; i++) {
+		for (j = 0; j < rack->nshards; j++) {
+			redis_conn = &rack->shards[j][i];
+			redis_conn->endpoint = &rack->endpoints[i];
+			redis_conn->cold = dynoc->lazy;
+			redis_conn->slot = dynoc->nslots;
 		}
+		dynoc->nslots++;
 	}
+	return 0;
 }
 
 int
 dynoc_start(struct dynoc *dynoc) {
 	struct datacenter *dc;
 	uint32_t rc_count, i;
+	int64_t deadline, left;
 
 	dynoc->hash_func = get_hash_func(dynoc->hash_type);
 
@@ -248,7 +724,9 @@ dynoc_start(struct dynoc *dynoc) {
 	if (dc) {
 		rc_count = dc->rack_count;
 		for (i = 0; i < rc_count; i++) {
-			redis_connection_pool_init(&dc->rack[i]);
+			if (redis_connection_pool_init(dynoc, &dc->rack[i]) < 0) {
+				return -1;
+			}
 		}
 	}
 
@@ -256,10 +734,23 @@ dynoc_start(struct dynoc *dynoc) {
 	if (dc) {
 		rc_count = dc->rack_count;
 		for (i = 0; i < rc_count; i++) {
-			redis_connection_pool_init(&dc->rack[i]);
+			if (redis_connection_pool_init(dynoc, &dc->rack[i]) < 0) {
+				return -1;
+			}
 		}
 	}
 
+	/*
+	 * Looking up and connecting share the connect timeout, lookups at
+	 * most half of it so that a hung resolver still leaves the nodes that
+	 * did resolve time to connect. Nodes not resolved or still down by
+	 * then are left to the reconnect thread.
+	 */
+	deadline = now_ms() + dynoc->connect_timeout;
+	resolve_datacenters(dynoc, dynoc->connect_timeout / 2);
+	left = deadline - now_ms();
+	connect_datacenters(dynoc, left > 0 ? (int)left : 0);
+
 	pthread_create(&dynoc->tid, NULL, reconnect_thread, dynoc);
 	return 0;
 }
@@ -318,13 +809,22 @@ dynoc_rack_init(struct dynoc *dynoc, uint32_t node_count, const char *name, dc_t
 			rack->name = strdup(name);
 			rack->node_count = node_count;
 			rack->ncontinuum = 0;
+			rack->nunix = 0;
 			rack->continuum = calloc(node_count, sizeof(struct continuum));
-			rack->redis_conn_pool = calloc(node_count, sizeof(struct redis_connection));
+			rack->endpoints = calloc(node_count, sizeof(struct endpoint));
+			rack->redis_conn_pool = NULL;
+			if (posix_memalign((void **)&rack->redis_conn_pool, CACHE_LINE_SIZE,
+			                   node_count * sizeof(struct redis_connection)) == 0) {
+				memset(rack->redis_conn_pool, 0, node_count * sizeof(struct redis_connection));
+			}
+			if (!rack->continuum || !rack->endpoints || !rack->redis_conn_pool) {
+				return -1;
+			}
 
+			rack->shards = NULL;
+			rack->nshards = 0;
 			for (j = 0; j < node_count; j++) {
-				pthread_mutex_init(&rack->redis_conn_pool[j].lock, NULL);
-				rack->redis_conn_pool[j].status = INVALID;
-				rack->redis_conn_pool[j].ctx = NULL;
+				redis_connection_init(&rack->redis_conn_pool[j]);
 			}
 			break;
 		}
@@ -340,47 +840,62 @@ rack_destroy(struct rack *rack) {
 		free(rack->name);
 	}
 
-	if (rack->continuum) {
+	free(rack->continuum);
+
+	if (rack->endpoints) {
 		for (i = 0; i < rack->ncontinuum; i++) {
-			continuum_destroy(&rack->continuum[i]);
+			endpoint_destroy(&rack->endpoints[i]);
 		}
-		free(rack->continuum);
+		free(rack->endpoints);
 	}
 
-	if (rack->redis_conn_pool) {
-		for (i = 0; i < rack->node_count; i++) {
-			if (rack->redis_conn_pool[i].ctx) {
-				pthread_mutex_destroy(&rack->redis_conn_pool[i].lock);
-				redisFree(rack->redis_conn_pool[i].ctx);
-			}
+	if (rack->nshards > 1) {
+		for (i = 0; i < rack->nshards; i++) {
+			redis_connection_pool_destroy(rack->shards[i], rack->node_count);
+			numa_pool_free(rack->shards[i], rack->node_count);
 		}
+	} else if (rack->redis_conn_pool) {
+		redis_connection_pool_destroy(rack->redis_conn_pool, rack->node_count);
 		free(rack->redis_conn_pool);
 	}
+	free(rack->shards);
 }
 
 static void
-continuum_init(struct continuum *continuum, const char *ip, int port, const char *pass, const char *token_str, uint32_t index) {
-	struct token *token = malloc(sizeof(struct token));
-	token_init(token);
-	token_size(token, 1);
-	token_parse(token_str, strlen(token_str), token);
+continuum_init(struct continuum *continuum, const char *token_str, uint32_t index) {
+	token_init(&continuum->token);
+	token_size(&continuum->token, 1);
+	token_parse(token_str, strlen(token_str), &continuum->token);
 	continuum->index = index;
-	continuum->token = token;
-	continuum->endpoint.host = strdup(ip);
-	continuum->endpoint.port = port;
+}
+
+static void
+endpoint_init(struct endpoint *endpoint, const char *ip, int port, const char *pass) {
+	endpoint->host = strdup(ip);
+	endpoint->port = port;
+	if (strncmp(ip, UNIX_ENDPOINT_PREFIX, strlen(UNIX_ENDPOINT_PREFIX)) == 0) {
+		endpoint->path = strdup(ip + strlen(UNIX_ENDPOINT_PREFIX));
+	} else {
+		endpoint->path = NULL;
+	}
+	endpoint->resolved = 0;
+	endpoint->job = NULL;
 	if (pass) {
-		continuum->endpoint.pass = strdup(pass);
+		endpoint->pass = strdup(pass);
 	} else {
-		continuum->endpoint.pass = NULL;
+		endpoint->pass = NULL;
 	}
-} 
+}
 
 static void
-continuum_destroy(struct continuum *continuum) {
-	free(continuum->endpoint.host);
-	if (continuum->endpoint.pass) {
-		free(continuum->endpoint.pass);
+endpoint_destroy(struct endpoint *endpoint) {
+	resolve_cancel(endpoint);
+	free(endpoint->host);
+	if (endpoint->pass) {
+		free(endpoint->pass);
+	}
+	if (endpoint->path) {
+		free(endpoint->path);
 	}
-	free(continuum->token);
 }
 
@@ -30,46 +30,116 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #include <hiredis.h>
 
 #include "dynoc-hashkit.h"
 #include "dynoc-token.h"
+#include "dynoc-codec.h"
 
 #define VALID   1
 #define INVALID 0
 #define DEFAULT_HASH HASH_MURMUR
+#define DEFAULT_CONNECT_TIMEOUT 3000
+#define DEFAULT_HEALTH_INTERVAL 30
+#define CACHE_LINE_SIZE 64
+
+/*
+ * Streaming callbacks. A stream_write_t receives consecutive pieces of a
+ * value and returns non-zero to abort; a stream_read_t fills `buf` with up
+ * to `len` bytes of the value and returns how many it wrote, or <= 0 on
+ * failure.
+ */
+typedef int (*stream_write_t)(void *arg, const char *data, size_t len);
+typedef ssize_t (*stream_read_t)(void *arg, char *buf, size_t len);
 
 typedef enum dc_type {
 	REMOTE_DC,
 	LOCAL_DC
 } dc_type_t;
 
+/* `path` is set for unix socket endpoints ("unix:/path"), NULL for TCP. */
+#define UNIX_ENDPOINT_PREFIX "unix:"
+
+/*
+ * `addr` is valid once `resolved` is set; `job` is a lookup still in
+ * flight. See resolve_endpoints().
+ */
+struct resolve_job;
+
 struct endpoint {
 	char *host;
 	int port;
 	char *pass;
+	char *path;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	int resolved;
+	struct resolve_job *job;
 };
 
+/* A node's position on the ring, kept small for the search; read-only once started. */
 struct continuum {
 	uint32_t index;
-	uint32_t value;
-	struct endpoint endpoint;
-	struct token *token;
+	struct token token;
+};
+
+/*
+ * Socket options of the connections to the nodes. 0 leaves the system
+ * default in place for every field but incoming_cpu, which is unset when
+ * -1. keepidle, keepintvl: seconds; user_timeout: milliseconds;
+ * busy_poll: microseconds; rcvbuf, sndbuf: bytes. Only rcvbuf and sndbuf
+ * apply to unix socket endpoints.
+ */
+struct socket_options {
+	int nodelay;
+	int keepalive;
+	int keepidle;
+	int keepintvl;
+	int keepcnt;
+	int user_timeout;
+	int busy_poll;
+	int rcvbuf;
+	int sndbuf;
+	int incoming_cpu;
 };
 
+/*
+ * The connection to one node. Slots are cache line aligned so threads
+ * using different nodes never share a line; the first line holds what
+ * every command touches, the rest is for connects and the health check.
+ */
 struct redis_connection {
-	uint32_t status;
 	pthread_mutex_t lock;
+	uint32_t status;
+	uint32_t pending;
+	int timeout_ms;
+	uint32_t cold;
 	redisContext *ctx;
-};
+
+	time_t last_used;
+	uint32_t nscripts;
+	uint32_t slot;          /* index among all nodes, for thread contexts */
+	uint32_t suspect;       /* failed on a thread context, until the next health check */
+	const struct endpoint *endpoint;
+	struct socket_options sockopts;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
 
 struct rack {
 	char *name;
 	uint32_t node_count;
 	uint32_t ncontinuum;
+	uint32_t nunix;
 	struct continuum *continuum;
+	struct endpoint *endpoints;
 	struct redis_connection *redis_conn_pool;
+	/* One pool per NUMA node, the first is redis_conn_pool. */
+	struct redis_connection **shards;
+	uint32_t nshards;
 };
 
 struct datacenter {
@@ -79,12 +149,244 @@ struct datacenter {
 	dc_type_t dc_type;
 };
 
+struct counter {
+	char *name;
+	uint32_t nshards;
+	struct counter *next;
+};
+
+/*
+ * A Lua script known to the client. `index` counts the scripts registered
+ * before it, so a connection only has to remember how many it loaded.
+ */
+struct script {
+	char sha[41];
+	char *body;
+	size_t len;
+	uint32_t index;
+	struct script *next;
+};
+
+typedef enum hotkey_read {
+	HOTKEY_READ_RANDOM,
+	HOTKEY_READ_STICKY
+} hotkey_read_t;
+
+struct hotkey {
+	char *key;
+	uint32_t ncopies;
+	int ttl;
+	hotkey_read_t read;
+	pthread_mutex_t lock;
+	uint64_t generation;    /* bumped under `lock` once a write is done */
+	struct hotkey *next;
+};
+
+/*
+ * Retry policy. Every attempt that fails after its command was sent is a
+ * retry; skipping a node already known to be down is not.
+ * - max_retries: retries per command, -1 for no limit but the topology.
+ * - budget_percent: retries allowed as a percentage of requests, client
+ *   wide, so an outage cannot multiply the load on the rest of the fleet.
+ * - budget_reserve: retries that may be spent in a burst (bucket size).
+ * - retry_unsafe: whether INCR/INCRBY/DECR/DECRBY are resent after a
+ *   failure that leaves it unknown whether they were applied; error
+ *   replies, which guarantee they were not, are always retryable.
+ * - backoff_base, backoff_max: full jitter exponential backoff between
+ *   retries in milliseconds, 0 for none.
+ */
+struct retry_policy {
+	int max_retries;
+	int budget_percent;
+	int budget_reserve;
+	int retry_unsafe;
+	int backoff_base;
+	int backoff_max;
+};
+
+/*
+ * Consistency levels. CONSISTENCY_DC_ONE, the default, uses the first
+ * healthy local rack and leaves replication to dynomite. The other levels
+ * send the command to the owner of the key in every local rack at once: a
+ * write succeeds once one, a majority or all of those nodes acknowledged
+ * it, a read once as many of them returned the same value.
+ * CONSISTENCY_DEFAULT only clears a per thread override.
+ */
+typedef enum consistency {
+	CONSISTENCY_DEFAULT,
+	CONSISTENCY_DC_ONE,
+	CONSISTENCY_ONE,
+	CONSISTENCY_QUORUM,
+	CONSISTENCY_ALL
+} consistency_t;
+
+/*
+ * Called by a fanned out read for every rack whose value differs from the
+ * one most racks returned. `field` is NULL for GET.
+ */
+typedef void (*read_mismatch_t)(const char *key, const char *field, const char *rack, void *arg);
+
+typedef enum io_backend {
+	IO_BACKEND_POLL,
+	IO_BACKEND_URING
+} io_backend_t;
+
 struct dynoc {
 	pthread_t tid;
 	hash_type_t hash_type;
 	hash_func_t hash_func;
+	char hash_tag[2];
 	struct datacenter* local_dc;
 	struct datacenter* remote_dc;
+	struct counter *counters;
+	struct hotkey *hotkeys;
+	struct script *scripts;
+	const struct value_codec *codec;
+	size_t codec_threshold;
+	int connect_timeout;
+	int command_timeout;
+	int health_interval;
+	int lazy;
+	int idle_timeout;
+	struct retry_policy retry;
+	int64_t retry_tokens;
+	consistency_t write_consistency;
+	consistency_t read_consistency;
+	read_mismatch_t read_mismatch;
+	void *read_mismatch_arg;
+	io_backend_t io_backend;
+	struct socket_options sockopts;
+	uint32_t nslots;
+	struct numa *numa;
+};
+
+/*
+ * State of one node as reported by dynoc_stats(). `sockopts` holds the
+ * options in effect on its connection as read back from the kernel,
+ * which may differ from those asked for (the kernel doubles buffer
+ * sizes, and some options need privileges); it is only meaningful while
+ * `connected`.
+ */
+struct node_stats {
+	const char *dc;
+	const char *rack;
+	const struct endpoint *endpoint;
+	int connected;
+	struct socket_options sockopts;
+};
+
+typedef void (*node_stats_t)(const struct node_stats *stats, void *arg);
+
+struct scan_iter;
+struct job;
+struct numa;
+typedef struct dynoc_thread_ctx dynoc_thread_ctx_t;
+
+typedef enum job_action {
+	JOB_DEL,
+	JOB_UNLINK,
+	JOB_EXPIRE,
+	JOB_PERSIST
+} job_action_t;
+
+/*
+ * Options of a pattern job, all optional (0):
+ * - rack: rack whose nodes are scanned, NULL for the first local rack.
+ * - seconds: TTL set by JOB_EXPIRE, which requires it.
+ * - batch: keys per pipelined batch, 100 by default.
+ * - rate: keys per second at most, 0 for no limit.
+ * - count: COUNT hint of the SCAN commands.
+ */
+struct job_options {
+	const char *rack;
+	int seconds;
+	int batch;
+	int rate;
+	int count;
+};
+
+/*
+ * Progress of a pattern job. `applied` counts keys the action changed,
+ * `skipped` keys it did not (deleted meanwhile, or without a TTL to
+ * persist) and `failed` keys no node acknowledged. `error` is set when
+ * a node could not be scanned to the end.
+ */
+struct job_progress {
+	uint64_t scanned;
+	uint64_t applied;
+	uint64_t skipped;
+	uint64_t failed;
+	int done;
+	int error;
+};
+
+typedef void (*job_progress_t)(const struct job_progress *progress, void *arg);
+
+/*
+ * Input formats of dynoc_load(). LOAD_TSV lines are "key<TAB>value" (SET)
+ * or "key<TAB>value<TAB>seconds" (SETEX), LOAD_TSV_HASH lines are
+ * "key<TAB>field<TAB>value" (HSET); neither can hold tabs or newlines in
+ * a value. LOAD_RESP is a stream of commands in the redis protocol, as
+ * fed to redis-cli --pipe, each routed by its first argument.
+ */
+typedef enum load_format {
+	LOAD_TSV,
+	LOAD_TSV_HASH,
+	LOAD_RESP
+} load_format_t;
+
+/*
+ * Options of dynoc_load(), all optional (0):
+ * - rack: rack written to, NULL for the first local one; dynomite
+ *   replicates to the others.
+ * - threads: worker threads, 4 by default.
+ * - window: commands in flight per node and worker, 256 by default.
+ */
+struct load_options {
+	const char *rack;
+	int threads;
+	int window;
+};
+
+/*
+ * Output formats of dynoc_dump(), both streams of commands that
+ * dynoc_load() with LOAD_RESP replays. DUMP_RESTORE writes RESTORE .. REPLACE
+ * with the DUMP payload and TTL of every key. DUMP_TYPED writes SET with
+ * PX for strings and HMSET plus PEXPIRE for hashes, and skips other types.
+ */
+typedef enum dump_format {
+	DUMP_RESTORE,
+	DUMP_TYPED
+} dump_format_t;
+
+/*
+ * Options of dynoc_dump(), all optional (0): the rack whose nodes are
+ * dumped (NULL for the first local one), and the MATCH pattern and COUNT
+ * hint of the SCAN commands.
+ */
+struct dump_options {
+	const char *rack;
+	const char *match;
+	int count;
+};
+
+/*
+ * `skipped` counts keys that expired, were deleted or are of a type
+ * DUMP_TYPED cannot export. `failed_nodes` counts nodes whose file is
+ * incomplete.
+ */
+struct dump_stats {
+	uint64_t keys;
+	uint64_t written;
+	uint64_t skipped;
+	uint32_t failed_nodes;
+};
+
+struct load_stats {
+	uint64_t records;
+	uint64_t loaded;
+	uint64_t failed;
+	uint64_t malformed;
 };
 
 #ifdef __cplusplus
@@ -100,12 +402,159 @@ int dynoc_init(struct dynoc *dynoc);
  * as key hash algorithm.
  */
 int dynoc_hash_type_init(struct dynoc *dynoc, const char *hash_name);
+
+/*
+ * Hash tag delimiters, two characters such as "{}", as in the hash_tag
+ * setting of dynomite. Only the text between the first pair in a key is
+ * hashed, if it is not empty, so "{user123}:profile" and
+ * "{user123}:cart" live on the same node. Sharded counters and hot keys
+ * spread their sub-keys over the ring, so their names may not carry a
+ * tag; this fails if one already does, as do their init functions
+ * afterwards.
+ */
+int dynoc_hash_tag_init(struct dynoc *dynoc, const char *hash_tag);
+
+/*
+ * Deadline in milliseconds for connecting (and authenticating) to the
+ * nodes. All nodes are connected concurrently, so dynoc_start() returns
+ * within this time however many nodes are unreachable; those are picked
+ * up by the background health check. Defaults to 3 seconds.
+ */
+int dynoc_connect_timeout_init(struct dynoc *dynoc, int timeout_ms);
+
+/*
+ * Seconds between two rounds of the background health check, which
+ * reconnects broken nodes and pings the others. Defaults to 30; a node
+ * that failed is skipped by commands for up to this long.
+ */
+int dynoc_health_check_init(struct dynoc *dynoc, int interval);
+
+/*
+ * Command deadlines.
+ * dynoc_command_timeout_init() bounds every command, failover to other
+ * racks and datacenters included, to `timeout_ms` (0, the default, means
+ * no limit). dynoc_set_deadline() sets an absolute deadline `timeout_ms`
+ * from now for every following command of the calling thread on this
+ * client, e.g. the budget of the request being served; 0 clears it. The
+ * time left is applied as the socket timeout of each attempt, and no
+ * further rack or datacenter is tried once it is spent.
+ */
+int dynoc_command_timeout_init(struct dynoc *dynoc, int timeout_ms);
+int dynoc_set_deadline(struct dynoc *dynoc, int timeout_ms);
+
+/*
+ * Replace the retry policy. The default allows unlimited failover across
+ * the topology within a budget of 10% of requests (burst of 10), never
+ * resends non-idempotent commands after an ambiguous failure and does
+ * not back off.
+ */
+int dynoc_retry_policy_init(struct dynoc *dynoc, const struct retry_policy *policy);
+
+/*
+ * Write consistency of SET, SETEX, PSETEX, HSET and DEL.
+ * dynoc_write_consistency_init() sets the client wide level;
+ * dynoc_set_write_consistency() overrides it for the following commands
+ * of the calling thread, CONSISTENCY_DEFAULT restores it. A fanned out
+ * write returns as soon as enough racks acknowledged it, the slower
+ * replies are discarded in the background. It is never retried, and a
+ * failed one may still have been applied by some racks. Non-idempotent
+ * commands, streamed writes and hot keys always use CONSISTENCY_DC_ONE.
+ */
+int dynoc_write_consistency_init(struct dynoc *dynoc, consistency_t level);
+int dynoc_set_write_consistency(struct dynoc *dynoc, consistency_t level);
+
+/*
+ * Read consistency of GET and HGET, set the same way. Values are compared
+ * by murmur3 digest; a fanned out read returns NULL when not enough racks
+ * agree before the deadline, and reports diverging racks to `mismatch`
+ * (may be NULL). Streamed reads and hot keys always use
+ * CONSISTENCY_DC_ONE.
+ */
+int dynoc_read_consistency_init(struct dynoc *dynoc, consistency_t level, read_mismatch_t mismatch, void *arg);
+int dynoc_set_read_consistency(struct dynoc *dynoc, consistency_t level);
+
+/*
+ * Lazy mode: dynoc_start() opens no connection; each node is connected by
+ * the first command that needs it, so remote datacenter nodes stay cold
+ * until a failover reaches them. Connections unused for `idle_timeout`
+ * seconds (0 disables reaping) are closed by the background thread, which
+ * runs every 30 seconds by default (see dynoc_health_check_init()), and
+ * reopened on the next use.
+ */
+int dynoc_lazy_init(struct dynoc *dynoc, int idle_timeout);
+
+/*
+ * Socket options applied to every connection dynoc opens, whether at
+ * dynoc_start(), by the health check or lazily. The default only sets
+ * TCP_NODELAY. Keepalive with a short user timeout detects half-open
+ * connections without waiting for a command to time out.
+ */
+int dynoc_socket_options_init(struct dynoc *dynoc, const struct socket_options *opts);
+
+/* Call `cb` for every node of both datacenters. */
+int dynoc_stats(struct dynoc *dynoc, node_stats_t cb, void *arg);
+
+/*
+ * I/O backend of the multi-node pipelines (fan-outs, quorum reads and
+ * writes, counters, hot keys): "poll" (the default) or "uring", which
+ * submits the sends and receives of all nodes through one io_uring per
+ * thread. Returns -1 and keeps "poll" if io_uring is not available.
+ * Single-key commands always go through hiredis.
+ */
+int dynoc_io_backend_init(struct dynoc *dynoc, const char *name);
+/*
+ * Compress values of at least `threshold` bytes written by SET, SETEX,
+ * PSETEX and HSET; GET and HGET transparently return the original value.
+ * Compression is off unless one of these is called. dynoc_codec_init()
+ * picks a built in codec by name ("lz"); dynoc_codec_register() plugs in
+ * a caller supplied codec whose id must not clash with a built in one.
+ */
+int dynoc_codec_init(struct dynoc *dynoc, const char *codec_name, size_t threshold);
+int dynoc_codec_register(struct dynoc *dynoc, const struct value_codec *codec, size_t threshold);
 int dynoc_datacenter_init(struct dynoc *dynoc, uint32_t rack_count, const char *name, dc_type_t dc_type);
 int dynoc_rack_init(struct dynoc *dynoc, uint32_t node_count, const char *name, dc_type_t dc_type);
+/*
+ * `ip` may also be "unix:/path/to/socket" for a dynomite node running on
+ * this host, `port` is then ignored. When such a node owns the key in one
+ * of the racks, commands try that rack before the others.
+ */
 int dynoc_add_node(struct dynoc *dynoc, const char *ip, int port, const char *pass, const char *token, const char *rc_name, dc_type_t dc_type);
 int dynoc_start(struct dynoc *dynoc);
 void dynoc_destroy(struct dynoc *dynoc);
 
+/*
+ * Thread-affine connections, for thread-per-core servers. After
+ * dynoc_thread_ctx_create() the calling thread has a connection of its own
+ * to every node, opened on first use, and its single-key commands (SET,
+ * GET, DEL, HSET, HGET, INCR/DECR, SETEX, PSETEX, scripts) run on them
+ * without taking any lock. Node health stays shared: nodes the health
+ * check found down are skipped, and a node failing on one thread is
+ * skipped by all until the next health check passes. Fan-outs, pipelines,
+ * streams and scans keep using the shared connections. One context per
+ * thread; free it on that thread before dynoc_destroy().
+ */
+dynoc_thread_ctx_t *dynoc_thread_ctx_create(struct dynoc *dynoc);
+void dynoc_thread_ctx_free(dynoc_thread_ctx_t *ctx);
+
+/*
+ * NUMA placement, Linux only. dynoc_numa_init(), before dynoc_start(),
+ * keeps the shared connections once per NUMA node: each copy lives in
+ * memory of its node and is connected and health checked from its CPUs,
+ * and a command uses the copy of the node its thread runs on. The slots
+ * are placed by first touch; the hiredis contexts and buffers are
+ * malloc()ed by the connecting thread, which runs on the shard's CPUs,
+ * so they land there unless malloc() reuses memory freed elsewhere. A
+ * cold connection opened lazily by a command is allocated by that
+ * command's thread. Bulk paths (scan, dump, load, jobs) always use the
+ * copy of node 0. Returns the number of nodes, 1 (and changes nothing)
+ * on a single node host, -1 if the topology cannot be read.
+ * dynoc_numa_bind() pins the calling thread to the CPUs of node `node`
+ * (0 .. count-1); a thread context created after it is allocated there
+ * too.
+ */
+int dynoc_numa_init(struct dynoc *dynoc);
+int dynoc_numa_bind(struct dynoc *dynoc, int node);
+
 /*
  * Redis Commands
  */
@@ -118,7 +567,7 @@ int dynoc_hset(struct dynoc *dynoc, const char *key, const char *field, const ch
 int dynoc_incr(struct dynoc *dynoc, const char *key);
 int dynoc_incrby(struct dynoc *dynoc, const char *key, int val);
 int dynoc_decr(struct dynoc *dynoc, const char *key);
-int dynoc_decryby(struct dynoc *dynoc, const char *key, int val);
+int dynoc_decrby(struct dynoc *dynoc, const char *key, int val);
 
 /*
  * The following functions return a redisReply pointer, the caller must check 
@@ -128,6 +577,137 @@ int dynoc_decryby(struct dynoc *dynoc, const char *key, int val);
 redisReply *dynoc_get(struct dynoc *dynoc, const char *key);
 redisReply *dynoc_hget(struct dynoc *dynoc, const char *key, const char *field);
 
+/*
+ * Streaming access to large values.
+ * The GET/HGET variants hand the value to `cb`, or write it to `fd`, in
+ * pieces of at most 64KB as they come off the socket, so memory stays
+ * bounded whatever the value size. They return 0 when a value was
+ * streamed, 1 when the key or field does not exist and -1 on error. Once
+ * part of a value was delivered an error is not retried on another rack.
+ * Like any command, all of them retry under the retry policy.
+ *
+ * dynoc_set_stream() pulls exactly `len` bytes from `cb`; dynoc_set_iov()
+ * sends the buffers of `iov` with writev(). Values written this way are
+ * never compressed, though compressed values are decoded when streamed.
+ */
+int dynoc_get_stream(struct dynoc *dynoc, const char *key, stream_write_t cb, void *arg);
+int dynoc_hget_stream(struct dynoc *dynoc, const char *key, const char *field, stream_write_t cb, void *arg);
+int dynoc_get_fd(struct dynoc *dynoc, const char *key, int fd);
+int dynoc_hget_fd(struct dynoc *dynoc, const char *key, const char *field, int fd);
+int dynoc_set_stream(struct dynoc *dynoc, const char *key, size_t len, stream_read_t cb, void *arg);
+int dynoc_set_iov(struct dynoc *dynoc, const char *key, const struct iovec *iov, int iovcnt);
+
+/*
+ * Sharded counters.
+ * A counter is spread over `nshards` sub-keys ("name:0" .. "name:N-1") that
+ * hash to different nodes. dynoc_counter_incr() bumps one random shard and
+ * dynoc_counter_get() reads all shards in one pipelined round trip and sums
+ * them. Counters must be declared with dynoc_counter_init() before
+ * dynoc_start(); undeclared names are treated as a single plain key.
+ * Never lower the shard count of a counter that already holds data.
+ */
+int dynoc_counter_init(struct dynoc *dynoc, const char *name, uint32_t nshards);
+int dynoc_counter_incr(struct dynoc *dynoc, const char *name, int delta);
+int dynoc_counter_get(struct dynoc *dynoc, const char *name, long long *value);
+
+/*
+ * Replicated hot keys.
+ * A hot key is stored as the key itself plus `ncopies - 1` copies
+ * ("key:copy:1" ..) that hash to other nodes; reads pick one copy at random
+ * (HOTKEY_READ_RANDOM) or keep each thread on the same copy
+ * (HOTKEY_READ_STICKY, which knows nothing of the topology: it only keeps
+ * a thread on one node). Writes go to the key first and then to every
+ * copy in one pipeline, serialized per key inside this process. Copies
+ * expire after `ttl` seconds (0 keeps them forever) so a copy missed by a
+ * racing writer heals itself; a reader that misses a copy falls back to
+ * the key and repopulates the copy with SET NX, unless a write of this
+ * process got in between. A repaired copy expires after `ttl`, or after a
+ * minute if that is 0, so a copy repopulated just as another process
+ * deleted the key does not outlive it for long. dynoc_hotkey_del()
+ * invalidates the key and all its copies. Declare hot keys before
+ * dynoc_start().
+ */
+int dynoc_hotkey_init(struct dynoc *dynoc, const char *key, uint32_t ncopies, int ttl, hotkey_read_t read);
+int dynoc_hotkey_set(struct dynoc *dynoc, const char *key, const char *value);
+int dynoc_hotkey_del(struct dynoc *dynoc, const char *key);
+redisReply *dynoc_hotkey_get(struct dynoc *dynoc, const char *key);
+
+/*
+ * Lua scripting.
+ * Scripts run with EVALSHA on the node owning keys[0], so all their keys
+ * must live on that node (see dynoc_hash_tag_init()); `nkeys` must be at
+ * least 1. dynoc_eval() registers `script` on first use;
+ * dynoc_script_register() does so ahead of time and returns its SHA1 in
+ * `sha` (41 bytes, may be NULL) for dynoc_evalsha(). Registered scripts
+ * are loaded on every node by the health check, and again on demand when
+ * a node answers NOSCRIPT. Errors raised by a script are returned as an
+ * error reply; NULL means no node could run it. A script is only resent
+ * to another rack when it surely did not run.
+ */
+int dynoc_script_register(struct dynoc *dynoc, const char *script, char *sha);
+redisReply *dynoc_eval(struct dynoc *dynoc, const char *script, int nkeys, const char **keys, int nargs, const char **args);
+redisReply *dynoc_evalsha(struct dynoc *dynoc, const char *sha, int nkeys, const char **keys, int nargs, const char **args);
+
+/*
+ * Keyspace scan.
+ * dynoc_scan_iter() walks every node of one rack (the first local rack if
+ * `rack` is NULL) with SCAN at once, one thread per node, so the whole
+ * keyspace is seen once. `match` and `count` (0 for the server default)
+ * are passed to SCAN. Keys wait in a queue of `queue_size` entries (0 for
+ * 1024); the scanning threads stop while it is full.
+ * dynoc_scan_next() returns 1 with the next key, valid until the next
+ * call, 0 once every node was walked, and -1 instead if a node could not
+ * be. Like SCAN itself this may return a key more than once.
+ * dynoc_scan_iter_free() may be called before the end.
+ */
+struct scan_iter *dynoc_scan_iter(struct dynoc *dynoc, const char *rack, const char *match, int count, size_t queue_size);
+int dynoc_scan_next(struct scan_iter *iter, const char **key, size_t *len);
+void dynoc_scan_iter_free(struct scan_iter *iter);
+
+/*
+ * Pattern jobs.
+ * dynoc_job_start() runs `action` on every key matching `pattern` in the
+ * background: the nodes of a rack are scanned as with dynoc_scan_iter()
+ * and the action is sent in pipelined batches to the node owning each
+ * key, from which dynomite replicates it. `cb`, if any, is called from
+ * the job thread after every batch and once more when the job is done. A
+ * job has a retry budget of its own, so its failures cannot use up the
+ * one of the commands running alongside. dynoc_job_progress() takes a
+ * snapshot at any time; dynoc_job_cancel() stops the job after the
+ * current batch. dynoc_job_wait() waits for the end, frees the job and
+ * returns 0 if every key was handled.
+ */
+struct job *dynoc_job_start(struct dynoc *dynoc, const char *pattern, job_action_t action,
+                            const struct job_options *opts, job_progress_t cb, void *arg);
+void dynoc_job_progress(struct job *job, struct job_progress *progress);
+void dynoc_job_cancel(struct job *job);
+int dynoc_job_wait(struct job *job, struct job_progress *progress);
+
+/*
+ * Bulk load.
+ * dynoc_load() maps the file at `path`, splits it at record boundaries
+ * between the worker threads and has each of them pipeline its records
+ * to their owning nodes over its own connections, keeping up to `window`
+ * of them in flight per node. A record whose node is down goes to the
+ * next rack. Failed records are counted and logged with their key.
+ * Returns 0 if every record was parsed and acknowledged; `stats`, if not
+ * NULL, gets the counts either way.
+ */
+int dynoc_load(struct dynoc *dynoc, const char *path, load_format_t format,
+               const struct load_options *opts, struct load_stats *stats);
+
+/*
+ * Keyspace export.
+ * dynoc_dump() walks every node of a rack at once, each on its own
+ * thread, fetches the keys of every SCAN batch with pipelined rounds of
+ * a few keys (two per slice for DUMP_TYPED), so commands sharing the
+ * node's connection wait for one small round at most, and streams them
+ * to "<prefix>.<n>", one file per node, so the shards can be restored
+ * in parallel. Returns 0 if every node was dumped to the end.
+ */
+int dynoc_dump(struct dynoc *dynoc, const char *prefix, dump_format_t format,
+               const struct dump_options *opts, struct dump_stats *stats);
+
 #ifdef __cplusplus
 }
 };
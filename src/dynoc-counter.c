@@ -0,0 +1,166 @@
+/*
+ * Dynoc is a minimalistic C client library for the dynomite.
+ * Copyright (C) 2016-2017 huya.com, Lampman Yao
+ */
+
+/*
+ * Dynomite - A thin, distributed replication layer for multi non-distributed storages.
+ * Copyright (C) 2014 Netflix, Inc.
+ */
+
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "dynoc-debug.h"
+#include "dynoc-conn.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define COUNTER_KEY_LEN 512
+
+static struct counter *
+find_counter(struct dynoc *dynoc, const char *name) {
+	struct counter *counter;
+
+	for (counter = dynoc->counters; counter; counter = counter->next) {
+		if (strcmp(counter->name, name) == 0) {
+			return counter;
+		}
+	}
+	return NULL;
+}
+
+static uint32_t
+counter_shards(struct dynoc *dynoc, const char *name) {
+	struct counter *counter = find_counter(dynoc, name);
+	return counter ? counter->nshards : 1;
+}
+
+static int
+shard_key(char *buf, const char *name, uint32_t nshards, uint32_t shard) {
+	int n;
+
+	if (nshards == 1) {
+		n = snprintf(buf, COUNTER_KEY_LEN, "%s", name);
+	} else {
+		n = snprintf(buf, COUNTER_KEY_LEN, "%s:%u", name, shard);
+	}
+	return (n < 0 || n >= COUNTER_KEY_LEN) ? -1 : 0;
+}
+
+int
+dynoc_counter_init(struct dynoc *dynoc, const char *name, uint32_t nshards) {
+	struct counter *counter;
+
+	if (!name || nshards == 0) {
+		return -1;
+	}
+
+	if (nshards > 1 && key_hash_tag(dynoc, name, strlen(name), NULL)) {
+		log_debug("sharded counter %s carries a hash tag", name);
+		return -1;
+	}
+
+	counter = find_counter(dynoc, name);
+	if (counter) {
+		counter->nshards = nshards;
+		return 0;
+	}
+
+	counter = malloc(sizeof(struct counter));
+	if (!counter) {
+		return -1;
+	}
+
+	counter->name = strdup(name);
+	counter->nshards = nshards;
+	counter->next = dynoc->counters;
+	dynoc->counters = counter;
+	return 0;
+}
+
+int
+dynoc_counter_incr(struct dynoc *dynoc, const char *name, int delta) {
+	char key[COUNTER_KEY_LEN];
+	uint32_t nshards;
+
+	if (!name) {
+		return -1;
+	}
+
+	nshards = counter_shards(dynoc, name);
+	if (shard_key(key, name, nshards, random_index(nshards)) < 0) {
+		return -1;
+	}
+
+	return dynoc_incrby(dynoc, key, delta);
+}
+
+int
+dynoc_counter_get(struct dynoc *dynoc, const char *name, long long *value) {
+	struct key_request *reqs;
+	char (*keys)[COUNTER_KEY_LEN];
+	uint32_t nshards, i;
+	long long sum = 0;
+	int ret = 0;
+
+	if (!name || !value) {
+		return -1;
+	}
+
+	nshards = counter_shards(dynoc, name);
+	reqs = calloc(nshards, sizeof(*reqs));
+	keys = calloc(nshards, sizeof(*keys));
+	if (!reqs || !keys) {
+		ret = -1;
+		goto out;
+	}
+
+	for (i = 0; i < nshards; i++) {
+		if (shard_key(keys[i], name, nshards, i) < 0 ||
+		    key_request_format(&reqs[i], keys[i], "GET %s", keys[i]) < 0) {
+			ret = -1;
+			goto out;
+		}
+	}
+
+	if (fanout_exec(dynoc, reqs, nshards) < 0) {
+		ret = -1;
+		goto out;
+	}
+
+	for (i = 0; i < nshards; i++) {
+		redisReply *reply = reqs[i].reply;
+		if (reply->type == REDIS_REPLY_STRING) {
+			sum += strtoll(reply->str, NULL, 10);
+		} else if (reply->type == REDIS_REPLY_INTEGER) {
+			sum += reply->integer;
+		}
+	}
+	*value = sum;
+
+out:
+	if (reqs) {
+		for (i = 0; i < nshards; i++) {
+			key_request_reset(&reqs[i]);
+		}
+	}
+	free(keys);
+	free(reqs);
+	return ret;
+}
@@ -0,0 +1,433 @@
+/*
+ * Dynoc is a minimalistic C client library for the dynomite.
+ * Copyright (C) 2016-2017 huya.com, Lampman Yao
+ */
+
+/*
+ * Dynomite - A thin, distributed replication layer for multi non-distributed storages.
+ * Copyright (C) 2014 Netflix, Inc.
+ */
+
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "dynoc-debug.h"
+#include "dynoc-conn.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DUMP_BUFFER (1024 * 1024)
+
+/* Keys per locked round trip, so commands to the node wait at most that long. */
+#define DUMP_ROUND_KEYS 16
+
+struct dump {
+	struct dynoc *dynoc;
+	dump_format_t format;
+	const char *match;
+	int count;
+	int stopped;
+};
+
+/* Output of one node, written in large sequential chunks. */
+struct dump_writer {
+	int fd;
+	char *buf;
+	size_t used;
+	size_t size;
+	int error;
+};
+
+struct dump_node {
+	struct dump *dump;
+	struct redis_connection *redis_conn;
+	pthread_t tid;
+	int started;
+	int failed;
+	struct dump_writer out;
+	struct dump_stats stats;
+};
+
+static void
+writer_write(struct dump_writer *out, const char *data, size_t len) {
+	ssize_t n;
+
+	while (len && !out->error) {
+		n = write(out->fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			out->error = 1;
+			break;
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+static void
+writer_flush(struct dump_writer *out) {
+	writer_write(out, out->buf, out->used);
+	out->used = 0;
+}
+
+static void
+writer_put(struct dump_writer *out, const char *data, size_t len) {
+	if (out->used + len > out->size) {
+		writer_flush(out);
+		if (len > out->size) {
+			writer_write(out, data, len);
+			return;
+		}
+	}
+	memcpy(out->buf + out->used, data, len);
+	out->used += len;
+}
+
+static void
+writer_header(struct dump_writer *out, char type, size_t n) {
+	char header[32];
+
+	writer_put(out, header, snprintf(header, sizeof(header), "%c%zu\r\n", type, n));
+}
+
+static void
+writer_arg(struct dump_writer *out, const char *arg, size_t len) {
+	writer_header(out, '$', len);
+	writer_put(out, arg, len);
+	writer_put(out, "\r\n", 2);
+}
+
+static void
+writer_int(struct dump_writer *out, long long value) {
+	char num[32];
+
+	writer_arg(out, num, snprintf(num, sizeof(num), "%lld", value));
+}
+
+/*
+ * Send two commands for each of keys `from` .. `to` - 1 in one pipeline
+ * and collect the replies, or return -1 if the connection failed. The
+ * connection is locked.
+ */
+static int
+dump_round(struct dump_node *node, redisReply *keys, size_t from, size_t to,
+           const char **cmds, redisReply **replies) {
+	redisContext *ctx = node->redis_conn->ctx;
+	size_t i, j;
+
+	for (i = from; i < to; i++) {
+		for (j = 0; j < 2; j++) {
+			if (!cmds[i * 2 + j]) {
+				continue;
+			}
+			redisAppendCommand(ctx, "%s %b", cmds[i * 2 + j], keys->element[i]->str, keys->element[i]->len);
+		}
+	}
+
+	for (i = from * 2; i < to * 2; i++) {
+		replies[i] = NULL;
+		if (cmds[i] && redisGetReply(ctx, (void **)&replies[i]) != REDIS_OK) {
+			reset_redis_connection(node->redis_conn);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static long long
+reply_ttl(redisReply *reply) {
+	return reply && reply->type == REDIS_REPLY_INTEGER ? reply->integer : -2;
+}
+
+/* RESTORE key ttl payload REPLACE, from PTTL and DUMP. */
+static void
+dump_restore(struct dump_node *node, redisReply *key, redisReply **replies) {
+	long long ttl = reply_ttl(replies[0]);
+	redisReply *payload = replies[1];
+
+	if (ttl == -2 || !payload || payload->type != REDIS_REPLY_STRING) {
+		/* Gone since it was scanned. */
+		node->stats.skipped++;
+		return;
+	}
+
+	writer_header(&node->out, '*', 5);
+	writer_arg(&node->out, "RESTORE", 7);
+	writer_arg(&node->out, key->str, key->len);
+	writer_int(&node->out, ttl < 0 ? 0 : ttl);
+	writer_arg(&node->out, payload->str, payload->len);
+	writer_arg(&node->out, "REPLACE", 7);
+	node->stats.written++;
+}
+
+/* SET key value [PX ttl], or HMSET key field value .. [PEXPIRE key ttl]. */
+static void
+dump_typed(struct dump_node *node, redisReply *key, long long ttl, redisReply *value) {
+	size_t i;
+
+	if (ttl == -2 || !value) {
+		node->stats.skipped++;
+		return;
+	}
+
+	if (value->type == REDIS_REPLY_STRING) {
+		writer_header(&node->out, '*', ttl > 0 ? 5 : 3);
+		writer_arg(&node->out, "SET", 3);
+		writer_arg(&node->out, key->str, key->len);
+		writer_arg(&node->out, value->str, value->len);
+		if (ttl > 0) {
+			writer_arg(&node->out, "PX", 2);
+			writer_int(&node->out, ttl);
+		}
+	} else if (value->type == REDIS_REPLY_ARRAY && value->elements) {
+		writer_header(&node->out, '*', value->elements + 2);
+		writer_arg(&node->out, "HMSET", 5);
+		writer_arg(&node->out, key->str, key->len);
+		for (i = 0; i < value->elements; i++) {
+			writer_arg(&node->out, value->element[i]->str, value->element[i]->len);
+		}
+		if (ttl > 0) {
+			writer_header(&node->out, '*', 3);
+			writer_arg(&node->out, "PEXPIRE", 7);
+			writer_arg(&node->out, key->str, key->len);
+			writer_int(&node->out, ttl);
+		}
+	} else {
+		/* Changed type, or deleted, between the two rounds. */
+		node->stats.skipped++;
+		return;
+	}
+	node->stats.written++;
+}
+
+static int
+dump_batch(struct redis_connection *redis_conn, redisReply *keys, void *arg) {
+	struct dump_node *node = arg;
+	const char **cmds;
+	redisReply **replies, **values = NULL;
+	long long *ttls = NULL;
+	size_t n = keys->elements, i, from, to;
+	int ret = -1;
+
+	if (!n) {
+		return 0;
+	}
+	cmds = calloc(n * 2, sizeof(*cmds));
+	replies = calloc(n * 2, sizeof(*replies));
+	if (!cmds || !replies) {
+		goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (keys->element[i]->type != REDIS_REPLY_STRING) {
+			continue;
+		}
+		cmds[i * 2] = "PTTL";
+		cmds[i * 2 + 1] = node->dump->format == DUMP_RESTORE ? "DUMP" : "TYPE";
+	}
+
+	if (node->dump->format == DUMP_TYPED) {
+		ttls = calloc(n, sizeof(*ttls));
+		values = calloc(n * 2, sizeof(*values));
+		if (!ttls || !values) {
+			goto out;
+		}
+	}
+
+	/*
+	 * The connection is shared with commands routed to the node, so it is
+	 * locked for one slice of the page at a time rather than all of it.
+	 */
+	for (from = 0; from < n; from = to) {
+		to = n - from > DUMP_ROUND_KEYS ? from + DUMP_ROUND_KEYS : n;
+
+		pthread_mutex_lock(&redis_conn->lock);
+		if (!connection_ready(node->dump->dynoc, redis_conn) ||
+		    dump_round(node, keys, from, to, cmds, replies) < 0) {
+			pthread_mutex_unlock(&redis_conn->lock);
+			goto out;
+		}
+		if (node->dump->format != DUMP_TYPED) {
+			pthread_mutex_unlock(&redis_conn->lock);
+			continue;
+		}
+
+		/* Second round: fetch the values of the types we can export. */
+		for (i = from; i < to; i++) {
+			redisReply *type = replies[i * 2 + 1];
+
+			ttls[i] = reply_ttl(replies[i * 2]);
+			cmds[i * 2] = NULL;
+			cmds[i * 2 + 1] = NULL;
+			if (type && type->type == REDIS_REPLY_STATUS && strcmp(type->str, "string") == 0) {
+				cmds[i * 2] = "GET";
+			} else if (type && type->type == REDIS_REPLY_STATUS && strcmp(type->str, "hash") == 0) {
+				cmds[i * 2] = "HGETALL";
+			}
+		}
+		if (dump_round(node, keys, from, to, cmds, values) < 0) {
+			pthread_mutex_unlock(&redis_conn->lock);
+			goto out;
+		}
+		pthread_mutex_unlock(&redis_conn->lock);
+	}
+
+	/* Write outside the lock, the connection is free for other users. */
+	for (i = 0; i < n; i++) {
+		if (keys->element[i]->type != REDIS_REPLY_STRING) {
+			continue;
+		}
+		node->stats.keys++;
+		if (node->dump->format == DUMP_RESTORE) {
+			dump_restore(node, keys->element[i], &replies[i * 2]);
+		} else {
+			dump_typed(node, keys->element[i], ttls[i], values[i * 2]);
+		}
+	}
+	ret = node->out.error ? -1 : 0;
+
+out:
+	for (i = 0; replies && i < n * 2; i++) {
+		if (replies[i]) {
+			freeReplyObject(replies[i]);
+		}
+		if (values && values[i]) {
+			freeReplyObject(values[i]);
+		}
+	}
+	free(cmds);
+	free(replies);
+	free(values);
+	free(ttls);
+	if (ret < 0) {
+		node->failed = 1;
+	}
+	return ret;
+}
+
+static void *
+dump_thread(void *arg) {
+	struct dump_node *node = arg;
+	struct dump *dump = node->dump;
+
+	if (scan_node(dump->dynoc, node->redis_conn, dump->match, dump->count,
+	              &dump->stopped, dump_batch, node) < 0) {
+		node->failed = 1;
+	}
+
+	writer_flush(&node->out);
+	if (fsync(node->out.fd) < 0) {
+		node->out.error = 1;
+	}
+	return NULL;
+}
+
+int
+dynoc_dump(struct dynoc *dynoc, const char *prefix, dump_format_t format,
+           const struct dump_options *opts, struct dump_stats *stats) {
+	struct dump_options defaults;
+	struct dump dump;
+	struct dump_node *nodes;
+	struct rack *rack;
+	char path[4096];
+	uint32_t i;
+	int ret = 0;
+
+	if (format < DUMP_RESTORE || format > DUMP_TYPED) {
+		return -1;
+	}
+	if (!opts) {
+		memset(&defaults, 0, sizeof(defaults));
+		opts = &defaults;
+	}
+	if (opts->count < 0) {
+		return -1;
+	}
+
+	rack = rack_find(dynoc, opts->rack);
+	if (!rack || !rack->ncontinuum) {
+		log_debug("no rack to dump");
+		return -1;
+	}
+
+	dump.dynoc = dynoc;
+	dump.format = format;
+	dump.match = opts->match;
+	dump.count = opts->count;
+	dump.stopped = 0;
+
+	nodes = calloc(rack->ncontinuum, sizeof(*nodes));
+	if (!nodes) {
+		return -1;
+	}
+	if (stats) {
+		memset(stats, 0, sizeof(*stats));
+	}
+
+	for (i = 0; i < rack->ncontinuum; i++) {
+		struct dump_node *node = &nodes[i];
+
+		node->dump = &dump;
+		node->redis_conn = &rack->redis_conn_pool[i];
+		node->out.fd = -1;
+		node->out.size = DUMP_BUFFER;
+		node->out.buf = malloc(node->out.size);
+		snprintf(path, sizeof(path), "%s.%u", prefix, i);
+		if (node->out.buf) {
+			node->out.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		}
+		if (node->out.fd < 0 || pthread_create(&node->tid, NULL, dump_thread, node) != 0) {
+			log_debug("cannot dump to %s", path);
+			ret = -1;
+			continue;
+		}
+		node->started = 1;
+	}
+
+	for (i = 0; i < rack->ncontinuum; i++) {
+		struct dump_node *node = &nodes[i];
+
+		if (node->started) {
+			pthread_join(node->tid, NULL);
+		}
+		if (node->out.fd >= 0 && close(node->out.fd) < 0) {
+			node->out.error = 1;
+		}
+		if (!node->started || node->failed || node->out.error) {
+			ret = -1;
+			if (stats) {
+				stats->failed_nodes++;
+			}
+		}
+		if (stats) {
+			stats->keys += node->stats.keys;
+			stats->written += node->stats.written;
+			stats->skipped += node->stats.skipped;
+		}
+		free(node->out.buf);
+	}
+
+	free(nodes);
+	return ret;
+}
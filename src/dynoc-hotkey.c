@@ -0,0 +1,282 @@
+/*
+ * Dynoc is a minimalistic C client library for the dynomite.
+ * Copyright (C) 2016-2017 huya.com, Lampman Yao
+ */
+
+/*
+ * Dynomite - A thin, distributed replication layer for multi non-distributed storages.
+ * Copyright (C) 2014 Netflix, Inc.
+ */
+
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "dynoc-debug.h"
+#include "dynoc-conn.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define HOTKEY_KEY_LEN    512
+#define HOTKEY_REPAIR_TTL 60
+
+static __thread uint32_t sticky_copy;
+
+static struct hotkey *
+find_hotkey(struct dynoc *dynoc, const char *key) {
+	struct hotkey *hotkey;
+
+	for (hotkey = dynoc->hotkeys; hotkey; hotkey = hotkey->next) {
+		if (strcmp(hotkey->key, key) == 0) {
+			return hotkey;
+		}
+	}
+	return NULL;
+}
+
+static int
+copy_key(char *buf, const char *key, uint32_t copy) {
+	int n = snprintf(buf, HOTKEY_KEY_LEN, "%s:copy:%u", key, copy);
+	return (n < 0 || n >= HOTKEY_KEY_LEN) ? -1 : 0;
+}
+
+static uint32_t
+select_copy(struct hotkey *hotkey) {
+	if (hotkey->read == HOTKEY_READ_STICKY) {
+		if (sticky_copy == 0) {
+			sticky_copy = random_index(UINT32_MAX - 1) + 1;
+		}
+		return sticky_copy % hotkey->ncopies;
+	}
+	return random_index(hotkey->ncopies);
+}
+
+int
+dynoc_hotkey_init(struct dynoc *dynoc, const char *key, uint32_t ncopies, int ttl, hotkey_read_t read) {
+	struct hotkey *hotkey;
+
+	if (!key || ncopies == 0 || ttl < 0) {
+		return -1;
+	}
+
+	if (ncopies > 1 && key_hash_tag(dynoc, key, strlen(key), NULL)) {
+		log_debug("hot key %s carries a hash tag", key);
+		return -1;
+	}
+
+	hotkey = find_hotkey(dynoc, key);
+	if (!hotkey) {
+		hotkey = malloc(sizeof(struct hotkey));
+		if (!hotkey) {
+			return -1;
+		}
+		hotkey->key = strdup(key);
+		hotkey->generation = 0;
+		pthread_mutex_init(&hotkey->lock, NULL);
+		hotkey->next = dynoc->hotkeys;
+		dynoc->hotkeys = hotkey;
+	}
+
+	hotkey->ncopies = ncopies;
+	hotkey->ttl = ttl;
+	hotkey->read = read;
+	return 0;
+}
+
+/*
+ * Send `format` (taking the copy key first) to copies 1..ncopies-1.
+ * Returns 0 if every copy acknowledged.
+ */
+static int
+hotkey_fanout(struct dynoc *dynoc, struct hotkey *hotkey, const char *value, int del) {
+	struct key_request *reqs;
+	char (*keys)[HOTKEY_KEY_LEN];
+	uint32_t ncopy = hotkey->ncopies - 1, i;
+	struct value encoded = { NULL, 0, NULL };
+	int ret = 0;
+
+	if (ncopy == 0) {
+		return 0;
+	}
+
+	if (!del && value_encode(dynoc->codec, dynoc->codec_threshold, value, strlen(value), &encoded) < 0) {
+		return -1;
+	}
+
+	reqs = calloc(ncopy, sizeof(*reqs));
+	keys = calloc(ncopy, sizeof(*keys));
+	if (!reqs || !keys) {
+		ret = -1;
+		goto out;
+	}
+
+	for (i = 0; i < ncopy; i++) {
+		if (copy_key(keys[i], hotkey->key, i + 1) < 0) {
+			ret = -1;
+			goto out;
+		}
+		if (del) {
+			ret = key_request_format(&reqs[i], keys[i], "DEL %s", keys[i]);
+		} else if (hotkey->ttl) {
+			ret = key_request_format(&reqs[i], keys[i], "SET %s %b EX %d", keys[i],
+			                         encoded.data, encoded.len, hotkey->ttl);
+		} else {
+			ret = key_request_format(&reqs[i], keys[i], "SET %s %b", keys[i], encoded.data, encoded.len);
+		}
+		if (ret < 0) {
+			goto out;
+		}
+	}
+
+	ret = fanout_exec(dynoc, reqs, ncopy);
+
+out:
+	if (reqs) {
+		for (i = 0; i < ncopy; i++) {
+			key_request_reset(&reqs[i]);
+		}
+	}
+	free(keys);
+	free(reqs);
+	value_free(&encoded);
+	return ret;
+}
+
+int
+dynoc_hotkey_set(struct dynoc *dynoc, const char *key, const char *value) {
+	struct hotkey *hotkey;
+	int ret;
+
+	if (!key || !value) {
+		return -1;
+	}
+
+	hotkey = find_hotkey(dynoc, key);
+	if (!hotkey) {
+		return dynoc_set(dynoc, key, value);
+	}
+
+	pthread_mutex_lock(&hotkey->lock);
+	ret = dynoc_set(dynoc, key, value);
+	if (ret == 0 && hotkey_fanout(dynoc, hotkey, value, 0) < 0) {
+		/* Drop the copies we could not update rather than serve them stale. */
+		log_debug("replicate %s failed, invalidating copies", key);
+		ret = hotkey_fanout(dynoc, hotkey, NULL, 1);
+	}
+	__atomic_add_fetch(&hotkey->generation, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&hotkey->lock);
+
+	return ret;
+}
+
+int
+dynoc_hotkey_del(struct dynoc *dynoc, const char *key) {
+	struct hotkey *hotkey;
+	int ret;
+
+	if (!key) {
+		return -1;
+	}
+
+	hotkey = find_hotkey(dynoc, key);
+	if (!hotkey) {
+		return dynoc_del(dynoc, key);
+	}
+
+	pthread_mutex_lock(&hotkey->lock);
+	ret = dynoc_del(dynoc, key);
+	if (hotkey_fanout(dynoc, hotkey, NULL, 1) < 0) {
+		ret = -1;
+	}
+	__atomic_add_fetch(&hotkey->generation, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&hotkey->lock);
+
+	return ret;
+}
+
+/*
+ * Repopulate a copy from the key read while `generation` was current. A
+ * write done since then may have changed or deleted the key, so the copy
+ * is left alone. The lock keeps writers out until the copy is written,
+ * but only one repair runs at a time and no reader waits for it: when
+ * the lock is taken the copy is left to the next miss. Writers of other
+ * processes are not seen: the TTL bounds how long a copy of a deleted
+ * value can survive.
+ */
+static void
+repair_copy(struct dynoc *dynoc, struct hotkey *hotkey, const char *ckey, redisReply *reply,
+            uint64_t generation) {
+	struct key_request req;
+	struct value encoded;
+	int ttl = hotkey->ttl ? hotkey->ttl : HOTKEY_REPAIR_TTL;
+
+	if (pthread_mutex_trylock(&hotkey->lock) != 0) {
+		return;
+	}
+	if (hotkey->generation != generation ||
+	    value_encode(dynoc->codec, dynoc->codec_threshold, reply->str, reply->len, &encoded) < 0) {
+		pthread_mutex_unlock(&hotkey->lock);
+		return;
+	}
+
+	/* NX: never overwrite a copy a concurrent writer has already refreshed. */
+	if (key_request_format(&req, ckey, "SET %s %b EX %d NX", ckey, encoded.data, encoded.len, ttl) == 0) {
+		fanout_exec(dynoc, &req, 1);
+		key_request_reset(&req);
+	}
+	pthread_mutex_unlock(&hotkey->lock);
+	value_free(&encoded);
+}
+
+redisReply *
+dynoc_hotkey_get(struct dynoc *dynoc, const char *key) {
+	struct hotkey *hotkey;
+	redisReply *reply;
+	char ckey[HOTKEY_KEY_LEN];
+	uint64_t generation;
+	uint32_t copy;
+
+	if (!key) {
+		return NULL;
+	}
+
+	hotkey = find_hotkey(dynoc, key);
+	if (!hotkey) {
+		return dynoc_get(dynoc, key);
+	}
+
+	copy = select_copy(hotkey);
+	if (copy == 0 || copy_key(ckey, key, copy) < 0) {
+		return dynoc_get(dynoc, key);
+	}
+
+	reply = dynoc_get(dynoc, ckey);
+	if (reply && reply->type == REDIS_REPLY_STRING) {
+		return reply;
+	}
+
+	if (reply) {
+		freeReplyObject(reply);
+	}
+
+	generation = __atomic_load_n(&hotkey->generation, __ATOMIC_ACQUIRE);
+	reply = dynoc_get(dynoc, key);
+	if (reply && reply->type == REDIS_REPLY_STRING) {
+		repair_copy(dynoc, hotkey, ckey, reply, generation);
+	}
+	return reply;
+}
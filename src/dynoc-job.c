@@ -0,0 +1,265 @@
+/*
+ * Dynoc is a minimalistic C client library for the dynomite.
+ * Copyright (C) 2016-2017 huya.com, Lampman Yao
+ */
+
+/*
+ * Dynomite - A thin, distributed replication layer for multi non-distributed storages.
+ * Copyright (C) 2014 Netflix, Inc.
+ */
+
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "dynoc-debug.h"
+#include "dynoc-conn.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define JOB_BATCH 100
+
+struct job {
+	struct dynoc *dynoc;
+	struct scan_iter *iter;
+	job_action_t action;
+	struct job_options opts;
+	job_progress_t cb;
+	void *arg;
+	pthread_t tid;
+	pthread_mutex_t lock;
+	struct job_progress progress;
+	int cancelled;
+	/* Retry budget of its own, see fanout_exec_on(). */
+	int64_t retry_tokens;
+};
+
+static int
+job_format(struct job *job, struct key_request *req, const char *key, size_t len) {
+	switch (job->action) {
+	case JOB_DEL:
+		return key_request_format(req, key, "DEL %b", key, len);
+	case JOB_UNLINK:
+		return key_request_format(req, key, "UNLINK %b", key, len);
+	case JOB_EXPIRE:
+		return key_request_format(req, key, "EXPIRE %b %d", key, len, job->opts.seconds);
+	case JOB_PERSIST:
+		return key_request_format(req, key, "PERSIST %b", key, len);
+	}
+	return -1;
+}
+
+/* Apply the action to a batch of keys, each on the node owning it. */
+static void
+job_batch(struct job *job, struct key_request *reqs, char **keys, uint32_t nkey) {
+	uint64_t applied = 0, skipped = 0, failed = 0;
+	uint32_t i;
+
+	/* Node 0's copy, like the scan, see dynoc_numa_init(). */
+	fanout_exec_on(job->dynoc, reqs, nkey, 0, &job->retry_tokens);
+
+	for (i = 0; i < nkey; i++) {
+		redisReply *reply = reqs[i].reply;
+
+		if (!reply || reply->type != REDIS_REPLY_INTEGER) {
+			failed++;
+		} else if (reply->integer > 0) {
+			applied++;
+		} else {
+			/* Gone already, or nothing to persist. */
+			skipped++;
+		}
+		key_request_reset(&reqs[i]);
+		free(keys[i]);
+	}
+
+	pthread_mutex_lock(&job->lock);
+	job->progress.applied += applied;
+	job->progress.skipped += skipped;
+	job->progress.failed += failed;
+	pthread_mutex_unlock(&job->lock);
+}
+
+/* Sleep as long as it takes to keep the job under its rate. */
+static void
+job_throttle(struct job *job, int64_t start, uint64_t nkeys) {
+	int64_t due;
+
+	if (!job->opts.rate) {
+		return;
+	}
+	due = start + (int64_t)(nkeys * 1000 / job->opts.rate) - now_ms();
+	if (due > 0) {
+		usleep(due * 1000);
+	}
+}
+
+static void *
+job_thread(void *arg) {
+	struct job *job = arg;
+	struct key_request *reqs;
+	struct job_progress progress;
+	char **keys;
+	const char *key;
+	size_t len;
+	uint32_t nkey = 0;
+	uint64_t total = 0;
+	int64_t start = now_ms();
+	int ret = 1;
+
+	reqs = calloc(job->opts.batch, sizeof(*reqs));
+	keys = calloc(job->opts.batch, sizeof(*keys));
+	if (!reqs || !keys) {
+		ret = -1;
+	}
+
+	while (ret == 1 && !__atomic_load_n(&job->cancelled, __ATOMIC_ACQUIRE)) {
+		ret = dynoc_scan_next(job->iter, &key, &len);
+		if (ret == 1) {
+			/* The scanned key only lives until the next call. */
+			keys[nkey] = malloc(len + 1);
+			if (!keys[nkey]) {
+				ret = -1;
+				break;
+			}
+			memcpy(keys[nkey], key, len);
+			keys[nkey][len] = '\0';
+			if (job_format(job, &reqs[nkey], keys[nkey], len) < 0) {
+				free(keys[nkey]);
+				ret = -1;
+				break;
+			}
+			nkey++;
+		}
+
+		if (nkey && (nkey == (uint32_t)job->opts.batch || ret != 1)) {
+			job_batch(job, reqs, keys, nkey);
+			total += nkey;
+			nkey = 0;
+
+			pthread_mutex_lock(&job->lock);
+			job->progress.scanned = total;
+			progress = job->progress;
+			pthread_mutex_unlock(&job->lock);
+			if (job->cb) {
+				job->cb(&progress, job->arg);
+			}
+			job_throttle(job, start, total);
+		}
+
+		if (ret != 1) {
+			break;
+		}
+	}
+
+	if (nkey) {
+		job_batch(job, reqs, keys, nkey);
+		total += nkey;
+	}
+	free(reqs);
+	free(keys);
+
+	pthread_mutex_lock(&job->lock);
+	job->progress.scanned = total;
+	job->progress.done = 1;
+	job->progress.error = ret < 0;
+	progress = job->progress;
+	pthread_mutex_unlock(&job->lock);
+	if (job->cb) {
+		job->cb(&progress, job->arg);
+	}
+	return NULL;
+}
+
+struct job *
+dynoc_job_start(struct dynoc *dynoc, const char *pattern, job_action_t action,
+                const struct job_options *opts, job_progress_t cb, void *arg) {
+	struct job *job;
+
+	if (action < JOB_DEL || action > JOB_PERSIST || !pattern) {
+		return NULL;
+	}
+	/* EXPIRE 0 would delete every key. */
+	if (action == JOB_EXPIRE && (!opts || opts->seconds <= 0)) {
+		return NULL;
+	}
+	if (opts && (opts->batch < 0 || opts->rate < 0 || opts->count < 0)) {
+		return NULL;
+	}
+
+	job = calloc(1, sizeof(*job));
+	if (!job) {
+		return NULL;
+	}
+	if (opts) {
+		job->opts = *opts;
+	}
+	if (!job->opts.batch) {
+		job->opts.batch = JOB_BATCH;
+	}
+	job->dynoc = dynoc;
+	job->action = action;
+	job->cb = cb;
+	job->arg = arg;
+	job->retry_tokens = (int64_t)dynoc->retry.budget_reserve * RETRY_TOKEN;
+
+	/* Room for a few batches, so scanning runs ahead of the actions. */
+	job->iter = dynoc_scan_iter(dynoc, job->opts.rack, pattern, job->opts.count, job->opts.batch * 4);
+	if (!job->iter) {
+		free(job);
+		return NULL;
+	}
+
+	pthread_mutex_init(&job->lock, NULL);
+	if (pthread_create(&job->tid, NULL, job_thread, job) != 0) {
+		pthread_mutex_destroy(&job->lock);
+		dynoc_scan_iter_free(job->iter);
+		free(job);
+		return NULL;
+	}
+	return job;
+}
+
+void
+dynoc_job_progress(struct job *job, struct job_progress *progress) {
+	pthread_mutex_lock(&job->lock);
+	*progress = job->progress;
+	pthread_mutex_unlock(&job->lock);
+}
+
+void
+dynoc_job_cancel(struct job *job) {
+	__atomic_store_n(&job->cancelled, 1, __ATOMIC_RELEASE);
+}
+
+int
+dynoc_job_wait(struct job *job, struct job_progress *progress) {
+	int ret;
+
+	pthread_join(job->tid, NULL);
+	dynoc_scan_iter_free(job->iter);
+
+	if (progress) {
+		*progress = job->progress;
+	}
+	ret = job->progress.error || job->progress.failed || job->cancelled ? -1 : 0;
+
+	pthread_mutex_destroy(&job->lock);
+	free(job);
+	return ret;
+}
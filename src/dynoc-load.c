@@ -0,0 +1,673 @@
+/*
+ * Dynoc is a minimalistic C client library for the dynomite.
+ * Copyright (C) 2016-2017 huya.com, Lampman Yao
+ */
+
+/*
+ * Dynomite - A thin, distributed replication layer for multi non-distributed storages.
+ * Copyright (C) 2014 Netflix, Inc.
+ */
+
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "dynoc-debug.h"
+#include "dynoc-conn.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LOAD_THREADS 4
+#define LOAD_WINDOW  256
+#define LOAD_TIMEOUT 30000    /* ms without a reply before in-flight records fail, if no command timeout */
+#define LOAD_FLUSH   (64 * 1024)
+
+struct load {
+	struct dynoc *dynoc;
+	/* The rack written to first, then the others of its datacenter. */
+	struct rack **racks;
+	uint32_t nrack;
+	load_format_t format;
+	uint32_t window;
+	int timeout;
+};
+
+/* A record sent and waiting for its reply. */
+struct load_record {
+	const char *key;
+	size_t keylen;
+};
+
+/*
+ * A worker's own connection to a node, indexed by the node's slot like a
+ * thread context, with its records in flight in reply order.
+ */
+struct load_node {
+	struct redis_connection *shared;
+	struct load_record *fifo;
+	uint32_t head;
+	uint32_t count;
+	size_t unsent;
+};
+
+struct load_worker {
+	struct load *load;
+	const char *start;
+	const char *end;
+	pthread_t tid;
+	int started;
+
+	struct redis_connection *conns;
+	struct load_node *nodes;
+	struct pollfd *pfds;
+	uint32_t *polled;
+	char *buf;
+	size_t used;
+	size_t size;
+
+	struct load_stats stats;
+};
+
+/* Parse a decimal length terminated by CRLF. */
+static const char *
+resp_len(const char *p, const char *end, long *len) {
+	long n = 0;
+
+	if (p >= end || *p < '0' || *p > '9') {
+		return NULL;
+	}
+	while (p < end && *p >= '0' && *p <= '9') {
+		n = n * 10 + (*p++ - '0');
+		if (n > 512L * 1024 * 1024) {
+			return NULL;
+		}
+	}
+	if (end - p < 2 || p[0] != '\r' || p[1] != '\n') {
+		return NULL;
+	}
+	*len = n;
+	return p + 2;
+}
+
+/*
+ * One command in RESP ("*N\r\n$len\r\narg\r\n" ..), as written by
+ * redis-cli --pipe style tools. Returns the end of the record and its
+ * first argument, the key, or NULL if the input is malformed.
+ */
+static const char *
+resp_record(const char *p, const char *end, const char **key, size_t *keylen) {
+	long argc, len, i;
+
+	if (p >= end || *p != '*' || !(p = resp_len(p + 1, end, &argc)) || argc < 2) {
+		return NULL;
+	}
+	for (i = 0; i < argc; i++) {
+		if (p >= end || *p != '$' || !(p = resp_len(p + 1, end, &len))) {
+			return NULL;
+		}
+		if (end - p < len + 2 || p[len] != '\r' || p[len + 1] != '\n') {
+			return NULL;
+		}
+		if (i == 1) {
+			*key = p;
+			*keylen = len;
+		}
+		p += len + 2;
+	}
+	return p;
+}
+
+static int
+buf_reserve(struct load_worker *worker, size_t len) {
+	char *buf;
+	size_t size;
+
+	if (worker->used + len <= worker->size) {
+		return 0;
+	}
+	size = worker->size ? worker->size : 64 * 1024;
+	while (size < worker->used + len) {
+		size *= 2;
+	}
+	buf = realloc(worker->buf, size);
+	if (!buf) {
+		return -1;
+	}
+	worker->buf = buf;
+	worker->size = size;
+	return 0;
+}
+
+static void
+buf_arg(struct load_worker *worker, const char *arg, size_t len) {
+	worker->used += sprintf(worker->buf + worker->used, "$%zu\r\n", len);
+	memcpy(worker->buf + worker->used, arg, len);
+	worker->used += len;
+	memcpy(worker->buf + worker->used, "\r\n", 2);
+	worker->used += 2;
+}
+
+/* Format a TSV line as SET, SETEX or HSET into the worker buffer. */
+static int
+tsv_record(struct load_worker *worker, const char *p, const char *end, const char **key, size_t *keylen) {
+	const char *cols[4];
+	size_t lens[4], need = 0;
+	const char *tab;
+	int ncol = 0, i;
+
+	while (ncol < 4) {
+		tab = memchr(p, '\t', end - p);
+		cols[ncol] = p;
+		lens[ncol] = (tab ? tab : end) - p;
+		ncol++;
+		if (!tab) {
+			break;
+		}
+		p = tab + 1;
+	}
+	if (ncol == 4) {
+		return -1;
+	}
+
+	if (worker->load->format == LOAD_TSV_HASH) {
+		if (ncol != 3) {
+			return -1;
+		}
+		/* key, field, value */
+		memmove(cols + 1, cols, sizeof(cols[0]) * 3);
+		memmove(lens + 1, lens, sizeof(lens[0]) * 3);
+		cols[0] = "HSET";
+		lens[0] = 4;
+	} else if (ncol == 2) {
+		/* key, value */
+		memmove(cols + 1, cols, sizeof(cols[0]) * 2);
+		memmove(lens + 1, lens, sizeof(lens[0]) * 2);
+		cols[0] = "SET";
+		lens[0] = 3;
+	} else if (ncol == 3) {
+		/* key, value, seconds */
+		for (i = 0; i < (int)lens[2]; i++) {
+			if (cols[2][i] < '0' || cols[2][i] > '9') {
+				return -1;
+			}
+		}
+		if (!lens[2]) {
+			return -1;
+		}
+		cols[3] = cols[1];
+		lens[3] = lens[1];
+		cols[1] = cols[0];
+		lens[1] = lens[0];
+		cols[0] = "SETEX";
+		lens[0] = 5;
+	} else {
+		return -1;
+	}
+	ncol++;
+
+	for (i = 0; i < ncol; i++) {
+		need += lens[i] + 32;
+	}
+	if (buf_reserve(worker, need + 16) < 0) {
+		return -1;
+	}
+	worker->used += sprintf(worker->buf + worker->used, "*%d\r\n", ncol);
+	for (i = 0; i < ncol; i++) {
+		buf_arg(worker, cols[i], lens[i]);
+	}
+
+	*key = cols[1];
+	*keylen = lens[1];
+	return 0;
+}
+
+static void
+load_failed(struct load_worker *worker, const char *key, size_t keylen, const char *why) {
+	log_debug("load of %.*s failed: %s", (int)keylen, key, why);
+	worker->stats.failed++;
+}
+
+/* The connection broke or timed out, its records in flight are lost. */
+static void
+load_node_fail(struct load_worker *worker, struct load_node *node, const char *why) {
+	struct redis_connection *redis_conn = &worker->conns[node->shared->slot];
+	struct load_record *record;
+
+	node->unsent = 0;
+	while (node->count) {
+		record = &node->fifo[node->head];
+		load_failed(worker, record->key, record->keylen, why);
+		node->head = (node->head + 1) % worker->load->window;
+		node->count--;
+	}
+	reset_redis_connection(redis_conn);
+	connection_failed(node->shared, redis_conn);
+}
+
+static void
+load_node_replies(struct load_worker *worker, struct load_node *node) {
+	redisContext *ctx = worker->conns[node->shared->slot].ctx;
+	struct load_record *record;
+	redisReply *reply;
+
+	while (node->count) {
+		reply = NULL;
+		if (redisGetReplyFromReader(ctx, (void **)&reply) == REDIS_ERR) {
+			load_node_fail(worker, node, "protocol error");
+			return;
+		}
+		if (!reply) {
+			return;
+		}
+
+		record = &node->fifo[node->head];
+		if (reply->type == REDIS_REPLY_ERROR) {
+			load_failed(worker, record->key, record->keylen, reply->str);
+		} else {
+			worker->stats.loaded++;
+		}
+		freeReplyObject(reply);
+		node->head = (node->head + 1) % worker->load->window;
+		node->count--;
+	}
+}
+
+static int
+load_node_flush(struct load_worker *worker, struct load_node *node) {
+	redisContext *ctx = worker->conns[node->shared->slot].ctx;
+	int done;
+
+	do {
+		if (redisBufferWrite(ctx, &done) == REDIS_ERR) {
+			load_node_fail(worker, node, "write failed");
+			return -1;
+		}
+	} while (!done);
+	node->unsent = 0;
+	return 0;
+}
+
+/*
+ * Send what is buffered and take the replies of every node that has some,
+ * until `full` (if any) has room again or, without it, nothing is in
+ * flight. Nodes keep their own window: a slow one only holds up the
+ * records routed to it.
+ */
+static void
+load_wait(struct load_worker *worker, struct load_node *full) {
+	struct load *load = worker->load;
+	struct load_node *node;
+	uint32_t npfd, i;
+	int rv;
+
+	for (i = 0; i < load->dynoc->nslots; i++) {
+		node = &worker->nodes[i];
+		if (node->count) {
+			load_node_flush(worker, node);
+		}
+	}
+
+	while (!full || full->count == load->window) {
+		for (i = 0, npfd = 0; i < load->dynoc->nslots; i++) {
+			node = &worker->nodes[i];
+			if (node->count) {
+				worker->pfds[npfd].fd = worker->conns[i].ctx->fd;
+				worker->pfds[npfd].events = POLLIN;
+				worker->pfds[npfd].revents = 0;
+				worker->polled[npfd++] = i;
+			}
+		}
+		if (!npfd) {
+			break;
+		}
+
+		rv = poll(worker->pfds, npfd, load->timeout);
+		if (rv < 0 && errno == EINTR) {
+			continue;
+		}
+		for (i = 0; i < npfd; i++) {
+			node = &worker->nodes[worker->polled[i]];
+			if (rv <= 0) {
+				load_node_fail(worker, node, "timed out");
+			} else if (worker->pfds[i].revents) {
+				if (redisBufferRead(worker->conns[worker->polled[i]].ctx) == REDIS_ERR) {
+					load_node_fail(worker, node, "read failed");
+				} else {
+					load_node_replies(worker, node);
+				}
+			}
+		}
+	}
+}
+
+/*
+ * The node a record goes to: its owner in the rack written to, or in the
+ * next rack of the datacenter while that one is down, as for single-key
+ * writes. NULL if no rack has it up.
+ */
+static struct load_node *
+load_route(struct load_worker *worker, const char *key, size_t keylen) {
+	struct load *load = worker->load;
+	struct redis_connection *shared, *redis_conn;
+	uint32_t i;
+
+	for (i = 0; i < load->nrack; i++) {
+		shared = rack_owner(load->dynoc, load->racks[i], key, keylen);
+		if (node_down(shared)) {
+			continue;
+		}
+
+		redis_conn = &worker->conns[shared->slot];
+		if (!redis_conn->status) {
+			redis_conn->endpoint = shared->endpoint;
+			redis_conn->slot = shared->slot;
+			redis_conn->cold = 1;
+		}
+		if (!connection_ready(load->dynoc, redis_conn)) {
+			connection_failed(shared, redis_conn);
+			continue;
+		}
+
+		worker->nodes[shared->slot].shared = shared;
+		return &worker->nodes[shared->slot];
+	}
+	return NULL;
+}
+
+static void *
+load_thread(void *arg) {
+	struct load_worker *worker = arg;
+	struct load *load = worker->load;
+	struct load_node *node;
+	struct load_record *record;
+	redisContext *ctx;
+	const char *p = worker->start, *next, *eol, *key, *cmd;
+	size_t keylen, len;
+
+	while (p < worker->end) {
+		worker->used = 0;
+		if (load->format == LOAD_RESP) {
+			next = resp_record(p, worker->end, &key, &keylen);
+			if (!next) {
+				/* There is no telling where the next record starts. */
+				log_debug("malformed RESP at offset %zu of the chunk", (size_t)(p - worker->start));
+				worker->stats.malformed++;
+				break;
+			}
+			/* Sent straight from the mapping. */
+			cmd = p;
+			len = next - p;
+		} else {
+			eol = memchr(p, '\n', worker->end - p);
+			next = eol ? eol + 1 : worker->end;
+			eol = eol ? eol : worker->end;
+			if (eol > p && eol[-1] == '\r') {
+				eol--;
+			}
+			if (eol == p) {
+				p = next;
+				continue;
+			}
+			if (tsv_record(worker, p, eol, &key, &keylen) < 0) {
+				worker->stats.malformed++;
+				p = next;
+				continue;
+			}
+			cmd = worker->buf;
+			len = worker->used;
+		}
+		worker->stats.records++;
+		p = next;
+
+		node = load_route(worker, key, keylen);
+		if (!node) {
+			load_failed(worker, key, keylen, "no node up");
+			continue;
+		}
+		if (node->count == load->window) {
+			load_wait(worker, node);
+			/* Waiting may have failed the node, route the record again. */
+			if (!worker->conns[node->shared->slot].status && !(node = load_route(worker, key, keylen))) {
+				load_failed(worker, key, keylen, "no node up");
+				continue;
+			}
+		}
+
+		/* hiredis copies the command, the worker buffer is free again. */
+		ctx = worker->conns[node->shared->slot].ctx;
+		if (redisAppendFormattedCommand(ctx, cmd, len) != REDIS_OK) {
+			load_failed(worker, key, keylen, "out of memory");
+			continue;
+		}
+		record = &node->fifo[(node->head + node->count) % load->window];
+		record->key = key;
+		record->keylen = keylen;
+		node->count++;
+
+		node->unsent += len;
+		if (node->unsent >= LOAD_FLUSH) {
+			load_node_flush(worker, node);
+		}
+	}
+
+	load_wait(worker, NULL);
+	return NULL;
+}
+
+/* Split points at record boundaries, chunk `i` is [splits[i], splits[i + 1]). */
+static void
+load_split(const char *data, size_t size, load_format_t format, const char **splits, uint32_t n) {
+	const char *p = data, *end = data + size, *key, *next;
+	size_t keylen;
+	uint32_t i;
+
+	splits[0] = data;
+	splits[n] = end;
+	for (i = 1; i < n; i++) {
+		const char *target = data + size / n * i;
+
+		if (format != LOAD_RESP) {
+			p = target > splits[i - 1] ? target : splits[i - 1];
+			next = memchr(p, '\n', end - p);
+			splits[i] = next ? next + 1 : end;
+			continue;
+		}
+
+		/* RESP cannot be resynchronized, walk the headers up to the target. */
+		while (p < target && (next = resp_record(p, end, &key, &keylen))) {
+			p = next;
+		}
+		splits[i] = p < target ? end : p;
+	}
+}
+
+static int
+load_worker_init(struct load_worker *worker) {
+	struct load *load = worker->load;
+	uint32_t nslots = load->dynoc->nslots, i;
+
+	if (posix_memalign((void **)&worker->conns, CACHE_LINE_SIZE, nslots * sizeof(*worker->conns)) != 0) {
+		worker->conns = NULL;
+		return -1;
+	}
+	memset(worker->conns, 0, nslots * sizeof(*worker->conns));
+
+	worker->nodes = calloc(nslots, sizeof(*worker->nodes));
+	worker->pfds = calloc(nslots, sizeof(*worker->pfds));
+	worker->polled = calloc(nslots, sizeof(*worker->polled));
+	if (!worker->nodes || !worker->pfds || !worker->polled) {
+		return -1;
+	}
+	worker->nodes[0].fifo = calloc((size_t)nslots * load->window, sizeof(struct load_record));
+	if (!worker->nodes[0].fifo) {
+		return -1;
+	}
+	for (i = 1; i < nslots; i++) {
+		worker->nodes[i].fifo = worker->nodes[0].fifo + (size_t)i * load->window;
+	}
+	return 0;
+}
+
+static void
+load_worker_free(struct load_worker *worker) {
+	uint32_t i;
+
+	if (worker->conns) {
+		for (i = 0; i < worker->load->dynoc->nslots; i++) {
+			if (worker->conns[i].ctx) {
+				redisFree(worker->conns[i].ctx);
+			}
+		}
+		free(worker->conns);
+	}
+	if (worker->nodes) {
+		free(worker->nodes[0].fifo);
+		free(worker->nodes);
+	}
+	free(worker->pfds);
+	free(worker->polled);
+	free(worker->buf);
+}
+
+int
+dynoc_load(struct dynoc *dynoc, const char *path, load_format_t format,
+           const struct load_options *opts, struct load_stats *stats) {
+	struct load_options defaults;
+	struct datacenter *dc;
+	struct rack *rack;
+	struct load load;
+	struct load_worker *workers;
+	const char **splits;
+	struct stat st;
+	char *data;
+	uint32_t nthread, i;
+	int fd, ret = 0;
+
+	if (format < LOAD_TSV || format > LOAD_RESP) {
+		return -1;
+	}
+	if (!opts) {
+		memset(&defaults, 0, sizeof(defaults));
+		opts = &defaults;
+	}
+	if (opts->threads < 0 || opts->window < 0) {
+		return -1;
+	}
+
+	load.dynoc = dynoc;
+	load.format = format;
+	load.window = opts->window ? opts->window : LOAD_WINDOW;
+	load.timeout = dynoc->command_timeout ? dynoc->command_timeout : LOAD_TIMEOUT;
+	rack = rack_find(dynoc, opts->rack);
+	if (!rack || !rack->ncontinuum) {
+		log_debug("no rack to load into");
+		return -1;
+	}
+	nthread = opts->threads ? opts->threads : LOAD_THREADS;
+
+	/* Records fail over to the other racks of the same datacenter. */
+	dc = dynoc->local_dc;
+	if (!dc || rack < dc->rack || rack >= dc->rack + dc->rack_count) {
+		dc = dynoc->remote_dc;
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+	if (stats) {
+		memset(stats, 0, sizeof(*stats));
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return -1;
+	}
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+	workers = calloc(nthread, sizeof(*workers));
+	splits = calloc(nthread + 1, sizeof(*splits));
+	load.racks = malloc(dc->rack_count * sizeof(*load.racks));
+	if (!workers || !splits || !load.racks) {
+		free(workers);
+		free(splits);
+		free(load.racks);
+		munmap(data, st.st_size);
+		return -1;
+	}
+	load_split(data, st.st_size, format, splits, nthread);
+
+	load.racks[0] = rack;
+	load.nrack = 1;
+	for (i = 0; i < dc->rack_count; i++) {
+		if (&dc->rack[i] != rack && dc->rack[i].ncontinuum) {
+			load.racks[load.nrack++] = &dc->rack[i];
+		}
+	}
+
+	for (i = 0; i < nthread; i++) {
+		struct load_worker *worker = &workers[i];
+
+		worker->load = &load;
+		worker->start = splits[i];
+		worker->end = splits[i + 1];
+		if (load_worker_init(worker) < 0 ||
+		    pthread_create(&worker->tid, NULL, load_thread, worker) != 0) {
+			ret = -1;
+			continue;
+		}
+		worker->started = 1;
+	}
+
+	for (i = 0; i < nthread; i++) {
+		struct load_worker *worker = &workers[i];
+
+		if (worker->started) {
+			pthread_join(worker->tid, NULL);
+		}
+		if (stats) {
+			stats->records += worker->stats.records;
+			stats->loaded += worker->stats.loaded;
+			stats->failed += worker->stats.failed;
+			stats->malformed += worker->stats.malformed;
+		}
+		if (worker->stats.failed || worker->stats.malformed) {
+			ret = -1;
+		}
+		load_worker_free(worker);
+	}
+
+	free(workers);
+	free(splits);
+	free(load.racks);
+	munmap(data, st.st_size);
+	return ret;
+}
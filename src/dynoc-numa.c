@@ -0,0 +1,244 @@
+/*
+ * Dynoc is a minimalistic C client library for the dynomite.
+ * Copyright (C) 2016-2017 huya.com, Lampman Yao
+ */
+
+/*
+ * Dynomite - A thin, distributed replication layer for multi non-distributed storages.
+ * Copyright (C) 2014 Netflix, Inc.
+ */
+
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* sched_getcpu() and the CPU_* macros. */
+#define _GNU_SOURCE
+
+#include "dynoc-debug.h"
+#include "dynoc-conn.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#ifndef NUMA_SYSFS
+#define NUMA_SYSFS "/sys/devices/system/node"
+#endif
+
+#define NUMA_MAX_NODES 64
+
+/*
+ * The NUMA nodes that have CPUs, in id order; "node" below is the index
+ * in that order, which is also the connection shard of the node.
+ */
+struct numa {
+	uint32_t nnode;
+	cpu_set_t cpus[NUMA_MAX_NODES];
+	uint8_t cpu_node[CPU_SETSIZE];
+};
+
+/* The affinity a thread had before numa_run_on(). */
+static __thread cpu_set_t thread_saved;
+static __thread int thread_pinned;
+
+/* Parse a sysfs cpu list such as "0-15,32-47". Returns the CPU count. */
+static int
+cpulist_parse(const char *list, cpu_set_t *set) {
+	const char *p = list;
+	char *end;
+	long lo, hi, cpu;
+	int n = 0;
+
+	CPU_ZERO(set);
+	while (*p && !isspace((unsigned char)*p)) {
+		lo = strtol(p, &end, 10);
+		if (end == p) {
+			return -1;
+		}
+		hi = lo;
+		p = end;
+		if (*p == '-') {
+			hi = strtol(p + 1, &end, 10);
+			p = end;
+		}
+		for (cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++) {
+			CPU_SET(cpu, set);
+			n++;
+		}
+		if (*p == ',') {
+			p++;
+		}
+	}
+	return n;
+}
+
+static int
+node_cmp(const void *a, const void *b) {
+	return *(const int *)a - *(const int *)b;
+}
+
+static int
+numa_discover(struct numa *numa) {
+	char path[256], list[4096];
+	int ids[NUMA_MAX_NODES], nid = 0, id, cpu, i;
+	struct dirent *entry;
+	FILE *fp;
+	DIR *dir;
+
+	dir = opendir(NUMA_SYSFS);
+	if (!dir) {
+		return -1;
+	}
+	while ((entry = readdir(dir)) && nid < NUMA_MAX_NODES) {
+		if (sscanf(entry->d_name, "node%d", &id) == 1) {
+			ids[nid++] = id;
+		}
+	}
+	closedir(dir);
+	qsort(ids, nid, sizeof(*ids), node_cmp);
+
+	numa->nnode = 0;
+	for (i = 0; i < nid; i++) {
+		snprintf(path, sizeof(path), NUMA_SYSFS "/node%d/cpulist", ids[i]);
+		fp = fopen(path, "r");
+		if (!fp) {
+			continue;
+		}
+		if (!fgets(list, sizeof(list), fp)) {
+			list[0] = '\0';
+		}
+		fclose(fp);
+
+		/* Memory only nodes get no shard. */
+		if (cpulist_parse(list, &numa->cpus[numa->nnode]) > 0) {
+			for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+				if (CPU_ISSET(cpu, &numa->cpus[numa->nnode])) {
+					numa->cpu_node[cpu] = numa->nnode;
+				}
+			}
+			numa->nnode++;
+		}
+	}
+	return numa->nnode ? 0 : -1;
+}
+
+int
+dynoc_numa_init(struct dynoc *dynoc) {
+	struct numa *numa;
+
+	if (dynoc->numa) {
+		return dynoc->numa->nnode;
+	}
+
+	numa = calloc(1, sizeof(*numa));
+	if (!numa) {
+		return -1;
+	}
+	if (numa_discover(numa) < 0) {
+		log_debug("no NUMA topology in %s", NUMA_SYSFS);
+		free(numa);
+		return -1;
+	}
+	if (numa->nnode == 1) {
+		free(numa);
+		return 1;
+	}
+
+	dynoc->numa = numa;
+	return numa->nnode;
+}
+
+int
+dynoc_numa_bind(struct dynoc *dynoc, int node) {
+	if (!dynoc->numa || node < 0 || (uint32_t)node >= dynoc->numa->nnode) {
+		return -1;
+	}
+	return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &dynoc->numa->cpus[node]) == 0 ? 0 : -1;
+}
+
+uint32_t
+numa_shards(struct dynoc *dynoc) {
+	return dynoc->numa ? dynoc->numa->nnode : 1;
+}
+
+uint32_t
+numa_current(struct dynoc *dynoc) {
+	int cpu;
+
+	if (!dynoc->numa) {
+		return 0;
+	}
+	cpu = sched_getcpu();
+	return cpu >= 0 && cpu < CPU_SETSIZE ? dynoc->numa->cpu_node[cpu] : 0;
+}
+
+void
+numa_run_on(struct dynoc *dynoc, uint32_t node) {
+	if (!dynoc->numa) {
+		return;
+	}
+	if (!thread_pinned && sched_getaffinity(0, sizeof(thread_saved), &thread_saved) == 0) {
+		thread_pinned = 1;
+	}
+	sched_setaffinity(0, sizeof(cpu_set_t), &dynoc->numa->cpus[node]);
+}
+
+void
+numa_run_anywhere(struct dynoc *dynoc) {
+	if (thread_pinned) {
+		sched_setaffinity(0, sizeof(thread_saved), &thread_saved);
+		thread_pinned = 0;
+	}
+}
+
+/*
+ * Pages of their own, first touched from a CPU of `node` so the kernel
+ * places them there. This places the slots only: hiredis contexts and
+ * their buffers come from malloc() in whichever thread connects, which
+ * is why connect_nodes() pins itself to the shard's CPUs while it
+ * installs the context of an attempt that names its shard.
+ */
+struct redis_connection *
+numa_pool_alloc(struct dynoc *dynoc, uint32_t node, uint32_t count) {
+	size_t len = count * sizeof(struct redis_connection);
+	void *pool;
+
+	pool = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (pool == MAP_FAILED) {
+		return NULL;
+	}
+	numa_run_on(dynoc, node);
+	memset(pool, 0, len);
+	numa_run_anywhere(dynoc);
+	return pool;
+}
+
+void
+numa_pool_free(struct redis_connection *pool, uint32_t count) {
+	munmap(pool, count * sizeof(struct redis_connection));
+}
+
+void
+numa_destroy(struct dynoc *dynoc) {
+	free(dynoc->numa);
+	dynoc->numa = NULL;
+}
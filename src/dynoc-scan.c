@@ -0,0 +1,333 @@
+/*
+ * Dynoc is a minimalistic C client library for the dynomite.
+ * Copyright (C) 2016-2017 huya.com, Lampman Yao
+ */
+
+/*
+ * Dynomite - A thin, distributed replication layer for multi non-distributed storages.
+ * Copyright (C) 2014 Netflix, Inc.
+ */
+
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "dynoc-debug.h"
+#include "dynoc-conn.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SCAN_QUEUE_SIZE 1024
+#define SCAN_CURSOR_LEN 32
+
+struct scan_node {
+	struct scan_iter *iter;
+	struct redis_connection *redis_conn;
+	pthread_t tid;
+};
+
+struct scan_iter {
+	struct dynoc *dynoc;
+	char *match;
+	int count;
+
+	pthread_mutex_t lock;
+	pthread_cond_t not_full;
+	pthread_cond_t not_empty;
+	char **keys;
+	size_t *lens;
+	size_t size;
+	size_t head;
+	size_t nqueued;
+	uint32_t nrunning;
+	int failed;
+	int stopped;
+	char *current;
+
+	struct scan_node *nodes;
+	uint32_t nnode;
+};
+
+struct rack *
+rack_find(struct dynoc *dynoc, const char *name) {
+	struct datacenter *dcs[2] = { dynoc->local_dc, dynoc->remote_dc };
+	uint32_t i, j;
+
+	for (i = 0; i < 2; i++) {
+		if (!dcs[i]) {
+			continue;
+		}
+		for (j = 0; j < dcs[i]->rack_count; j++) {
+			if (!name || (dcs[i]->rack[j].name && strcmp(dcs[i]->rack[j].name, name) == 0)) {
+				return &dcs[i]->rack[j];
+			}
+		}
+	}
+	return NULL;
+}
+
+/* Queue a key, waiting while the queue is full. Takes ownership of `key`. */
+static int
+scan_push(struct scan_iter *iter, char *key, size_t len) {
+	pthread_mutex_lock(&iter->lock);
+	while (iter->nqueued == iter->size && !iter->stopped) {
+		pthread_cond_wait(&iter->not_full, &iter->lock);
+	}
+	if (iter->stopped) {
+		pthread_mutex_unlock(&iter->lock);
+		free(key);
+		return -1;
+	}
+	iter->keys[(iter->head + iter->nqueued) % iter->size] = key;
+	iter->lens[(iter->head + iter->nqueued) % iter->size] = len;
+	iter->nqueued++;
+	pthread_cond_signal(&iter->not_empty);
+	pthread_mutex_unlock(&iter->lock);
+	return 0;
+}
+
+static redisReply *
+scan_command(struct dynoc *dynoc, struct redis_connection *redis_conn, const char *cursor,
+             const char *match, int count) {
+	redisReply *reply;
+
+	pthread_mutex_lock(&redis_conn->lock);
+	if (!connection_ready(dynoc, redis_conn)) {
+		pthread_mutex_unlock(&redis_conn->lock);
+		return NULL;
+	}
+
+	/* The pattern is passed with its length, as one argument whatever it holds. */
+	if (match && count) {
+		reply = redisCommand(redis_conn->ctx, "SCAN %s MATCH %b COUNT %d", cursor, match, strlen(match), count);
+	} else if (match) {
+		reply = redisCommand(redis_conn->ctx, "SCAN %s MATCH %b", cursor, match, strlen(match));
+	} else if (count) {
+		reply = redisCommand(redis_conn->ctx, "SCAN %s COUNT %d", cursor, count);
+	} else {
+		reply = redisCommand(redis_conn->ctx, "SCAN %s", cursor);
+	}
+
+	if (reply && (reply->type != REDIS_REPLY_ARRAY || reply->elements != 2 ||
+	    reply->element[0]->type != REDIS_REPLY_STRING ||
+	    reply->element[1]->type != REDIS_REPLY_ARRAY)) {
+		log_debug("unexpected SCAN reply");
+		freeReplyObject(reply);
+		reply = NULL;
+	}
+	if (!reply) {
+		reset_redis_connection(redis_conn);
+	}
+	pthread_mutex_unlock(&redis_conn->lock);
+	return reply;
+}
+
+/*
+ * Walk one node from cursor 0 back to 0. The pooled connection is only
+ * held for each SCAN round trip, never while `cb` runs. A failed round
+ * trip is tried once more from the same cursor, after reconnecting right
+ * away rather than waiting for the health check.
+ */
+int
+scan_node(struct dynoc *dynoc, struct redis_connection *redis_conn, const char *match, int count,
+          const int *stopped, scan_batch_t cb, void *arg) {
+	char cursor[SCAN_CURSOR_LEN] = "0";
+	struct conn_attempt attempt;
+	redisReply *reply;
+	int retried = 0, stop;
+
+	while (!__atomic_load_n(stopped, __ATOMIC_ACQUIRE)) {
+		reply = scan_command(dynoc, redis_conn, cursor, match, count);
+		if (!reply) {
+			if (retried++) {
+				log_debug("scan of %s:%d failed", redis_conn->endpoint->host, redis_conn->endpoint->port);
+				return -1;
+			}
+			attempt.redis_conn = redis_conn;
+			attempt.endpoint = redis_conn->endpoint;
+			attempt.sockopts = &dynoc->sockopts;
+			/* Bulk paths use shard 0, its contexts belong on node 0. */
+			attempt.dynoc = dynoc;
+			attempt.shard = 0;
+			connect_nodes(&attempt, 1, dynoc->connect_timeout);
+			continue;
+		}
+		retried = 0;
+
+		snprintf(cursor, sizeof(cursor), "%s", reply->element[0]->str);
+		stop = cb(redis_conn, reply->element[1], arg) < 0;
+		freeReplyObject(reply);
+
+		if (stop || strcmp(cursor, "0") == 0) {
+			break;
+		}
+	}
+	return 0;
+}
+
+static int
+scan_queue(struct redis_connection *redis_conn, redisReply *keys, void *arg) {
+	struct scan_iter *iter = arg;
+	int stop;
+	size_t i;
+
+	for (i = 0; i < keys->elements; i++) {
+		if (keys->element[i]->type != REDIS_REPLY_STRING) {
+			continue;
+		}
+		/* Hand the string over instead of copying it. */
+		stop = scan_push(iter, keys->element[i]->str, keys->element[i]->len) < 0;
+		keys->element[i]->str = NULL;
+		if (stop) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void *
+scan_thread(void *arg) {
+	struct scan_node *node = arg;
+	struct scan_iter *iter = node->iter;
+	int failed;
+
+	failed = scan_node(iter->dynoc, node->redis_conn, iter->match, iter->count,
+	                   &iter->stopped, scan_queue, iter) < 0;
+
+	pthread_mutex_lock(&iter->lock);
+	iter->failed |= failed;
+	iter->nrunning--;
+	pthread_cond_broadcast(&iter->not_empty);
+	pthread_mutex_unlock(&iter->lock);
+	return NULL;
+}
+
+struct scan_iter *
+dynoc_scan_iter(struct dynoc *dynoc, const char *rack_name, const char *match, int count, size_t queue_size) {
+	struct scan_iter *iter;
+	struct rack *rack;
+	uint32_t i;
+
+	rack = rack_find(dynoc, rack_name);
+	if (!rack || !rack->ncontinuum || count < 0) {
+		log_debug("no rack to scan");
+		return NULL;
+	}
+
+	iter = calloc(1, sizeof(*iter));
+	if (!iter) {
+		return NULL;
+	}
+	iter->dynoc = dynoc;
+	iter->count = count;
+	iter->size = queue_size ? queue_size : SCAN_QUEUE_SIZE;
+	iter->match = match ? strdup(match) : NULL;
+	iter->keys = calloc(iter->size, sizeof(*iter->keys));
+	iter->lens = calloc(iter->size, sizeof(*iter->lens));
+	iter->nodes = calloc(rack->ncontinuum, sizeof(*iter->nodes));
+	if ((match && !iter->match) || !iter->keys || !iter->lens || !iter->nodes) {
+		free(iter->match);
+		free(iter->keys);
+		free(iter->lens);
+		free(iter->nodes);
+		free(iter);
+		return NULL;
+	}
+	pthread_mutex_init(&iter->lock, NULL);
+	pthread_cond_init(&iter->not_full, NULL);
+	pthread_cond_init(&iter->not_empty, NULL);
+
+	pthread_mutex_lock(&iter->lock);
+	for (i = 0; i < rack->ncontinuum; i++) {
+		struct scan_node *node = &iter->nodes[iter->nnode];
+
+		node->iter = iter;
+		node->redis_conn = &rack->redis_conn_pool[i];
+		iter->nrunning++;
+		if (pthread_create(&node->tid, NULL, scan_thread, node) != 0) {
+			iter->nrunning--;
+			iter->failed = 1;
+			continue;
+		}
+		iter->nnode++;
+	}
+	pthread_mutex_unlock(&iter->lock);
+
+	return iter;
+}
+
+int
+dynoc_scan_next(struct scan_iter *iter, const char **key, size_t *len) {
+	int ret;
+
+	free(iter->current);
+	iter->current = NULL;
+
+	pthread_mutex_lock(&iter->lock);
+	while (iter->nqueued == 0 && iter->nrunning) {
+		pthread_cond_wait(&iter->not_empty, &iter->lock);
+	}
+
+	if (iter->nqueued) {
+		iter->current = iter->keys[iter->head];
+		*key = iter->current;
+		if (len) {
+			*len = iter->lens[iter->head];
+		}
+		iter->head = (iter->head + 1) % iter->size;
+		iter->nqueued--;
+		pthread_cond_signal(&iter->not_full);
+		ret = 1;
+	} else {
+		ret = iter->failed ? -1 : 0;
+	}
+	pthread_mutex_unlock(&iter->lock);
+	return ret;
+}
+
+void
+dynoc_scan_iter_free(struct scan_iter *iter) {
+	uint32_t i;
+
+	if (!iter) {
+		return;
+	}
+
+	pthread_mutex_lock(&iter->lock);
+	iter->stopped = 1;
+	pthread_cond_broadcast(&iter->not_full);
+	pthread_mutex_unlock(&iter->lock);
+
+	for (i = 0; i < iter->nnode; i++) {
+		pthread_join(iter->nodes[i].tid, NULL);
+	}
+
+	while (iter->nqueued) {
+		free(iter->keys[iter->head]);
+		iter->head = (iter->head + 1) % iter->size;
+		iter->nqueued--;
+	}
+	free(iter->current);
+	pthread_cond_destroy(&iter->not_full);
+	pthread_cond_destroy(&iter->not_empty);
+	pthread_mutex_destroy(&iter->lock);
+	free(iter->match);
+	free(iter->keys);
+	free(iter->lens);
+	free(iter->nodes);
+	free(iter);
+}
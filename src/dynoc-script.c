@@ -0,0 +1,314 @@
+/*
+ * Dynoc is a minimalistic C client library for the dynomite.
+ * Copyright (C) 2016-2017 huya.com, Lampman Yao
+ */
+
+/*
+ * Dynomite - A thin, distributed replication layer for multi non-distributed storages.
+ * Copyright (C) 2014 Netflix, Inc.
+ */
+
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "dynoc-debug.h"
+#include "dynoc-conn.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SHA1_ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void
+sha1_block(uint32_t *h, const unsigned char *p) {
+	uint32_t w[80], a, b, c, d, e, f, k, t;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 |
+		       (uint32_t)p[i * 4 + 2] << 8 | (uint32_t)p[i * 4 + 3];
+	}
+	for (i = 16; i < 80; i++) {
+		w[i] = SHA1_ROTL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+	}
+
+	a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+	for (i = 0; i < 80; i++) {
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5a827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ed9eba1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8f1bbcdc;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xca62c1d6;
+		}
+		t = SHA1_ROTL(a, 5) + f + e + k + w[i];
+		e = d; d = c; c = SHA1_ROTL(b, 30); b = a; a = t;
+	}
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+}
+
+/* SHA1 of `len` bytes as 40 lowercase hex digits, as SCRIPT LOAD returns. */
+static void
+sha1_hex(const char *data, size_t len, char *hex) {
+	uint32_t h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+	unsigned char tail[128];
+	uint64_t bits = (uint64_t)len * 8;
+	size_t done = len & ~(size_t)63, rest = len - done, n;
+	int i;
+
+	for (n = 0; n < done; n += 64) {
+		sha1_block(h, (const unsigned char *)data + n);
+	}
+
+	memset(tail, 0, sizeof(tail));
+	memcpy(tail, data + done, rest);
+	tail[rest] = 0x80;
+	n = rest < 56 ? 64 : 128;
+	for (i = 0; i < 8; i++) {
+		tail[n - 1 - i] = (unsigned char)(bits >> (i * 8));
+	}
+	sha1_block(h, tail);
+	if (n == 128) {
+		sha1_block(h, tail + 64);
+	}
+
+	for (i = 0; i < 5; i++) {
+		sprintf(hex + i * 8, "%08x", h[i]);
+	}
+}
+
+static struct script *
+find_script(struct script *scripts, const char *sha) {
+	struct script *script;
+
+	for (script = scripts; script; script = script->next) {
+		if (strcasecmp(script->sha, sha) == 0) {
+			return script;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Scripts are registered while commands run, so the list is only ever
+ * pushed to, with a compare and swap, and never changes behind a reader.
+ */
+static struct script *
+register_script(struct dynoc *dynoc, const char *body) {
+	struct script *script, *head, *found;
+	char sha[41];
+	size_t len = strlen(body);
+
+	sha1_hex(body, len, sha);
+	found = find_script(__atomic_load_n(&dynoc->scripts, __ATOMIC_ACQUIRE), sha);
+	if (found) {
+		return found;
+	}
+
+	script = malloc(sizeof(*script));
+	if (!script) {
+		return NULL;
+	}
+	script->body = strdup(body);
+	if (!script->body) {
+		free(script);
+		return NULL;
+	}
+	script->len = len;
+	memcpy(script->sha, sha, sizeof(sha));
+
+	do {
+		head = __atomic_load_n(&dynoc->scripts, __ATOMIC_ACQUIRE);
+		found = find_script(head, sha);
+		if (found) {
+			free(script->body);
+			free(script);
+			return found;
+		}
+		script->index = head ? head->index + 1 : 0;
+		script->next = head;
+	} while (!__sync_bool_compare_and_swap(&dynoc->scripts, head, script));
+
+	return script;
+}
+
+/*
+ * Load the scripts registered since the last call on this connection, in
+ * one pipeline. Called by the health check with the connection locked and
+ * drained. Returns -1 if the connection failed.
+ */
+int
+script_preload(struct dynoc *dynoc, struct redis_connection *redis_conn) {
+	struct script *head, *script;
+	redisReply *reply;
+	uint32_t n = 0;
+
+	head = __atomic_load_n(&dynoc->scripts, __ATOMIC_ACQUIRE);
+	if (!head || head->index < redis_conn->nscripts) {
+		return 0;
+	}
+
+	for (script = head; script && script->index >= redis_conn->nscripts; script = script->next) {
+		redisAppendCommand(redis_conn->ctx, "SCRIPT LOAD %b", script->body, script->len);
+		n++;
+	}
+	while (n--) {
+		if (redisGetReply(redis_conn->ctx, (void **)&reply) != REDIS_OK) {
+			return -1;
+		}
+		if (reply->type == REDIS_REPLY_ERROR) {
+			log_debug("script load failed: %s", reply->str);
+		}
+		freeReplyObject(reply);
+	}
+
+	redis_conn->nscripts = head->index + 1;
+	return 0;
+}
+
+struct script_call {
+	const struct script *script;
+	int argc;
+	const char **argv;
+	size_t *argvlen;
+};
+
+static int
+noscript(redisReply *reply) {
+	return reply->type == REDIS_REPLY_ERROR && strncmp(reply->str, "NOSCRIPT", 8) == 0;
+}
+
+/* EVALSHA, loading the script and trying again if the node lost it. */
+static redisReply *
+script_attempt(struct redis_connection *redis_conn, void *arg) {
+	struct script_call *call = arg;
+	redisReply *reply;
+
+	reply = redisCommandArgv(redis_conn->ctx, call->argc, call->argv, call->argvlen);
+	if (!reply || !call->script || !noscript(reply)) {
+		return reply;
+	}
+	freeReplyObject(reply);
+
+	reply = redisCommand(redis_conn->ctx, "SCRIPT LOAD %b", call->script->body, call->script->len);
+	if (!reply || reply->type == REDIS_REPLY_ERROR) {
+		return reply;
+	}
+	freeReplyObject(reply);
+
+	return redisCommandArgv(redis_conn->ctx, call->argc, call->argv, call->argvlen);
+}
+
+static redisReply *
+script_exec(struct dynoc *dynoc, const struct script *script, const char *sha,
+            int nkeys, const char **keys, int nargs, const char **args) {
+	struct script_call call;
+	redisReply *reply;
+	char numkeys[16];
+	int i;
+
+	if (nkeys < 1 || nargs < 0) {
+		log_debug("a script needs a key to be routed by");
+		return NULL;
+	}
+	if (!keys || (nargs && !args)) {
+		return NULL;
+	}
+
+	call.script = script;
+	call.argc = 3 + nkeys + nargs;
+	call.argv = malloc(call.argc * sizeof(*call.argv));
+	call.argvlen = malloc(call.argc * sizeof(*call.argvlen));
+	if (!call.argv || !call.argvlen) {
+		free(call.argv);
+		free(call.argvlen);
+		return NULL;
+	}
+
+	snprintf(numkeys, sizeof(numkeys), "%d", nkeys);
+	call.argv[0] = "EVALSHA";
+	call.argv[1] = sha;
+	call.argv[2] = numkeys;
+	for (i = 0; i < nkeys; i++) {
+		call.argv[3 + i] = keys[i];
+	}
+	for (i = 0; i < nargs; i++) {
+		call.argv[3 + nkeys + i] = args[i];
+	}
+	for (i = 0; i < call.argc; i++) {
+		call.argvlen[i] = strlen(call.argv[i]);
+	}
+
+	/* A script may write anything: only resend it if it surely did not run. */
+	reply = command_run(dynoc, keys[0], COMMAND_ERROR_REPLY, script_attempt, &call);
+
+	free(call.argv);
+	free(call.argvlen);
+	return reply;
+}
+
+int
+dynoc_script_register(struct dynoc *dynoc, const char *script, char *sha) {
+	struct script *registered;
+
+	if (!script) {
+		return -1;
+	}
+
+	registered = register_script(dynoc, script);
+	if (!registered) {
+		return -1;
+	}
+	if (sha) {
+		memcpy(sha, registered->sha, sizeof(registered->sha));
+	}
+	return 0;
+}
+
+redisReply *
+dynoc_eval(struct dynoc *dynoc, const char *script, int nkeys, const char **keys, int nargs, const char **args) {
+	struct script *registered;
+
+	if (!script) {
+		return NULL;
+	}
+
+	registered = register_script(dynoc, script);
+	if (!registered) {
+		return NULL;
+	}
+	return script_exec(dynoc, registered, registered->sha, nkeys, keys, nargs, args);
+}
+
+redisReply *
+dynoc_evalsha(struct dynoc *dynoc, const char *sha, int nkeys, const char **keys, int nargs, const char **args) {
+	const struct script *script;
+
+	if (!sha) {
+		return NULL;
+	}
+
+	script = find_script(__atomic_load_n(&dynoc->scripts, __ATOMIC_ACQUIRE), sha);
+	return script_exec(dynoc, script, sha, nkeys, keys, nargs, args);
+}
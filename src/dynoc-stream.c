@@ -0,0 +1,570 @@
+/*
+ * Dynoc is a minimalistic C client library for the dynomite.
+ * Copyright (C) 2016-2017 huya.com, Lampman Yao
+ */
+
+/*
+ * Dynomite - A thin, distributed replication layer for multi non-distributed storages.
+ * Copyright (C) 2014 Netflix, Inc.
+ */
+
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "dynoc-debug.h"
+#include "dynoc-conn.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define STREAM_CHUNK_SIZE (64 * 1024)
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+enum stream_status {
+	STREAM_OK        = 0,
+	STREAM_NIL       = 1,
+	STREAM_IO_ERR    = -1,   /* connection state unknown, reset it */
+	STREAM_REPLY_ERR = -2,   /* error reply fully read, try another rack */
+	STREAM_ABORT     = -3    /* callback gave up mid value */
+};
+
+struct stream_buf {
+	int fd;
+	size_t pos;
+	size_t len;
+	char data[STREAM_CHUNK_SIZE];
+};
+
+static int
+write_all(int fd, const char *data, size_t len) {
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+writev_all(int fd, struct iovec *iov, int iovcnt) {
+	ssize_t n;
+
+	while (iovcnt > 0) {
+		n = writev(fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (n > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+/* Nothing may be buffered on either side before we touch the socket. */
+static int
+connection_idle(redisContext *ctx) {
+	return (!ctx->obuf || ctx->obuf[0] == '\0') && ctx->reader->pos == ctx->reader->len;
+}
+
+static int
+stream_fill(struct stream_buf *sb) {
+	ssize_t n;
+
+	if (sb->pos == sb->len) {
+		sb->pos = sb->len = 0;
+	} else if (sb->pos > 0) {
+		memmove(sb->data, sb->data + sb->pos, sb->len - sb->pos);
+		sb->len -= sb->pos;
+		sb->pos = 0;
+	}
+
+	if (sb->len == STREAM_CHUNK_SIZE) {
+		return -1;
+	}
+
+	do {
+		n = read(sb->fd, sb->data + sb->len, STREAM_CHUNK_SIZE - sb->len);
+	} while (n < 0 && errno == EINTR);
+
+	if (n <= 0) {
+		return -1;
+	}
+	sb->len += n;
+	return 0;
+}
+
+static int
+stream_line(struct stream_buf *sb, char *line, size_t cap) {
+	char *start, *end;
+	size_t n;
+
+	for (;;) {
+		start = sb->data + sb->pos;
+		end = memchr(start, '\n', sb->len - sb->pos);
+		if (end) {
+			n = end - start + 1;
+			if (n < 2 || end[-1] != '\r') {
+				return -1;
+			}
+			n -= 2;
+			if (n >= cap) {
+				n = cap - 1;
+			}
+			memcpy(line, start, n);
+			line[n] = '\0';
+			sb->pos = end - sb->data + 1;
+			return 0;
+		}
+		if (stream_fill(sb) < 0) {
+			return -1;
+		}
+	}
+}
+
+/*
+ * Compressed values cannot be decoded piecewise, so they are gathered and
+ * decoded first. value_header() already bounded `len` by the original
+ * length, which is at most CODEC_MAX_LEN.
+ */
+static int
+stream_compressed(struct dynoc *dynoc, struct stream_buf *sb, size_t len,
+                  stream_write_t cb, void *arg, int *delivered) {
+	char *raw, *value;
+	size_t got = 0, vlen, off, n;
+	int ret;
+
+	raw = malloc(len);
+	if (!raw) {
+		return STREAM_IO_ERR;
+	}
+
+	while (got < len) {
+		if (sb->pos == sb->len && stream_fill(sb) < 0) {
+			free(raw);
+			return STREAM_IO_ERR;
+		}
+		n = sb->len - sb->pos;
+		if (n > len - got) {
+			n = len - got;
+		}
+		memcpy(raw + got, sb->data + sb->pos, n);
+		sb->pos += n;
+		got += n;
+	}
+
+	if (value_decode(dynoc->codec, raw, len, &value, &vlen) < 0) {
+		log_debug("corrupt compressed value");
+		free(raw);
+		return STREAM_REPLY_ERR;
+	}
+	free(raw);
+
+	ret = STREAM_OK;
+	for (off = 0; off < vlen; off += n) {
+		n = vlen - off > STREAM_CHUNK_SIZE ? STREAM_CHUNK_SIZE : vlen - off;
+		*delivered = 1;
+		if (cb(arg, value + off, n) != 0) {
+			ret = STREAM_ABORT;
+			break;
+		}
+	}
+	free(value);
+	return ret;
+}
+
+static int
+stream_reply(struct dynoc *dynoc, struct stream_buf *sb, stream_write_t cb, void *arg, int *delivered) {
+	char line[128];
+	long long len;
+	size_t left, rawlen, n;
+	int ret;
+
+	if (stream_line(sb, line, sizeof(line)) < 0) {
+		return STREAM_IO_ERR;
+	}
+
+	if (line[0] == '-') {
+		log_debug("%s", line);
+		return STREAM_REPLY_ERR;
+	}
+
+	if (line[0] != '$') {
+		return STREAM_IO_ERR;
+	}
+
+	len = strtoll(line + 1, NULL, 10);
+	if (len < 0) {
+		return STREAM_NIL;
+	}
+
+	left = (size_t)len;
+	if (left >= CODEC_HEADER_LEN) {
+		while (sb->len - sb->pos < CODEC_HEADER_LEN) {
+			if (stream_fill(sb) < 0) {
+				return STREAM_IO_ERR;
+			}
+		}
+		if (value_header(dynoc->codec, sb->data + sb->pos, left, &rawlen)) {
+			ret = stream_compressed(dynoc, sb, left, cb, arg, delivered);
+			if (ret == STREAM_IO_ERR || ret == STREAM_ABORT) {
+				return ret;
+			}
+			left = 0;
+			goto trailer;
+		}
+	}
+
+	ret = STREAM_OK;
+	while (left) {
+		if (sb->pos == sb->len && stream_fill(sb) < 0) {
+			return STREAM_IO_ERR;
+		}
+		n = sb->len - sb->pos;
+		if (n > left) {
+			n = left;
+		}
+		*delivered = 1;
+		if (cb(arg, sb->data + sb->pos, n) != 0) {
+			return STREAM_ABORT;
+		}
+		sb->pos += n;
+		left -= n;
+	}
+
+trailer:
+	while (sb->len - sb->pos < 2) {
+		if (stream_fill(sb) < 0) {
+			return STREAM_IO_ERR;
+		}
+	}
+	if (sb->data[sb->pos] != '\r' || sb->data[sb->pos + 1] != '\n' || sb->pos + 2 != sb->len) {
+		return STREAM_IO_ERR;
+	}
+
+	return ret;
+}
+
+/*
+ * Whether a streamed command that failed once its write had started may
+ * go on to the next rack. These are all idempotent, but the node may have
+ * applied it, so it is a retry under the policy like in command_run().
+ */
+static int
+stream_retry(struct dynoc *dynoc, dc_type_t dc_type, uint32_t rc_idx, int *retries) {
+	return select_remaining(dynoc, dc_type, rc_idx) && retry_allowed(dynoc, ++*retries, 1, 1);
+}
+
+static int
+stream_get(struct dynoc *dynoc, const char *key, const char *cmd, int len, stream_write_t cb, void *arg) {
+	struct token token;
+	struct redis_connection *redis_conn;
+	struct stream_buf *sb;
+	dc_type_t dc_type = LOCAL_DC;
+	uint32_t rc_idx = 0;
+	int delivered, ret, retries = 0;
+
+	sb = malloc(sizeof(struct stream_buf));
+	if (!sb) {
+		return -1;
+	}
+
+	token_init(&token);
+	retry_budget_deposit(dynoc);
+
+	while ((redis_conn = select_connection(dynoc, key, &token, &dc_type, &rc_idx))) {
+		pthread_mutex_lock(&redis_conn->lock);
+		if (!connection_ready(dynoc, redis_conn) || !connection_idle(redis_conn->ctx)) {
+			pthread_mutex_unlock(&redis_conn->lock);
+			continue;
+		}
+
+		if (write_all(redis_conn->ctx->fd, cmd, len) < 0) {
+			reset_redis_connection(redis_conn);
+			pthread_mutex_unlock(&redis_conn->lock);
+			if (!stream_retry(dynoc, dc_type, rc_idx, &retries)) {
+				break;
+			}
+			continue;
+		}
+
+		sb->fd = redis_conn->ctx->fd;
+		sb->pos = sb->len = 0;
+		delivered = 0;
+		ret = stream_reply(dynoc, sb, cb, arg, &delivered);
+		if (ret == STREAM_IO_ERR || ret == STREAM_ABORT) {
+			reset_redis_connection(redis_conn);
+		}
+		pthread_mutex_unlock(&redis_conn->lock);
+
+		if (ret == STREAM_OK || ret == STREAM_NIL) {
+			free(sb);
+			return ret;
+		}
+		if (delivered || ret == STREAM_ABORT) {
+			/* Part of the value already reached the caller, no failover. */
+			break;
+		}
+		if (!stream_retry(dynoc, dc_type, rc_idx, &retries)) {
+			break;
+		}
+	}
+
+	free(sb);
+	return -1;
+}
+
+int
+dynoc_get_stream(struct dynoc *dynoc, const char *key, stream_write_t cb, void *arg) {
+	char *cmd;
+	int len, ret;
+
+	if (!key || !cb) {
+		return -1;
+	}
+
+	len = redisFormatCommand(&cmd, "GET %s", key);
+	if (len < 0) {
+		return -1;
+	}
+
+	ret = stream_get(dynoc, key, cmd, len, cb, arg);
+	free(cmd);
+	return ret;
+}
+
+int
+dynoc_hget_stream(struct dynoc *dynoc, const char *key, const char *field, stream_write_t cb, void *arg) {
+	char *cmd;
+	int len, ret;
+
+	if (!key || !field || !cb) {
+		return -1;
+	}
+
+	len = redisFormatCommand(&cmd, "HGET %s %s", key, field);
+	if (len < 0) {
+		return -1;
+	}
+
+	ret = stream_get(dynoc, key, cmd, len, cb, arg);
+	free(cmd);
+	return ret;
+}
+
+static int
+fd_writer(void *arg, const char *data, size_t len) {
+	return write_all(*(int *)arg, data, len);
+}
+
+int
+dynoc_get_fd(struct dynoc *dynoc, const char *key, int fd) {
+	return dynoc_get_stream(dynoc, key, fd_writer, &fd);
+}
+
+int
+dynoc_hget_fd(struct dynoc *dynoc, const char *key, const char *field, int fd) {
+	return dynoc_hget_stream(dynoc, key, field, fd_writer, &fd);
+}
+
+static int
+set_header(char **header, const char *key, size_t len) {
+	size_t klen = strlen(key);
+	int n;
+
+	*header = malloc(klen + 64);
+	if (!*header) {
+		return -1;
+	}
+
+	n = snprintf(*header, klen + 64, "*3\r\n$3\r\nSET\r\n$%zu\r\n%s\r\n$%zu\r\n", klen, key, len);
+	if (n < 0 || (size_t)n >= klen + 64) {
+		free(*header);
+		return -1;
+	}
+	return n;
+}
+
+static int
+read_set_reply(struct redis_connection *redis_conn) {
+	void *reply = NULL;
+	int ok;
+
+	if (redisGetReply(redis_conn->ctx, &reply) == REDIS_ERR) {
+		reset_redis_connection(redis_conn);
+		return -1;
+	}
+
+	ok = ((redisReply *)reply)->type != REDIS_REPLY_ERROR;
+	freeReplyObject(reply);
+	return ok ? 0 : -1;
+}
+
+int
+dynoc_set_stream(struct dynoc *dynoc, const char *key, size_t len, stream_read_t cb, void *arg) {
+	struct token token;
+	struct redis_connection *redis_conn;
+	dc_type_t dc_type = LOCAL_DC;
+	uint32_t rc_idx = 0;
+	char *header, *buf;
+	size_t left;
+	ssize_t n;
+	int hlen, ret = -1, retries = 0;
+
+	if (!key || !cb) {
+		return -1;
+	}
+
+	hlen = set_header(&header, key, len);
+	if (hlen < 0) {
+		return -1;
+	}
+
+	buf = malloc(STREAM_CHUNK_SIZE);
+	if (!buf) {
+		free(header);
+		return -1;
+	}
+
+	token_init(&token);
+	retry_budget_deposit(dynoc);
+
+	while ((redis_conn = select_connection(dynoc, key, &token, &dc_type, &rc_idx))) {
+		pthread_mutex_lock(&redis_conn->lock);
+		if (!connection_ready(dynoc, redis_conn) || !connection_idle(redis_conn->ctx)) {
+			pthread_mutex_unlock(&redis_conn->lock);
+			continue;
+		}
+
+		if (write_all(redis_conn->ctx->fd, header, hlen) < 0) {
+			reset_redis_connection(redis_conn);
+			pthread_mutex_unlock(&redis_conn->lock);
+			if (!stream_retry(dynoc, dc_type, rc_idx, &retries)) {
+				break;
+			}
+			continue;
+		}
+
+		/* From here on the reader has been consumed, no failover. */
+		for (left = len; left; left -= n) {
+			n = cb(arg, buf, left > STREAM_CHUNK_SIZE ? STREAM_CHUNK_SIZE : left);
+			if (n <= 0 || (size_t)n > left || write_all(redis_conn->ctx->fd, buf, n) < 0) {
+				break;
+			}
+		}
+
+		if (left || write_all(redis_conn->ctx->fd, "\r\n", 2) < 0) {
+			reset_redis_connection(redis_conn);
+		} else {
+			ret = read_set_reply(redis_conn);
+		}
+		pthread_mutex_unlock(&redis_conn->lock);
+		break;
+	}
+
+	free(buf);
+	free(header);
+	return ret;
+}
+
+int
+dynoc_set_iov(struct dynoc *dynoc, const char *key, const struct iovec *iov, int iovcnt) {
+	struct token token;
+	struct redis_connection *redis_conn;
+	dc_type_t dc_type = LOCAL_DC;
+	uint32_t rc_idx = 0;
+	struct iovec *vec;
+	char *header;
+	size_t len = 0;
+	int hlen, i, ret = -1, retries = 0;
+
+	if (!key || (!iov && iovcnt) || iovcnt < 0) {
+		return -1;
+	}
+
+	for (i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+
+	hlen = set_header(&header, key, len);
+	if (hlen < 0) {
+		return -1;
+	}
+
+	vec = malloc((iovcnt + 2) * sizeof(struct iovec));
+	if (!vec) {
+		free(header);
+		return -1;
+	}
+
+	token_init(&token);
+	retry_budget_deposit(dynoc);
+
+	while (ret < 0 && (redis_conn = select_connection(dynoc, key, &token, &dc_type, &rc_idx))) {
+		pthread_mutex_lock(&redis_conn->lock);
+		if (!connection_ready(dynoc, redis_conn) || !connection_idle(redis_conn->ctx)) {
+			pthread_mutex_unlock(&redis_conn->lock);
+			continue;
+		}
+
+		/* writev_all() advances the vector, rebuild it for every attempt. */
+		vec[0].iov_base = header;
+		vec[0].iov_len = hlen;
+		memcpy(vec + 1, iov, iovcnt * sizeof(struct iovec));
+		vec[iovcnt + 1].iov_base = "\r\n";
+		vec[iovcnt + 1].iov_len = 2;
+
+		if (writev_all(redis_conn->ctx->fd, vec, iovcnt + 2) < 0) {
+			reset_redis_connection(redis_conn);
+		} else {
+			ret = read_set_reply(redis_conn);
+		}
+		pthread_mutex_unlock(&redis_conn->lock);
+
+		if (ret < 0 && !stream_retry(dynoc, dc_type, rc_idx, &retries)) {
+			break;
+		}
+	}
+
+	free(vec);
+	free(header);
+	return ret;
+}
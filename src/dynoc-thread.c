@@ -0,0 +1,138 @@
+/*
+ * Dynoc is a minimalistic C client library for the dynomite.
+ * Copyright (C) 2016-2017 huya.com, Lampman Yao
+ */
+
+/*
+ * Dynomite - A thin, distributed replication layer for multi non-distributed storages.
+ * Copyright (C) 2014 Netflix, Inc.
+ */
+
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "dynoc-debug.h"
+#include "dynoc-conn.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A thread context holds one private connection per node, indexed by the
+ * node's slot. Only its thread touches them, so they need no lock; what
+ * the threads share about a node is read and written with atomics: the
+ * status of its shared connection, kept by the health check, and the
+ * suspect flag.
+ */
+struct dynoc_thread_ctx {
+	struct dynoc *dynoc;
+	uint32_t nconn;
+	struct redis_connection *conns;
+};
+
+static __thread struct dynoc_thread_ctx *thread_ctx;
+
+dynoc_thread_ctx_t *
+dynoc_thread_ctx_create(struct dynoc *dynoc) {
+	struct dynoc_thread_ctx *ctx;
+
+	if (thread_ctx || !dynoc->nslots) {
+		log_debug("thread context already set or client not started");
+		return NULL;
+	}
+
+	ctx = malloc(sizeof(*ctx));
+	if (!ctx) {
+		return NULL;
+	}
+	if (posix_memalign((void **)&ctx->conns, CACHE_LINE_SIZE, dynoc->nslots * sizeof(*ctx->conns)) != 0) {
+		free(ctx);
+		return NULL;
+	}
+	memset(ctx->conns, 0, dynoc->nslots * sizeof(*ctx->conns));
+	ctx->dynoc = dynoc;
+	ctx->nconn = dynoc->nslots;
+	thread_ctx = ctx;
+	return ctx;
+}
+
+void
+dynoc_thread_ctx_free(dynoc_thread_ctx_t *ctx) {
+	uint32_t i;
+
+	if (!ctx) {
+		return;
+	}
+	if (thread_ctx == ctx) {
+		thread_ctx = NULL;
+	}
+	for (i = 0; i < ctx->nconn; i++) {
+		if (ctx->conns[i].ctx) {
+			redisFree(ctx->conns[i].ctx);
+		}
+	}
+	free(ctx->conns);
+	free(ctx);
+}
+
+int
+node_down(struct redis_connection *shared) {
+	if (__atomic_load_n(&shared->suspect, __ATOMIC_RELAXED)) {
+		return 1;
+	}
+	/* A lazy node nobody connected yet is not known to be down. */
+	return !__atomic_load_n(&shared->status, __ATOMIC_RELAXED) &&
+	       !__atomic_load_n(&shared->cold, __ATOMIC_RELAXED);
+}
+
+struct redis_connection *
+connection_acquire(struct dynoc *dynoc, struct redis_connection *shared) {
+	struct dynoc_thread_ctx *ctx = thread_ctx;
+	struct redis_connection *redis_conn;
+
+	if (!ctx || ctx->dynoc != dynoc) {
+		pthread_mutex_lock(&shared->lock);
+		return shared;
+	}
+
+	if (node_down(shared)) {
+		return NULL;
+	}
+
+	redis_conn = &ctx->conns[shared->slot];
+	if (!redis_conn->status) {
+		/* (Re)connected by connection_ready(), the node looks alive. */
+		redis_conn->endpoint = shared->endpoint;
+		redis_conn->slot = shared->slot;
+		redis_conn->cold = 1;
+	}
+	return redis_conn;
+}
+
+void
+connection_release(struct redis_connection *shared, struct redis_connection *redis_conn) {
+	if (redis_conn == shared) {
+		pthread_mutex_unlock(&shared->lock);
+	}
+}
+
+void
+connection_failed(struct redis_connection *shared, struct redis_connection *redis_conn) {
+	if (redis_conn != shared) {
+		__atomic_store_n(&shared->suspect, 1, __ATOMIC_RELAXED);
+	}
+}
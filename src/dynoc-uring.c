@@ -0,0 +1,610 @@
+/*
+ * Dynoc is a minimalistic C client library for the dynomite.
+ * Copyright (C) 2016-2017 huya.com, Lampman Yao
+ */
+
+/*
+ * Dynomite - A thin, distributed replication layer for multi non-distributed storages.
+ * Copyright (C) 2014 Netflix, Inc.
+ */
+
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "dynoc-debug.h"
+#include "dynoc-uring.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+
+#define URING_ENTRIES   256
+#define URING_BUF_COUNT 64
+#define URING_BUF_SIZE  (16 * 1024)
+#define URING_BGID      0
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* user_data of an operation: slot index and operation type. */
+#define URING_SEND      0
+#define URING_RECV      1
+#define URING_CANCEL    2
+#define URING_DATA(idx, op) (((uint64_t)(idx) << 2) | (op))
+
+struct uring {
+	int fd;
+	void *ring;
+	size_t ring_sz;
+	struct io_uring_sqe *sqes;
+	size_t sqes_sz;
+	unsigned sq_entries;
+	unsigned sq_tail;
+	unsigned *ksq_head;
+	unsigned *ksq_tail;
+	unsigned *ksq_mask;
+	unsigned *kcq_head;
+	unsigned *kcq_tail;
+	unsigned *kcq_mask;
+	struct io_uring_cqe *cqes;
+	struct io_uring_buf_ring *br;
+	size_t br_sz;
+	char *bufs;
+	uint16_t br_tail;
+	int single_shot;
+	int broken;
+};
+
+/* Send and receive state of one pipeline slot. */
+struct uring_slot {
+	struct iovec *iov;
+	uint32_t niov;
+	struct msghdr msg;
+	int sending;
+	int receiving;
+};
+
+static int
+sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags, void *arg, size_t argsz) {
+	return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argsz);
+}
+
+static int
+sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nargs) {
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+static void
+uring_free(void *ptr) {
+	struct uring *ring = ptr;
+
+	if (ring->ring && ring->ring != MAP_FAILED) {
+		munmap(ring->ring, ring->ring_sz);
+	}
+	if (ring->sqes && ring->sqes != MAP_FAILED) {
+		munmap(ring->sqes, ring->sqes_sz);
+	}
+	if (ring->br && ring->br != MAP_FAILED) {
+		munmap(ring->br, ring->br_sz);
+	}
+	if (ring->fd >= 0) {
+		close(ring->fd);
+	}
+	free(ring->bufs);
+	free(ring);
+}
+
+static void
+buf_recycle(struct uring *ring, uint16_t bid) {
+	struct io_uring_buf *buf = &ring->br->bufs[ring->br_tail & (URING_BUF_COUNT - 1)];
+
+	buf->addr = (uint64_t)(uintptr_t)(ring->bufs + (size_t)bid * URING_BUF_SIZE);
+	buf->len = URING_BUF_SIZE;
+	buf->bid = bid;
+	ring->br_tail++;
+	__atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+}
+
+static struct uring *
+uring_create(void) {
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	struct uring *ring;
+	size_t sq_sz, cq_sz;
+	char *base;
+	uint16_t i;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring) {
+		return NULL;
+	}
+
+	/* Each ring is only ever used by the thread owning it. */
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+	ring->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+	if (ring->fd < 0 && errno == EINVAL) {
+		memset(&p, 0, sizeof(p));
+		ring->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+	}
+	if (ring->fd < 0) {
+		log_debug("io_uring_setup failed: %s", strerror(errno));
+		goto fail;
+	}
+
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+		log_debug("io_uring lacks required features");
+		goto fail;
+	}
+
+	sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->ring_sz = sq_sz > cq_sz ? sq_sz : cq_sz;
+	ring->ring = mmap(NULL, ring->ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                  ring->fd, IORING_OFF_SQ_RING);
+	if (ring->ring == MAP_FAILED) {
+		goto fail;
+	}
+
+	ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                  ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		goto fail;
+	}
+
+	base = ring->ring;
+	ring->sq_entries = p.sq_entries;
+	ring->ksq_head = (unsigned *)(base + p.sq_off.head);
+	ring->ksq_tail = (unsigned *)(base + p.sq_off.tail);
+	ring->ksq_mask = (unsigned *)(base + p.sq_off.ring_mask);
+	ring->kcq_head = (unsigned *)(base + p.cq_off.head);
+	ring->kcq_tail = (unsigned *)(base + p.cq_off.tail);
+	ring->kcq_mask = (unsigned *)(base + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(base + p.cq_off.cqes);
+	ring->sq_tail = *ring->ksq_tail;
+	for (i = 0; i < p.sq_entries; i++) {
+		((unsigned *)(base + p.sq_off.array))[i] = i;
+	}
+
+	/* Registered receive buffers, picked by the kernel per completion. */
+	ring->br_sz = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+	ring->br = mmap(NULL, ring->br_sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ring->bufs = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+	if (ring->br == MAP_FAILED || !ring->bufs) {
+		goto fail;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)ring->br;
+	reg.ring_entries = URING_BUF_COUNT;
+	reg.bgid = URING_BGID;
+	if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		log_debug("io_uring buffer ring registration failed: %s", strerror(errno));
+		goto fail;
+	}
+
+	for (i = 0; i < URING_BUF_COUNT; i++) {
+		buf_recycle(ring, i);
+	}
+	return ring;
+
+fail:
+	uring_free(ring);
+	return NULL;
+}
+
+/*
+ * Submit the queued operations and, if `wait`, wait for a completion for
+ * at most `timeout_ms` (-1 for no limit). Returns 0 or -errno.
+ */
+static int
+uring_enter(struct uring *ring, int wait, int64_t timeout_ms) {
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned submit, flags = 0;
+	int rv;
+
+	__atomic_store_n(ring->ksq_tail, ring->sq_tail, __ATOMIC_RELEASE);
+	submit = ring->sq_tail - __atomic_load_n(ring->ksq_head, __ATOMIC_ACQUIRE);
+
+	memset(&arg, 0, sizeof(arg));
+	arg.sigmask_sz = _NSIG / 8;
+	if (wait) {
+		flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+		if (timeout_ms >= 0) {
+			ts.tv_sec = timeout_ms / 1000;
+			ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+			arg.ts = (uint64_t)(uintptr_t)&ts;
+		}
+	}
+
+	rv = sys_io_uring_enter(ring->fd, submit, wait ? 1 : 0, flags, wait ? &arg : NULL, wait ? sizeof(arg) : 0);
+	return rv < 0 ? -errno : 0;
+}
+
+static struct io_uring_sqe *
+uring_sqe(struct uring *ring) {
+	struct io_uring_sqe *sqe;
+
+	if (ring->sq_tail - __atomic_load_n(ring->ksq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+		uring_enter(ring, 0, 0);
+		if (ring->sq_tail - __atomic_load_n(ring->ksq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+			return NULL;
+		}
+	}
+
+	sqe = &ring->sqes[ring->sq_tail & *ring->ksq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_tail++;
+	return sqe;
+}
+
+static void
+queue_send(struct uring *ring, struct pipeline_slot *slot, struct uring_slot *us, uint32_t idx) {
+	struct io_uring_sqe *sqe = uring_sqe(ring);
+
+	if (!sqe) {
+		pipeline_slot_fail(slot, "submit");
+		return;
+	}
+
+	memset(&us->msg, 0, sizeof(us->msg));
+	us->msg.msg_iov = us->iov;
+	us->msg.msg_iovlen = us->niov < IOV_MAX ? us->niov : IOV_MAX;
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = slot->redis_conn->ctx->fd;
+	sqe->addr = (uint64_t)(uintptr_t)&us->msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = URING_DATA(idx, URING_SEND);
+	us->sending = 1;
+}
+
+static void
+queue_recv(struct uring *ring, struct pipeline_slot *slot, struct uring_slot *us, uint32_t idx) {
+	struct io_uring_sqe *sqe = uring_sqe(ring);
+
+	if (!sqe) {
+		pipeline_slot_fail(slot, "submit");
+		return;
+	}
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = slot->redis_conn->ctx->fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->ioprio = ring->single_shot ? 0 : IORING_RECV_MULTISHOT;
+	sqe->user_data = URING_DATA(idx, URING_RECV);
+	us->receiving = 1;
+}
+
+static void
+queue_cancel(struct uring *ring, uint64_t target) {
+	struct io_uring_sqe *sqe;
+
+	while (!(sqe = uring_sqe(ring))) {
+		uring_enter(ring, 0, 0);
+	}
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = target;
+	sqe->user_data = URING_DATA(0, URING_CANCEL);
+}
+
+static void
+send_done(struct uring *ring, struct pipeline_slot *slot, struct uring_slot *us, uint32_t idx,
+          int res, int rearm) {
+	size_t n;
+
+	us->sending = 0;
+	if (!slot->redis_conn->status) {
+		return;
+	}
+
+	if (res < 0 && res != -EINTR && res != -EAGAIN) {
+		/* Cancelled or failed half way: the stream cannot be trusted. */
+		pipeline_slot_fail(slot, "write");
+		return;
+	}
+
+	for (n = res > 0 ? (size_t)res : 0; n && us->niov; ) {
+		if (n >= us->iov->iov_len) {
+			n -= us->iov->iov_len;
+			us->iov++;
+			us->niov--;
+		} else {
+			us->iov->iov_base = (char *)us->iov->iov_base + n;
+			us->iov->iov_len -= n;
+			n = 0;
+		}
+	}
+
+	if (us->niov) {
+		if (rearm) {
+			queue_send(ring, slot, us, idx);
+		} else {
+			pipeline_slot_fail(slot, "write");
+		}
+	}
+}
+
+static uint32_t
+recv_done(struct uring *ring, struct pipeline_slot *slot, struct uring_slot *us, uint32_t idx,
+          struct conn_request *reqs, int res, uint32_t flags, int rearm) {
+	redisContext *ctx = slot->redis_conn->ctx;
+	uint32_t nreply = 0;
+	uint16_t bid;
+
+	if (!(flags & IORING_CQE_F_MORE)) {
+		us->receiving = 0;
+	}
+
+	if (flags & IORING_CQE_F_BUFFER) {
+		bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		if (res > 0 && slot->redis_conn->status) {
+			redisReaderFeed(ctx->reader, ring->bufs + (size_t)bid * URING_BUF_SIZE, res);
+			nreply = pipeline_slot_replies(slot, reqs);
+		}
+		buf_recycle(ring, bid);
+	}
+
+	if (!slot->redis_conn->status) {
+		return nreply;
+	}
+
+	if (res == 0) {
+		pipeline_slot_fail(slot, "read");
+		return nreply;
+	}
+	if (res == -EINVAL && !ring->single_shot) {
+		log_debug("multishot receive not supported, falling back to single shot");
+		ring->single_shot = 1;
+	} else if (res < 0 && res != -ENOBUFS && res != -EINTR && res != -EAGAIN && res != -ECANCELED) {
+		pipeline_slot_fail(slot, "read");
+		return nreply;
+	}
+
+	if (rearm && !us->receiving && slot->inflight) {
+		queue_recv(ring, slot, us, idx);
+	}
+	return nreply;
+}
+
+/* Process every completion in the queue. */
+static uint32_t
+uring_reap(struct uring *ring, struct pipeline_slot *slots, struct uring_slot *uslots,
+           struct conn_request *reqs, int rearm) {
+	struct io_uring_cqe *cqe;
+	unsigned head, tail;
+	uint32_t nreply = 0, idx;
+
+	head = *ring->kcq_head;
+	tail = __atomic_load_n(ring->kcq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+		cqe = &ring->cqes[head & *ring->kcq_mask];
+		idx = (uint32_t)(cqe->user_data >> 2);
+
+		switch (cqe->user_data & 3) {
+		case URING_SEND:
+			send_done(ring, &slots[idx], &uslots[idx], idx, cqe->res, rearm);
+			break;
+		case URING_RECV:
+			nreply += recv_done(ring, &slots[idx], &uslots[idx], idx, reqs, cqe->res, cqe->flags, rearm);
+			break;
+		default:
+			break;
+		}
+	}
+
+	__atomic_store_n(ring->kcq_head, head, __ATOMIC_RELEASE);
+	return nreply;
+}
+
+static int
+slots_waiting(struct pipeline_slot *slots, uint32_t nslot) {
+	uint32_t i;
+
+	for (i = 0; i < nslot; i++) {
+		if (slots[i].inflight) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int
+slots_busy(struct uring_slot *uslots, uint32_t nslot) {
+	uint32_t i;
+
+	for (i = 0; i < nslot; i++) {
+		if (uslots[i].sending || uslots[i].receiving) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+uint32_t
+uring_pipeline_io(struct uring *ring, struct pipeline_slot *slots, uint32_t nslot,
+                  struct conn_request *reqs, uint32_t nreq, pipeline_done_t done, void *arg) {
+	struct pipeline_slot *slot;
+	struct uring_slot *uslots;
+	struct iovec *iov;
+	uint32_t nreply = 0, off, i;
+	int64_t left;
+	int rv;
+
+	uslots = calloc(nslot, sizeof(*uslots));
+	iov = malloc(nreq * sizeof(*iov));
+	if (!uslots || !iov) {
+		for (i = 0; i < nslot; i++) {
+			if (slots[i].inflight) {
+				pipeline_slot_fail(&slots[i], "setup");
+			}
+		}
+		free(uslots);
+		free(iov);
+		return 0;
+	}
+
+	/* One gather list per node, in request order. */
+	for (i = 0; i < nreq; i++) {
+		if (reqs[i].sent) {
+			uslots[pipeline_slot_find(slots, nslot, reqs[i].redis_conn) - slots].niov++;
+		}
+	}
+	for (i = 0, off = 0; i < nslot; i++) {
+		uslots[i].iov = iov + off;
+		off += uslots[i].niov;
+		uslots[i].niov = 0;
+	}
+	for (i = 0; i < nreq; i++) {
+		if (reqs[i].sent) {
+			slot = pipeline_slot_find(slots, nslot, reqs[i].redis_conn);
+			struct uring_slot *us = &uslots[slot - slots];
+			us->iov[us->niov].iov_base = reqs[i].cmd;
+			us->iov[us->niov].iov_len = reqs[i].len;
+			us->niov++;
+		}
+	}
+
+	for (i = 0; i < nslot; i++) {
+		if (slots[i].inflight && uslots[i].niov) {
+			queue_send(ring, &slots[i], &uslots[i], i);
+		}
+		if (slots[i].inflight) {
+			queue_recv(ring, &slots[i], &uslots[i], i);
+		}
+	}
+
+	while ((!done || !done(reqs, nreq, arg)) && slots_waiting(slots, nslot)) {
+		left = command_remaining();
+		if (left == 0) {
+			log_debug("pipeline deadline exceeded");
+			break;
+		}
+
+		rv = uring_enter(ring, 1, left);
+		if (rv == -ETIME) {
+			log_debug("pipeline deadline exceeded");
+			break;
+		}
+		if (rv < 0 && rv != -EINTR && rv != -EBUSY) {
+			log_debug("io_uring_enter failed: %s", strerror(-rv));
+			break;
+		}
+		nreply += uring_reap(ring, slots, uslots, reqs, 1);
+	}
+
+	/* Nothing may stay in flight once the connections are unlocked. */
+	for (i = 0; i < nslot; i++) {
+		if (uslots[i].sending) {
+			queue_cancel(ring, URING_DATA(i, URING_SEND));
+		}
+		if (uslots[i].receiving) {
+			queue_cancel(ring, URING_DATA(i, URING_RECV));
+		}
+	}
+	while (slots_busy(uslots, nslot)) {
+		rv = uring_enter(ring, 1, -1);
+		if (rv < 0 && rv != -EINTR && rv != -EBUSY) {
+			/*
+			 * Completions still to come would be taken for those of a
+			 * later pipeline: retire the ring and the connections.
+			 */
+			log_debug("io_uring_enter failed: %s", strerror(-rv));
+			for (i = 0; i < nslot; i++) {
+				if (slots[i].redis_conn->status && (uslots[i].sending || uslots[i].receiving)) {
+					pipeline_slot_fail(&slots[i], "cancel");
+				}
+			}
+			ring->broken = 1;
+			break;
+		}
+		nreply += uring_reap(ring, slots, uslots, reqs, 0);
+	}
+
+	free(uslots);
+	free(iov);
+	return nreply;
+}
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static __thread struct uring *thread_ring;
+static __thread int thread_ring_failed;
+
+static void
+ring_key_init(void) {
+	pthread_key_create(&ring_key, uring_free);
+}
+
+struct uring *
+uring_thread_ring(void) {
+	if (thread_ring) {
+		return thread_ring->broken ? NULL : thread_ring;
+	}
+	if (thread_ring_failed) {
+		return NULL;
+	}
+
+	pthread_once(&ring_once, ring_key_init);
+	thread_ring = uring_create();
+	if (!thread_ring) {
+		thread_ring_failed = 1;
+		return NULL;
+	}
+
+	pthread_setspecific(ring_key, thread_ring);
+	return thread_ring;
+}
+
+#else
+
+struct uring *
+uring_thread_ring(void) {
+	return NULL;
+}
+
+uint32_t
+uring_pipeline_io(struct uring *ring, struct pipeline_slot *slots, uint32_t nslot,
+                  struct conn_request *reqs, uint32_t nreq, pipeline_done_t done, void *arg) {
+	return 0;
+}
+
+#endif
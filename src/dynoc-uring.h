@@ -0,0 +1,50 @@
+/*
+ * Dynoc is a minimalistic C client library for the dynomite.
+ * Copyright (C) 2016-2017 huya.com, Lampman Yao
+ */
+
+/*
+ * Dynomite - A thin, distributed replication layer for multi non-distributed storages.
+ * Copyright (C) 2014 Netflix, Inc.
+ */
+
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "dynoc-conn.h"
+
+/*
+ * io_uring I/O backend of the pipelines.
+ * Each thread gets its own ring on first use, with a ring of registered
+ * receive buffers. A pipeline submits the sends of every node and one
+ * multishot receive per node in a single io_uring_enter(), then takes
+ * replies as the completions come in. The commands are sent straight from
+ * the requests with sendmsg(), the hiredis output buffer is not used.
+ * Before returning every operation still in flight is cancelled and
+ * reaped, data that arrived meanwhile stays in the hiredis reader, so the
+ * connection can be handed back to the blocking hiredis API.
+ */
+struct uring;
+
+/* The ring of the calling thread, NULL if io_uring is not available. */
+struct uring *uring_thread_ring(void);
+
+/* Same contract as the poll() backend of conn_pipeline_until(). */
+uint32_t uring_pipeline_io(struct uring *ring, struct pipeline_slot *slots, uint32_t nslot,
+                           struct conn_request *reqs, uint32_t nreq, pipeline_done_t done, void *arg);
@@ -27,6 +27,8 @@
 
 #include "dynoc-hashkit.h"
 
+#include <string.h>
+
 uint32_t
 hash_murmur(const char *key, size_t length) {
 	/*
@@ -48,7 +50,10 @@ hash_murmur(const char *key, size_t length) {
 	const unsigned char * data = (const unsigned char *)key;
 
 	while (length >= 4) {
-		unsigned int k = *(unsigned int *)data;
+		unsigned int k;
+
+		/* Keys need not be aligned. */
+		memcpy(&k, data, sizeof(k));
 
 		k *= m;
 		k ^= k >> r;
@@ -27,10 +27,59 @@
 
 #include "dynoc-hashkit.h"
 
+#include <string.h>
+
 #define MURMUR3_SEED 0xc0a1e5ce
 
+#define ROTL32(x, r) (((x) << (r)) | ((x) >> (32 - (r))))
+
+/* MurmurHash3_x86_32. */
 uint32_t
 hash_murmur3(const char *key, size_t length) {
-	return 0;
+	const unsigned char *data = (const unsigned char *)key;
+	const uint32_t c1 = 0xcc9e2d51;
+	const uint32_t c2 = 0x1b873593;
+	uint32_t h = MURMUR3_SEED;
+	uint32_t k;
+	size_t i, nblocks = length / 4;
+
+	for (i = 0; i < nblocks; i++) {
+		memcpy(&k, data + i * 4, sizeof(k));
+
+		k *= c1;
+		k = ROTL32(k, 15);
+		k *= c2;
+
+		h ^= k;
+		h = ROTL32(h, 13);
+		h = h * 5 + 0xe6546b64;
+	}
+
+	data += nblocks * 4;
+	k = 0;
+
+	switch (length & 3) {
+	case 3:
+		k ^= (uint32_t)data[2] << 16;
+	case 2:
+		k ^= (uint32_t)data[1] << 8;
+	case 1:
+		k ^= data[0];
+		k *= c1;
+		k = ROTL32(k, 15);
+		k *= c2;
+		h ^= k;
+	default:
+		break;
+	}
+
+	h ^= (uint32_t)length;
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+
+	return h;
 }
 
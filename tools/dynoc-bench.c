@@ -0,0 +1,604 @@
+/*
+ * Dynoc is a minimalistic C client library for the dynomite.
+ * Copyright (C) 2016-2017 huya.com, Lampman Yao
+ */
+
+/*
+ * Dynomite - A thin, distributed replication layer for multi non-distributed storages.
+ * Copyright (C) 2014 Netflix, Inc.
+ */
+
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "topology.h"
+#include "hist.h"
+#include "dynoc-conn.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Latencies in microseconds, 1/64 at most off. */
+#define HIST_SUB_BITS 7
+
+#define KEY_LEN 64
+
+typedef enum bench_cmd {
+	CMD_GET,
+	CMD_SET,
+	CMD_DEL,
+	CMD_INCR,
+	CMD_HGET,
+	CMD_HSET,
+	CMD_COUNT
+} bench_cmd_t;
+
+static const char *cmd_names[CMD_COUNT] = { "get", "set", "del", "incr", "hget", "hset" };
+
+/* Counters and hashes get keys of their own, or they would hit strings. */
+static const char *cmd_spaces[CMD_COUNT] = { "", "", "", "n:", "h:", "h:" };
+
+typedef enum key_dist {
+	DIST_UNIFORM,
+	DIST_ZIPF,
+	DIST_HOTSPOT
+} key_dist_t;
+
+struct bench {
+	struct dynoc dynoc;
+	struct rack *rack;
+	int threads;
+	int pipeline;
+	int duration;
+	double rate;
+	int mix[CMD_COUNT];
+	int mix_total;
+	size_t value_min;
+	size_t value_max;
+	char *values;
+	const char *prefix;
+	uint64_t keyspace;
+	key_dist_t dist;
+	double zipf_theta;
+	double zipf_zetan;
+	double zipf_alpha;
+	double zipf_eta;
+	double hot_keys;
+	double hot_ops;
+	/* Set by a thread that cannot go on, the others stop too. */
+	int failed;
+};
+
+struct bench_thread {
+	struct bench *bench;
+	pthread_t tid;
+	uint64_t rand;
+	struct hist *cmds;
+	struct hist *nodes;
+};
+
+static void
+hist_print(const char *name, const struct hist *hist, double secs) {
+	if (!hist->total && !hist->errors) {
+		return;
+	}
+	printf("%-24s %10llu %10.0f %8llu %8llu %8llu %8llu %8llu %8llu %8llu\n", name,
+		(unsigned long long)hist->total, hist->total / secs,
+		(unsigned long long)hist->errors,
+		(unsigned long long)hist_percentile(hist, 50),
+		(unsigned long long)hist_percentile(hist, 90),
+		(unsigned long long)hist_percentile(hist, 99),
+		(unsigned long long)hist_percentile(hist, 99.9),
+		(unsigned long long)hist_percentile(hist, 99.99),
+		(unsigned long long)hist->max);
+}
+
+static void
+print_nodes(const struct datacenter *dc, const struct hist *nodes, double secs) {
+	const struct redis_connection *redis_conn;
+	char name[128];
+	uint32_t i, j;
+
+	for (i = 0; dc && i < dc->rack_count; i++) {
+		for (j = 0; j < dc->rack[i].ncontinuum; j++) {
+			redis_conn = &dc->rack[i].redis_conn_pool[j];
+			snprintf(name, sizeof(name), "%s:%d", redis_conn->endpoint->host, redis_conn->endpoint->port);
+			hist_print(name, &nodes[redis_conn->slot], secs);
+		}
+	}
+}
+
+static uint64_t
+now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* xorshift64*, one state per thread. */
+static uint64_t
+next_rand(struct bench_thread *thread) {
+	thread->rand ^= thread->rand >> 12;
+	thread->rand ^= thread->rand << 25;
+	thread->rand ^= thread->rand >> 27;
+	return thread->rand * 2685821657736338717ULL;
+}
+
+static double
+next_double(struct bench_thread *thread) {
+	return (next_rand(thread) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Zipfian constants as in YCSB (Gray et al., "Quickly generating billion-record synthetic databases"). */
+static void
+zipf_init(struct bench *bench) {
+	double zeta2 = 0;
+	uint64_t i;
+
+	bench->zipf_zetan = 0;
+	for (i = 1; i <= bench->keyspace; i++) {
+		bench->zipf_zetan += 1 / pow((double)i, bench->zipf_theta);
+		if (i == 2) {
+			zeta2 = bench->zipf_zetan;
+		}
+	}
+	bench->zipf_alpha = 1 / (1 - bench->zipf_theta);
+	bench->zipf_eta = (1 - pow(2.0 / bench->keyspace, 1 - bench->zipf_theta)) /
+	                  (1 - zeta2 / bench->zipf_zetan);
+}
+
+static uint64_t
+next_key(struct bench_thread *thread) {
+	struct bench *bench = thread->bench;
+	double u, uz;
+	uint64_t hot;
+
+	switch (bench->dist) {
+	case DIST_ZIPF:
+		u = next_double(thread);
+		uz = u * bench->zipf_zetan;
+		if (uz < 1) {
+			return 0;
+		}
+		if (uz < 1 + pow(0.5, bench->zipf_theta)) {
+			return 1;
+		}
+		return (uint64_t)(bench->keyspace * pow(bench->zipf_eta * u - bench->zipf_eta + 1, bench->zipf_alpha)) % bench->keyspace;
+	case DIST_HOTSPOT:
+		hot = (uint64_t)(bench->keyspace * bench->hot_keys);
+		hot = hot ? hot : 1;
+		if (next_double(thread) < bench->hot_ops || hot == bench->keyspace) {
+			return next_rand(thread) % hot;
+		}
+		return hot + next_rand(thread) % (bench->keyspace - hot);
+	default:
+		return next_rand(thread) % bench->keyspace;
+	}
+}
+
+static bench_cmd_t
+next_cmd(struct bench_thread *thread) {
+	struct bench *bench = thread->bench;
+	int pick = next_rand(thread) % bench->mix_total, i;
+
+	for (i = 0; i < CMD_COUNT; i++) {
+		pick -= bench->mix[i];
+		if (pick < 0) {
+			break;
+		}
+	}
+	return i;
+}
+
+/* A NUL terminated value of a random size: the tail of a shared buffer. */
+static const char *
+next_value(struct bench_thread *thread) {
+	struct bench *bench = thread->bench;
+	size_t len = bench->value_min;
+
+	if (bench->value_max > bench->value_min) {
+		len += next_rand(thread) % (bench->value_max - bench->value_min + 1);
+	}
+	return bench->values + bench->value_max - len;
+}
+
+static int
+run_one(struct bench *bench, bench_cmd_t cmd, const char *key, const char *value) {
+	redisReply *reply = NULL;
+
+	switch (cmd) {
+	case CMD_GET:
+		reply = dynoc_get(&bench->dynoc, key);
+		break;
+	case CMD_SET:
+		return dynoc_set(&bench->dynoc, key, value);
+	case CMD_DEL:
+		return dynoc_del(&bench->dynoc, key);
+	case CMD_INCR:
+		return dynoc_incr(&bench->dynoc, key);
+	case CMD_HGET:
+		reply = dynoc_hget(&bench->dynoc, key, "f");
+		break;
+	case CMD_HSET:
+		return dynoc_hset(&bench->dynoc, key, "f", value);
+	default:
+		return -1;
+	}
+	if (!reply) {
+		return -1;
+	}
+	freeReplyObject(reply);
+	return 0;
+}
+
+static int
+format_one(struct key_request *req, bench_cmd_t cmd, const char *key, const char *value) {
+	switch (cmd) {
+	case CMD_GET:
+		return key_request_format(req, key, "GET %s", key);
+	case CMD_SET:
+		return key_request_format(req, key, "SET %s %s", key, value);
+	case CMD_DEL:
+		return key_request_format(req, key, "DEL %s", key);
+	case CMD_INCR:
+		if (key_request_format(req, key, "INCR %s", key) < 0) {
+			return -1;
+		}
+		req->unsafe = 1;
+		return 0;
+	case CMD_HGET:
+		return key_request_format(req, key, "HGET %s f", key);
+	case CMD_HSET:
+		return key_request_format(req, key, "HSET %s f %s", key, value);
+	default:
+		return -1;
+	}
+}
+
+static void *
+bench_thread(void *arg) {
+	struct bench_thread *thread = arg;
+	struct bench *bench = thread->bench;
+	struct key_request *reqs;
+	bench_cmd_t *cmds;
+	uint32_t *nodes;
+	char (*keys)[KEY_LEN];
+	uint64_t start = now_ns(), end = start + (uint64_t)bench->duration * 1000000000, sent = 0;
+	uint64_t intended, done, us;
+	double interval = 0;
+	int i, n = bench->pipeline, failed;
+
+	reqs = calloc(n, sizeof(*reqs));
+	cmds = calloc(n, sizeof(*cmds));
+	nodes = calloc(n, sizeof(*nodes));
+	keys = calloc(n, sizeof(*keys));
+	if (!reqs || !cmds || !nodes || !keys) {
+		fprintf(stderr, "out of memory\n");
+		__atomic_store_n(&bench->failed, 1, __ATOMIC_RELEASE);
+		goto out;
+	}
+
+	/* Open loop: every batch has a slot on a fixed schedule. */
+	if (bench->rate > 0) {
+		interval = 1e9 * bench->threads * n / bench->rate;
+	}
+
+	while (1) {
+		intended = interval > 0 ? start + (uint64_t)(sent * interval) : now_ns();
+		if (intended >= end || __atomic_load_n(&bench->failed, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+		if (interval > 0) {
+			uint64_t now = now_ns();
+			if (now < intended) {
+				struct timespec ts = { (intended - now) / 1000000000, (intended - now) % 1000000000 };
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		for (i = 0; i < n; i++) {
+			cmds[i] = next_cmd(thread);
+			snprintf(keys[i], KEY_LEN, "%s%s%llu", bench->prefix, cmd_spaces[cmds[i]],
+			         (unsigned long long)next_key(thread));
+			nodes[i] = rack_owner(&bench->dynoc, bench->rack, keys[i], strlen(keys[i]))->slot;
+		}
+
+		if (n == 1) {
+			failed = run_one(bench, cmds[0], keys[0], next_value(thread)) < 0;
+			if (!failed && command_node()) {
+				nodes[0] = command_node()->slot;
+			}
+		} else {
+			for (i = 0; i < n; i++) {
+				if (format_one(&reqs[i], cmds[i], keys[i], next_value(thread)) < 0) {
+					fprintf(stderr, "cannot format %s %s\n", cmd_names[cmds[i]], keys[i]);
+					__atomic_store_n(&bench->failed, 1, __ATOMIC_RELEASE);
+					while (i--) {
+						key_request_reset(&reqs[i]);
+					}
+					goto out;
+				}
+			}
+			fanout_exec(&bench->dynoc, reqs, n);
+			failed = 0;
+		}
+
+		/*
+		 * Measured from the intended start, so a stall also counts for the
+		 * requests that should have been sent during it. Pipelined replies
+		 * are not timed one by one: all of a batch get its latency.
+		 */
+		done = now_ns();
+		us = (done - intended) / 1000;
+		for (i = 0; i < n; i++) {
+			int bad = n == 1 ? failed : !reqs[i].reply || reqs[i].reply->type == REDIS_REPLY_ERROR;
+
+			if (n > 1 && !bad) {
+				nodes[i] = reqs[i].redis_conn->slot;
+			}
+			if (bad) {
+				thread->cmds[cmds[i]].errors++;
+				thread->nodes[nodes[i]].errors++;
+			} else {
+				hist_record(&thread->cmds[cmds[i]], us);
+				hist_record(&thread->nodes[nodes[i]], us);
+			}
+			if (n > 1) {
+				key_request_reset(&reqs[i]);
+			}
+		}
+		sent++;
+	}
+
+out:
+	free(reqs);
+	free(cmds);
+	free(nodes);
+	free(keys);
+	return NULL;
+}
+
+static int
+parse_mix(struct bench *bench, char *spec) {
+	char *item, *save, *colon;
+	int i;
+
+	memset(bench->mix, 0, sizeof(bench->mix));
+	bench->mix_total = 0;
+	for (item = strtok_r(spec, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+		colon = strchr(item, ':');
+		if (colon) {
+			*colon = '\0';
+		}
+		for (i = 0; i < CMD_COUNT && strcmp(cmd_names[i], item) != 0; i++);
+		if (i == CMD_COUNT) {
+			return -1;
+		}
+		bench->mix[i] = colon ? atoi(colon + 1) : 1;
+		if (bench->mix[i] < 0) {
+			return -1;
+		}
+		bench->mix_total += bench->mix[i];
+	}
+	return bench->mix_total > 0 ? 0 : -1;
+}
+
+static int
+parse_dist(struct bench *bench, const char *spec) {
+	if (strncmp(spec, "uniform", 7) == 0) {
+		bench->dist = DIST_UNIFORM;
+	} else if (strncmp(spec, "zipf", 4) == 0) {
+		bench->dist = DIST_ZIPF;
+		bench->zipf_theta = spec[4] == ':' ? atof(spec + 5) : 0.99;
+		if (bench->zipf_theta <= 0 || bench->zipf_theta >= 1) {
+			return -1;
+		}
+	} else if (strncmp(spec, "hotspot", 7) == 0) {
+		bench->dist = DIST_HOTSPOT;
+		bench->hot_keys = 0.2;
+		bench->hot_ops = 0.8;
+		if (spec[7] == ':' && sscanf(spec + 8, "%lf:%lf", &bench->hot_keys, &bench->hot_ops) != 2) {
+			return -1;
+		}
+		if (bench->hot_keys <= 0 || bench->hot_keys > 1 || bench->hot_ops < 0 || bench->hot_ops > 1) {
+			return -1;
+		}
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+static void
+usage(void) {
+	fprintf(stderr,
+		"usage: dynoc-bench [options] -n node [-n node ..]\n"
+		"  -t threads               client threads (default 4)\n"
+		"  -d seconds               duration (default 10)\n"
+		"  -m cmd:weight,..         mix of get set del incr hget hset (default get:80,set:20)\n"
+		"  -s bytes|min-max         value size, uniform between min and max (default 100)\n"
+		"  -k keys                  keyspace size (default 100000)\n"
+		"  -D uniform|zipf[:theta]|hotspot[:keys:ops]\n"
+		"                           key distribution (default uniform; zipf 0.99;\n"
+		"                           hotspot 0.2 of the keys get 0.8 of the operations)\n"
+		"  -P depth                 commands per pipelined batch (default 1)\n"
+		"  -R ops                   open loop at this total rate, latency measured\n"
+		"                           from the scheduled start (default closed loop)\n"
+		"  -p prefix                key prefix (default \"bench:\")\n"
+		"latencies are in microseconds, of whole batches with -P; commands count\n"
+		"against the node that answered, failures against the owner in the first rack.\n");
+	topology_usage();
+	exit(1);
+}
+
+int
+main(int argc, char **argv) {
+	struct topology topo;
+	struct bench bench;
+	struct bench_thread *threads;
+	struct hist *total;
+	double secs;
+	uint64_t start;
+	uint32_t i;
+	int c, t;
+
+	memset(&topo, 0, sizeof(topo));
+	memset(&bench, 0, sizeof(bench));
+	bench.threads = 4;
+	bench.duration = 10;
+	bench.pipeline = 1;
+	bench.value_min = bench.value_max = 100;
+	bench.keyspace = 100000;
+	bench.prefix = "bench:";
+	bench.mix[CMD_GET] = 80;
+	bench.mix[CMD_SET] = 20;
+	bench.mix_total = 100;
+
+	while ((c = getopt(argc, argv, "n:a:H:t:d:m:s:k:D:P:R:p:")) != -1) {
+		switch (c) {
+		case 'n':
+			if (topology_add(&topo, optarg) < 0) {
+				usage();
+			}
+			break;
+		case 'a':
+			topo.pass = optarg;
+			break;
+		case 'H':
+			topo.hash = optarg;
+			break;
+		case 't':
+			bench.threads = atoi(optarg);
+			break;
+		case 'd':
+			bench.duration = atoi(optarg);
+			break;
+		case 'm':
+			if (parse_mix(&bench, optarg) < 0) {
+				usage();
+			}
+			break;
+		case 's':
+			if (sscanf(optarg, "%zu-%zu", &bench.value_min, &bench.value_max) == 1) {
+				bench.value_max = bench.value_min;
+			}
+			break;
+		case 'k':
+			bench.keyspace = strtoull(optarg, NULL, 10);
+			break;
+		case 'D':
+			if (parse_dist(&bench, optarg) < 0) {
+				usage();
+			}
+			break;
+		case 'P':
+			bench.pipeline = atoi(optarg);
+			break;
+		case 'R':
+			bench.rate = atof(optarg);
+			break;
+		case 'p':
+			bench.prefix = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc || bench.threads < 1 || bench.duration < 1 || bench.pipeline < 1 ||
+	    bench.keyspace < 2 || bench.value_max < bench.value_min || bench.rate < 0) {
+		usage();
+	}
+
+	bench.values = malloc(bench.value_max + 1);
+	if (!bench.values) {
+		return 1;
+	}
+	memset(bench.values, 'x', bench.value_max);
+	bench.values[bench.value_max] = '\0';
+	if (bench.dist == DIST_ZIPF) {
+		zipf_init(&bench);
+	}
+
+	dynoc_init(&bench.dynoc);
+	if (topology_connect(&topo, &bench.dynoc) < 0) {
+		return 1;
+	}
+	bench.rack = rack_find(&bench.dynoc, NULL);
+
+	threads = calloc(bench.threads, sizeof(*threads));
+	total = hist_create(CMD_COUNT + bench.dynoc.nslots, HIST_SUB_BITS);
+	if (!threads || !total) {
+		return 1;
+	}
+
+	start = now_ns();
+	for (t = 0; t < bench.threads; t++) {
+		threads[t].bench = &bench;
+		threads[t].rand = 0x9e3779b97f4a7c15ULL * (t + 1) ^ start;
+		threads[t].cmds = hist_create(CMD_COUNT, HIST_SUB_BITS);
+		threads[t].nodes = hist_create(bench.dynoc.nslots, HIST_SUB_BITS);
+		if (!threads[t].cmds || !threads[t].nodes || pthread_create(&threads[t].tid, NULL, bench_thread, &threads[t]) != 0) {
+			fprintf(stderr, "cannot start thread %d\n", t);
+			return 1;
+		}
+	}
+	for (t = 0; t < bench.threads; t++) {
+		pthread_join(threads[t].tid, NULL);
+		for (i = 0; i < CMD_COUNT; i++) {
+			hist_merge(&total[i], &threads[t].cmds[i]);
+		}
+		for (i = 0; i < bench.dynoc.nslots; i++) {
+			hist_merge(&total[CMD_COUNT + i], &threads[t].nodes[i]);
+		}
+		hist_destroy(threads[t].cmds);
+		hist_destroy(threads[t].nodes);
+	}
+	secs = (now_ns() - start) / 1e9;
+
+	if (bench.failed) {
+		fprintf(stderr, "run stopped\n");
+		dynoc_destroy(&bench.dynoc);
+		free(threads);
+		hist_destroy(total);
+		free(bench.values);
+		free(topo.nodes);
+		return 1;
+	}
+
+	if (bench.pipeline > 1) {
+		printf("latencies are of whole batches of %d commands\n", bench.pipeline);
+	}
+	printf("%-24s %10s %10s %8s %8s %8s %8s %8s %8s %8s\n",
+		"", "ops", "ops/s", "errors", "p50", "p90", "p99", "p99.9", "p99.99", "max");
+	for (i = 0; i < CMD_COUNT; i++) {
+		hist_print(cmd_names[i], &total[i], secs);
+	}
+	print_nodes(bench.dynoc.local_dc, total + CMD_COUNT, secs);
+	print_nodes(bench.dynoc.remote_dc, total + CMD_COUNT, secs);
+
+	dynoc_destroy(&bench.dynoc);
+	free(threads);
+	hist_destroy(total);
+	free(bench.values);
+	free(topo.nodes);
+	return 0;
+}
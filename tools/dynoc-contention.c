@@ -0,0 +1,301 @@
+/*
+ * Dynoc is a minimalistic C client library for the dynomite.
+ * Copyright (C) 2016-2017 huya.com, Lampman Yao
+ */
+
+/*
+ * Dynomite - A thin, distributed replication layer for multi non-distributed storages.
+ * Copyright (C) 2014 Netflix, Inc.
+ */
+
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "dynoc-core.h"
+#include "dynoc-conn.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define KEYS_PER_NODE 64
+#define KEY_LEN       32
+
+/*
+ * The connection slot as it was before alignment, for comparison: packed
+ * in one array, so neighbouring nodes share cache lines.
+ */
+struct packed_slot {
+	uint32_t status;
+	uint32_t cold;
+	uint32_t pending;
+	uint32_t nscripts;
+	time_t last_used;
+	int timeout_ms;
+	pthread_mutex_t lock;
+	redisContext *ctx;
+	const struct endpoint *endpoint;
+	struct socket_options sockopts;
+};
+
+typedef enum slot_mode {
+	MODE_ALIGNED,
+	MODE_PACKED,
+	MODE_THREAD
+} slot_mode_t;
+
+struct contention {
+	struct dynoc dynoc;
+	struct rack *rack;
+	int nodes;
+	int shared;
+	slot_mode_t mode;
+	int duration;
+	char (*keys)[KEYS_PER_NODE][KEY_LEN];
+	struct packed_slot *slots;
+	int stop;
+};
+
+struct contention_thread {
+	struct contention *contention;
+	pthread_t tid;
+	int node;
+	uint64_t rand;
+	uint64_t ops;
+	uint64_t sink;
+};
+
+static void
+usage(void) {
+	fprintf(stderr,
+		"usage: dynoc-contention [options]\n"
+		"  -n nodes                 nodes in the rack (default 64)\n"
+		"  -t threads               highest thread count of the sweep (default 64)\n"
+		"  -d ms                    duration of every step (default 1000)\n"
+		"  -s                       threads pick random nodes instead of one each\n"
+		"no connection is opened: every operation routes a key to its node and\n"
+		"takes the node's lock, with the aligned connection slots and with the\n"
+		"packed layout they replaced, or takes the thread's own connection of\n"
+		"a thread context.\n");
+	exit(1);
+}
+
+static uint64_t
+now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+next_rand(struct contention_thread *thread) {
+	thread->rand ^= thread->rand >> 12;
+	thread->rand ^= thread->rand << 25;
+	thread->rand ^= thread->rand >> 27;
+	return thread->rand * 2685821657736338717ULL;
+}
+
+/* What a command does to its node's slot before and after the I/O. */
+static void *
+contention_thread(void *arg) {
+	struct contention_thread *thread = arg;
+	struct contention *contention = thread->contention;
+	struct redis_connection *redis_conn, *shared;
+	struct packed_slot *slot;
+	dynoc_thread_ctx_t *ctx = NULL;
+	const char *key;
+	uint64_t ops = 0, sink = 0;
+	int node = thread->node;
+
+	if (contention->mode == MODE_THREAD && !(ctx = dynoc_thread_ctx_create(&contention->dynoc))) {
+		return NULL;
+	}
+
+	while (!__atomic_load_n(&contention->stop, __ATOMIC_RELAXED)) {
+		if (contention->shared) {
+			node = next_rand(thread) % contention->nodes;
+		}
+		key = contention->keys[node][ops % KEYS_PER_NODE];
+		redis_conn = rack_owner(&contention->dynoc, contention->rack, key, strlen(key));
+
+		switch (contention->mode) {
+		case MODE_PACKED:
+			slot = &contention->slots[redis_conn - contention->rack->redis_conn_pool];
+			pthread_mutex_lock(&slot->lock);
+			sink += slot->status + slot->cold + slot->timeout_ms + (slot->ctx != NULL);
+			slot->pending = 0;
+			pthread_mutex_unlock(&slot->lock);
+			break;
+		case MODE_ALIGNED:
+		case MODE_THREAD:
+			shared = redis_conn;
+			redis_conn = connection_acquire(&contention->dynoc, shared);
+			sink += redis_conn->status + redis_conn->cold + redis_conn->timeout_ms + (redis_conn->ctx != NULL);
+			redis_conn->pending = 0;
+			connection_release(shared, redis_conn);
+			break;
+		}
+		ops++;
+	}
+
+	dynoc_thread_ctx_free(ctx);
+	thread->ops = ops;
+	thread->sink = sink;
+	return NULL;
+}
+
+static double
+run_step(struct contention *contention, int threads, slot_mode_t mode) {
+	struct contention_thread *workers;
+	uint64_t start, ops = 0;
+	int i;
+
+	workers = calloc(threads, sizeof(*workers));
+	if (!workers) {
+		return 0;
+	}
+	contention->mode = mode;
+	contention->stop = 0;
+
+	start = now_ns();
+	for (i = 0; i < threads; i++) {
+		workers[i].contention = contention;
+		workers[i].node = i % contention->nodes;
+		workers[i].rand = 0x9e3779b97f4a7c15ULL * (i + 1);
+		pthread_create(&workers[i].tid, NULL, contention_thread, &workers[i]);
+	}
+	usleep(contention->duration * 1000);
+	__atomic_store_n(&contention->stop, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < threads; i++) {
+		pthread_join(workers[i].tid, NULL);
+		ops += workers[i].ops;
+	}
+	free(workers);
+	return ops / ((now_ns() - start) / 1e9);
+}
+
+/* Find KEYS_PER_NODE keys owned by every node. */
+static int
+find_keys(struct contention *contention) {
+	struct redis_connection *redis_conn;
+	char key[KEY_LEN];
+	int *found, missing = contention->nodes, node;
+	uint64_t i;
+
+	found = calloc(contention->nodes, sizeof(*found));
+	contention->keys = calloc(contention->nodes, sizeof(*contention->keys));
+	if (!found || !contention->keys) {
+		free(found);
+		return -1;
+	}
+
+	for (i = 0; missing && i < 100000000; i++) {
+		snprintf(key, sizeof(key), "contention:%llu", (unsigned long long)i);
+		redis_conn = rack_owner(&contention->dynoc, contention->rack, key, strlen(key));
+		node = redis_conn - contention->rack->redis_conn_pool;
+		if (found[node] < KEYS_PER_NODE) {
+			strcpy(contention->keys[node][found[node]++], key);
+			if (found[node] == KEYS_PER_NODE) {
+				missing--;
+			}
+		}
+	}
+	free(found);
+	return missing ? -1 : 0;
+}
+
+int
+main(int argc, char **argv) {
+	struct contention contention;
+	char token[16];
+	double aligned, packed, thread;
+	int max_threads = 64, threads, c, i;
+
+	memset(&contention, 0, sizeof(contention));
+	contention.nodes = 64;
+	contention.duration = 1000;
+
+	while ((c = getopt(argc, argv, "n:t:d:s")) != -1) {
+		switch (c) {
+		case 'n':
+			contention.nodes = atoi(optarg);
+			break;
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 'd':
+			contention.duration = atoi(optarg);
+			break;
+		case 's':
+			contention.shared = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (contention.nodes <= 0 || max_threads <= 0 || contention.duration <= 0 || optind != argc) {
+		usage();
+	}
+
+	/* Lazy, so that starting opens no connection. */
+	dynoc_init(&contention.dynoc);
+	dynoc_lazy_init(&contention.dynoc, 0);
+	dynoc_datacenter_init(&contention.dynoc, 1, "dc", LOCAL_DC);
+	dynoc_rack_init(&contention.dynoc, contention.nodes, "rack", LOCAL_DC);
+	for (i = 0; i < contention.nodes; i++) {
+		snprintf(token, sizeof(token), "%u", (unsigned)(((uint64_t)1 << 32) / contention.nodes * i));
+		dynoc_add_node(&contention.dynoc, "127.0.0.1", 10000 + i, NULL, token, "rack", LOCAL_DC);
+	}
+	dynoc_start(&contention.dynoc);
+	contention.rack = rack_find(&contention.dynoc, NULL);
+
+	contention.slots = calloc(contention.nodes, sizeof(*contention.slots));
+	if (!contention.rack || !contention.slots || find_keys(&contention) < 0) {
+		fprintf(stderr, "dynoc-contention: setup failed\n");
+		return 1;
+	}
+	for (i = 0; i < contention.nodes; i++) {
+		pthread_mutex_init(&contention.slots[i].lock, NULL);
+	}
+
+	printf("%d nodes, %s, %ld CPUs\n", contention.nodes,
+		contention.shared ? "random nodes" : "one node per thread", sysconf(_SC_NPROCESSORS_ONLN));
+	printf("%8s %14s %14s %14s %8s\n", "threads", "packed ops/s", "aligned ops/s", "thread ops/s", "speedup");
+	for (threads = 1; ; threads = threads * 2 > max_threads && threads < max_threads ? max_threads : threads * 2) {
+		packed = run_step(&contention, threads, MODE_PACKED);
+		aligned = run_step(&contention, threads, MODE_ALIGNED);
+		thread = run_step(&contention, threads, MODE_THREAD);
+		printf("%8d %14.0f %14.0f %14.0f %7.2fx\n", threads, packed, aligned, thread,
+			packed ? aligned / packed : 0);
+		fflush(stdout);
+		if (threads >= max_threads) {
+			break;
+		}
+	}
+
+	for (i = 0; i < contention.nodes; i++) {
+		pthread_mutex_destroy(&contention.slots[i].lock);
+	}
+	free(contention.slots);
+	free(contention.keys);
+	dynoc_destroy(&contention.dynoc);
+	return 0;
+}
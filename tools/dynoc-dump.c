@@ -0,0 +1,121 @@
+/*
+ * Dynoc is a minimalistic C client library for the dynomite.
+ * Copyright (C) 2016-2017 huya.com, Lampman Yao
+ */
+
+/*
+ * Dynomite - A thin, distributed replication layer for multi non-distributed storages.
+ * Copyright (C) 2014 Netflix, Inc.
+ */
+
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "topology.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+static void
+usage(void) {
+	fprintf(stderr,
+		"usage: dynoc-dump [options] -n node [-n node ..] prefix\n"
+		"  -f restore|typed         output RESTORE commands (default) or SET/HMSET\n"
+		"  -r rack                  rack to dump (default the first)\n"
+		"  -m pattern               only keys matching pattern\n"
+		"  -c count                 SCAN COUNT hint\n"
+		"writes prefix.0 .. prefix.N-1, one file per node; restore each with\n"
+		"dynoc-load -f resp.\n");
+	topology_usage();
+	exit(1);
+}
+
+int
+main(int argc, char **argv) {
+	struct topology topo;
+	struct dump_options opts;
+	struct dump_stats stats;
+	struct dynoc dynoc;
+	struct timeval start, end;
+	dump_format_t format = DUMP_RESTORE;
+	double secs;
+	int c, ret;
+
+	memset(&topo, 0, sizeof(topo));
+	memset(&opts, 0, sizeof(opts));
+
+	while ((c = getopt(argc, argv, "n:a:H:f:r:m:c:")) != -1) {
+		switch (c) {
+		case 'n':
+			if (topology_add(&topo, optarg) < 0) {
+				usage();
+			}
+			break;
+		case 'a':
+			topo.pass = optarg;
+			break;
+		case 'H':
+			topo.hash = optarg;
+			break;
+		case 'f':
+			if (strcmp(optarg, "restore") == 0) {
+				format = DUMP_RESTORE;
+			} else if (strcmp(optarg, "typed") == 0) {
+				format = DUMP_TYPED;
+			} else {
+				usage();
+			}
+			break;
+		case 'r':
+			opts.rack = optarg;
+			break;
+		case 'm':
+			opts.match = optarg;
+			break;
+		case 'c':
+			opts.count = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1) {
+		usage();
+	}
+
+	dynoc_init(&dynoc);
+	if (topology_connect(&topo, &dynoc) < 0) {
+		return 1;
+	}
+
+	gettimeofday(&start, NULL);
+	ret = dynoc_dump(&dynoc, argv[optind], format, &opts, &stats);
+	gettimeofday(&end, NULL);
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+
+	printf("keys %llu written %llu skipped %llu failed nodes %u\n",
+		(unsigned long long)stats.keys, (unsigned long long)stats.written,
+		(unsigned long long)stats.skipped, stats.failed_nodes);
+	printf("%.2f s, %.0f keys/s\n", secs, secs > 0 ? stats.keys / secs : 0);
+
+	dynoc_destroy(&dynoc);
+	free(topo.nodes);
+	return ret < 0 ? 1 : 0;
+}
@@ -0,0 +1,696 @@
+/*
+ * Dynoc is a minimalistic C client library for the dynomite.
+ * Copyright (C) 2016-2017 huya.com, Lampman Yao
+ */
+
+/*
+ * Dynomite - A thin, distributed replication layer for multi non-distributed storages.
+ * Copyright (C) 2014 Netflix, Inc.
+ */
+
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "dynoc-core.h"
+#include "hist.h"
+#include "mock.h"
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HIST_SUB_BITS 5    /* 1/16 at most off, enough for p50 and p99 */
+
+#define MAX_NODES   64
+#define MAX_EVENTS  32
+#define MAX_SECONDS 3600
+#define SLOT_MS     100
+#define MAX_SLOTS   (MAX_SECONDS * 1000 / SLOT_MS)
+#define TICK_MS     10
+
+typedef enum action {
+	ACT_DOWN,
+	ACT_HANG,
+	ACT_LATENCY,
+	ACT_JITTER,
+	ACT_ERRORS,
+	ACT_DROPS,
+	ACT_AUTH_FAIL,
+	ACT_HEAL,
+	ACT_END
+} action_t;
+
+static const char *action_names[] = {
+	"down", "hang", "latency", "jitter", "errors", "drops", "auth_fail", "heal", "end"
+};
+
+struct node {
+	const char *dc;
+	char rack[16];
+	int index;
+	int port;
+	char token[16];
+};
+
+struct event {
+	int64_t at_ms;
+	action_t action;
+	uint64_t nodes;
+	double value;
+	char text[128];
+	int64_t applied_ms;
+	int64_t reconnected_ms;
+};
+
+struct faults {
+	struct dynoc dynoc;
+	struct mock *mock;
+	struct node nodes[MAX_NODES];
+	int nnode;
+	struct event events[MAX_EVENTS];
+	int nevent;
+	int threads;
+	int keys;
+	const char *pass;
+	int64_t start_ms;
+	int64_t end_ms;
+	int phase;
+	int stop;
+	/* Client-visible outcome per SLOT_MS of run time. */
+	uint64_t *slot_ops;
+	uint64_t *slot_errors;
+};
+
+struct faults_thread {
+	struct faults *faults;
+	pthread_t tid;
+	uint64_t rand;
+	/* Latency of each phase: before the first event, then after each. */
+	struct hist *phases;
+};
+
+static void
+usage(void) {
+	fprintf(stderr,
+		"usage: dynoc-faults [options] scenario\n"
+		"  -l racks:nodes           local datacenter layout (default 3:1)\n"
+		"  -r racks:nodes           remote datacenter layout (default none)\n"
+		"  -p port                  first port of the mock nodes (default 7700)\n"
+		"  -a password              password of the mock nodes (default \"mock\")\n"
+		"  -t threads               client threads (default 4)\n"
+		"  -k keys                  keyspace size (default 10000)\n"
+		"  -T ms                    command timeout (default 1000)\n"
+		"  -C ms                    connect timeout (default 1000)\n"
+		"  -i seconds               health check interval (default 30)\n"
+		"scenario lines are \"seconds action target [value]\", '#' comments:\n"
+		"  actions  down, hang (alias partition), latency ms, jitter ms,\n"
+		"           errors rate, drops rate, auth_fail, heal, end\n"
+		"  targets  all, dc local|remote, rack <dc>.rackN, node <dc>.rackN.I\n"
+		"e.g. \"5 down node local.rack1.0\", \"8 latency rack local.rack2 200\",\n"
+		"\"12 partition dc local\", \"20 heal all\", \"60 end\".\n");
+	exit(1);
+}
+
+static int64_t
+now_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int64_t
+elapsed_ms(struct faults *faults) {
+	return now_us() / 1000 - faults->start_ms;
+}
+
+static uint64_t
+next_rand(struct faults_thread *thread) {
+	thread->rand ^= thread->rand >> 12;
+	thread->rand ^= thread->rand << 25;
+	thread->rand ^= thread->rand >> 27;
+	return thread->rand * 2685821657736338717ULL;
+}
+
+/*
+ * Topology
+ */
+
+static int
+parse_layout(const char *spec, int *racks, int *nodes) {
+	if (sscanf(spec, "%d:%d", racks, nodes) != 2 || *racks < 0 || *nodes <= 0) {
+		return -1;
+	}
+	return 0;
+}
+
+static int
+add_nodes(struct faults *faults, const char *dc, int racks, int nodes, int *port) {
+	struct node *node;
+	int i, j;
+
+	for (i = 0; i < racks; i++) {
+		for (j = 0; j < nodes; j++) {
+			if (faults->nnode == MAX_NODES) {
+				fprintf(stderr, "at most %d nodes\n", MAX_NODES);
+				return -1;
+			}
+			node = &faults->nodes[faults->nnode++];
+			node->dc = dc;
+			snprintf(node->rack, sizeof(node->rack), "rack%d", i + 1);
+			node->index = j;
+			node->port = (*port)++;
+			snprintf(node->token, sizeof(node->token), "%u",
+				(unsigned)(((uint64_t)1 << 32) / nodes * j));
+		}
+	}
+	return 0;
+}
+
+static int
+connect_dc(struct faults *faults, const char *name, dc_type_t type, int racks, int nodes) {
+	struct node *node;
+	char rack[16];
+	int i;
+
+	if (racks == 0) {
+		return 0;
+	}
+	dynoc_datacenter_init(&faults->dynoc, racks, name, type);
+	for (i = 0; i < racks; i++) {
+		snprintf(rack, sizeof(rack), "rack%d", i + 1);
+		dynoc_rack_init(&faults->dynoc, nodes, rack, type);
+	}
+	for (i = 0; i < faults->nnode; i++) {
+		node = &faults->nodes[i];
+		if (strcmp(node->dc, name) != 0) {
+			continue;
+		}
+		if (dynoc_add_node(&faults->dynoc, "127.0.0.1", node->port, faults->pass,
+		                   node->token, node->rack, type) < 0) {
+			fprintf(stderr, "cannot add node %d\n", node->port);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Scenario
+ */
+
+/* The nodes `target` names, as a mask; 0 if it names none. */
+static uint64_t
+parse_target(struct faults *faults, const char *kind, const char *name) {
+	char dc[16] = "", rack[16] = "";
+	uint64_t mask = 0;
+	int index = -1, i;
+	struct node *node;
+
+	if (strcmp(kind, "all") == 0) {
+		return faults->nnode == 64 ? ~0ULL : (1ULL << faults->nnode) - 1;
+	}
+	if (!name || sscanf(name, "%15[^.].%15[^.].%d", dc, rack, &index) < 1) {
+		return 0;
+	}
+	if ((strcmp(kind, "dc") == 0 && (rack[0] || index >= 0)) ||
+	    (strcmp(kind, "rack") == 0 && (!rack[0] || index >= 0)) ||
+	    (strcmp(kind, "node") == 0 && index < 0)) {
+		return 0;
+	}
+	if (strcmp(kind, "dc") != 0 && strcmp(kind, "rack") != 0 && strcmp(kind, "node") != 0) {
+		return 0;
+	}
+
+	for (i = 0; i < faults->nnode; i++) {
+		node = &faults->nodes[i];
+		if (strcmp(node->dc, dc) == 0 && (!rack[0] || strcmp(node->rack, rack) == 0) &&
+		    (index < 0 || node->index == index)) {
+			mask |= 1ULL << i;
+		}
+	}
+	return mask;
+}
+
+static int
+parse_scenario(struct faults *faults, const char *path) {
+	char line[256], kind[16], name[64], *p;
+	char action[16];
+	struct event *event;
+	double at;
+	int lineno = 0, n, i;
+	FILE *fp;
+
+	fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+	if (!fp) {
+		perror(path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		if ((p = strchr(line, '#'))) {
+			*p = '\0';
+		}
+		for (p = line + strlen(line); p > line && isspace((unsigned char)p[-1]); *--p = '\0');
+		for (p = line; isspace((unsigned char)*p); p++);
+		if (!*p) {
+			continue;
+		}
+		if (faults->nevent == MAX_EVENTS) {
+			fprintf(stderr, "%s:%d: at most %d events\n", path, lineno, MAX_EVENTS);
+			goto fail;
+		}
+
+		event = &faults->events[faults->nevent];
+		memset(event, 0, sizeof(*event));
+		snprintf(event->text, sizeof(event->text), "%s", p);
+		kind[0] = name[0] = '\0';
+		n = sscanf(p, "%lf %15s %15s %63s %lf", &at, action, kind, name, &event->value);
+		if (n < 2 || at < 0 || at > MAX_SECONDS) {
+			goto bad;
+		}
+		event->at_ms = (int64_t)(at * 1000);
+		if (faults->nevent && event->at_ms < faults->events[faults->nevent - 1].at_ms) {
+			fprintf(stderr, "%s:%d: events out of order\n", path, lineno);
+			goto fail;
+		}
+
+		if (strcmp(action, "partition") == 0) {
+			strcpy(action, "hang");
+		}
+		for (i = 0; i <= ACT_END && strcmp(action, action_names[i]) != 0; i++);
+		if (i > ACT_END) {
+			goto bad;
+		}
+		event->action = i;
+		if (event->action == ACT_END) {
+			faults->nevent++;
+			break;
+		}
+
+		/* "all" takes no name, so the value moves one field left. */
+		if (strcmp(kind, "all") == 0 && n >= 4) {
+			event->value = atof(name);
+			n++;
+		}
+		event->nodes = parse_target(faults, kind, name);
+		if (!event->nodes) {
+			goto bad;
+		}
+		if ((event->action == ACT_LATENCY || event->action == ACT_JITTER ||
+		     event->action == ACT_ERRORS || event->action == ACT_DROPS) && n < 5) {
+			goto bad;
+		}
+		faults->nevent++;
+	}
+
+	if (fp != stdin) {
+		fclose(fp);
+	}
+	if (!faults->nevent || faults->events[faults->nevent - 1].action != ACT_END) {
+		fprintf(stderr, "%s: the scenario must finish with an end event\n", path);
+		return -1;
+	}
+	return 0;
+
+bad:
+	fprintf(stderr, "%s:%d: bad event \"%s\"\n", path, lineno, p);
+fail:
+	if (fp != stdin) {
+		fclose(fp);
+	}
+	return -1;
+}
+
+static void
+apply_event(struct faults *faults, const struct event *event) {
+	struct mock_faults mf;
+	int i;
+
+	for (i = 0; i < faults->nnode; i++) {
+		if (!(event->nodes & (1ULL << i))) {
+			continue;
+		}
+		mock_get_faults(faults->mock, i, &mf);
+		switch (event->action) {
+		case ACT_DOWN:
+			mf.down = 1;
+			break;
+		case ACT_HANG:
+			mf.hang = 1;
+			break;
+		case ACT_LATENCY:
+			mf.latency_ms = (int)event->value;
+			break;
+		case ACT_JITTER:
+			mf.jitter_ms = (int)event->value;
+			break;
+		case ACT_ERRORS:
+			mf.error_rate = event->value;
+			break;
+		case ACT_DROPS:
+			mf.drop_rate = event->value;
+			break;
+		case ACT_AUTH_FAIL:
+			mf.auth_fail = 1;
+			break;
+		case ACT_HEAL:
+			memset(&mf, 0, sizeof(mf));
+			break;
+		default:
+			break;
+		}
+		mock_set_faults(faults->mock, i, &mf);
+	}
+}
+
+struct reconnect_check {
+	struct faults *faults;
+	uint64_t nodes;
+	int missing;
+};
+
+static void
+check_node(const struct node_stats *stats, void *arg) {
+	struct reconnect_check *check = arg;
+	int i;
+
+	for (i = 0; i < check->faults->nnode; i++) {
+		if ((check->nodes & (1ULL << i)) && stats->endpoint->port == check->faults->nodes[i].port &&
+		    !stats->connected) {
+			check->missing++;
+		}
+	}
+}
+
+/* Whether the client holds a live connection to every node of `nodes`. */
+static int
+reconnected(struct faults *faults, uint64_t nodes) {
+	struct reconnect_check check = { faults, nodes, 0 };
+
+	dynoc_stats(&faults->dynoc, check_node, &check);
+	return check.missing == 0;
+}
+
+/*
+ * Load
+ */
+
+static void *
+load_thread(void *arg) {
+	struct faults_thread *thread = arg;
+	struct faults *faults = thread->faults;
+	redisReply *reply;
+	char key[32];
+	int64_t start, end, slot;
+	int phase, failed;
+
+	while (!__atomic_load_n(&faults->stop, __ATOMIC_ACQUIRE)) {
+		snprintf(key, sizeof(key), "faults:%llu",
+			(unsigned long long)(next_rand(thread) % faults->keys));
+		start = now_us();
+		if (next_rand(thread) % 100 < 80) {
+			reply = dynoc_get(&faults->dynoc, key);
+			failed = !reply || reply->type == REDIS_REPLY_ERROR;
+			if (reply) {
+				freeReplyObject(reply);
+			}
+		} else {
+			failed = dynoc_set(&faults->dynoc, key, "value") < 0;
+		}
+		end = now_us();
+
+		/* An operation belongs to the phase it completes in. */
+		phase = __atomic_load_n(&faults->phase, __ATOMIC_ACQUIRE);
+		hist_record(&thread->phases[phase], end - start);
+		slot = (end / 1000 - faults->start_ms) / SLOT_MS;
+		if (slot < MAX_SLOTS) {
+			__sync_fetch_and_add(&faults->slot_ops[slot], 1);
+			if (failed) {
+				__sync_fetch_and_add(&faults->slot_errors[slot], 1);
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Report
+ */
+
+static void
+report_phase(struct faults *faults, struct faults_thread *threads, int phase, int64_t from, int64_t to) {
+	struct hist *hist;
+	uint64_t ops = 0, errors = 0;
+	int64_t slot, last_error = -1;
+	int i;
+
+	hist = hist_create(1, HIST_SUB_BITS);
+	if (!hist) {
+		return;
+	}
+	for (i = 0; i < faults->threads; i++) {
+		hist_merge(hist, &threads[i].phases[phase]);
+	}
+	/* Events are applied late, the last ones may end past the slots. */
+	for (slot = from / SLOT_MS; slot < to / SLOT_MS && slot < MAX_SLOTS; slot++) {
+		ops += faults->slot_ops[slot];
+		errors += faults->slot_errors[slot];
+		if (faults->slot_errors[slot]) {
+			last_error = slot;
+		}
+	}
+
+	printf("  ops %llu, errors %llu (%.2f%%), latency p50 %llu p99 %llu max %llu us\n",
+		(unsigned long long)ops, (unsigned long long)errors, ops ? 100.0 * errors / ops : 0.0,
+		(unsigned long long)hist_percentile(hist, 50),
+		(unsigned long long)hist_percentile(hist, 99),
+		(unsigned long long)hist->max);
+	hist_destroy(hist);
+
+	/* Failed over once errors stop for the last second of the phase. */
+	if (!phase) {
+		return;
+	}
+	if (last_error < 0) {
+		printf("  no client-visible errors\n");
+	} else if ((last_error + 1) * SLOT_MS + 1000 <= to) {
+		printf("  errors stopped after %.1fs\n", ((last_error + 1) * SLOT_MS - from) / 1000.0);
+	} else {
+		printf("  errors never stopped\n");
+	}
+}
+
+static void
+report(struct faults *faults, struct faults_thread *threads) {
+	struct event *event;
+	uint64_t ops, errors;
+	int64_t from, to, slot, second;
+	int i;
+
+	printf("timeline (per second)\n");
+	for (second = 0; second * 1000 < faults->end_ms && second < MAX_SECONDS; second++) {
+		ops = errors = 0;
+		for (slot = second * 1000 / SLOT_MS; slot < (second + 1) * 1000 / SLOT_MS; slot++) {
+			ops += faults->slot_ops[slot];
+			errors += faults->slot_errors[slot];
+		}
+		printf("  %4llds %8llu ops %8llu errors\n", (long long)second,
+			(unsigned long long)ops, (unsigned long long)errors);
+	}
+
+	printf("baseline, 0.0s\n");
+	report_phase(faults, threads, 0, 0, faults->events[0].applied_ms);
+	for (i = 0; i < faults->nevent - 1; i++) {
+		event = &faults->events[i];
+		from = event->applied_ms;
+		to = faults->events[i + 1].applied_ms;
+		printf("\"%s\", %.1fs\n", event->text, from / 1000.0);
+		report_phase(faults, threads, i + 1, from, to);
+		if (event->action != ACT_HEAL) {
+			continue;
+		}
+		if (event->reconnected_ms >= 0) {
+			printf("  reconnected after %.1fs\n", (event->reconnected_ms - from) / 1000.0);
+		} else {
+			printf("  not reconnected\n");
+		}
+	}
+}
+
+int
+main(int argc, char **argv) {
+	struct faults faults;
+	struct faults_thread *threads;
+	struct event *event, *pending = NULL;
+	int local_racks = 3, local_nodes = 1, remote_racks = 0, remote_nodes = 1;
+	int port = 7700, command_timeout = 1000, connect_timeout = 1000, interval = 0;
+	int c, i, next = 0, ret = 1;
+	int64_t now;
+
+	memset(&faults, 0, sizeof(faults));
+	faults.threads = 4;
+	faults.keys = 10000;
+	faults.pass = "mock";
+
+	while ((c = getopt(argc, argv, "l:r:p:a:t:k:T:C:i:")) != -1) {
+		switch (c) {
+		case 'l':
+			if (parse_layout(optarg, &local_racks, &local_nodes) < 0 || local_racks == 0) {
+				usage();
+			}
+			break;
+		case 'r':
+			if (parse_layout(optarg, &remote_racks, &remote_nodes) < 0) {
+				usage();
+			}
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'a':
+			faults.pass = optarg;
+			break;
+		case 't':
+			faults.threads = atoi(optarg);
+			break;
+		case 'k':
+			faults.keys = atoi(optarg);
+			break;
+		case 'T':
+			command_timeout = atoi(optarg);
+			break;
+		case 'C':
+			connect_timeout = atoi(optarg);
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1 || faults.threads <= 0 || faults.keys <= 0 || port <= 0) {
+		usage();
+	}
+
+	if (add_nodes(&faults, "local", local_racks, local_nodes, &port) < 0 ||
+	    add_nodes(&faults, "remote", remote_racks, remote_nodes, &port) < 0 ||
+	    parse_scenario(&faults, argv[optind]) < 0) {
+		return 1;
+	}
+
+	faults.mock = mock_create(faults.pass);
+	if (!faults.mock) {
+		return 1;
+	}
+	for (i = 0; i < faults.nnode; i++) {
+		if (mock_add_node(faults.mock, faults.nodes[i].port) < 0) {
+			fprintf(stderr, "cannot listen on port %d\n", faults.nodes[i].port);
+			goto out;
+		}
+	}
+	if (mock_start(faults.mock) < 0) {
+		goto out;
+	}
+
+	dynoc_init(&faults.dynoc);
+	if (dynoc_command_timeout_init(&faults.dynoc, command_timeout) < 0 ||
+	    dynoc_connect_timeout_init(&faults.dynoc, connect_timeout) < 0 ||
+	    (interval && dynoc_health_check_init(&faults.dynoc, interval) < 0)) {
+		usage();
+	}
+	if (connect_dc(&faults, "local", LOCAL_DC, local_racks, local_nodes) < 0 ||
+	    connect_dc(&faults, "remote", REMOTE_DC, remote_racks, remote_nodes) < 0 ||
+	    dynoc_start(&faults.dynoc) < 0) {
+		fprintf(stderr, "cannot start the client\n");
+		goto out;
+	}
+
+	faults.slot_ops = calloc(MAX_SLOTS, sizeof(uint64_t));
+	faults.slot_errors = calloc(MAX_SLOTS, sizeof(uint64_t));
+	threads = calloc(faults.threads, sizeof(*threads));
+	if (!faults.slot_ops || !faults.slot_errors || !threads) {
+		goto destroy;
+	}
+
+	for (i = 0; i < faults.threads; i++) {
+		threads[i].phases = hist_create(MAX_EVENTS + 1, HIST_SUB_BITS);
+		if (!threads[i].phases) {
+			goto free_threads;
+		}
+	}
+
+	faults.start_ms = now_us() / 1000;
+	for (i = 0; i < faults.threads; i++) {
+		threads[i].faults = &faults;
+		threads[i].rand = 0x9e3779b97f4a7c15ULL * (i + 1);
+		pthread_create(&threads[i].tid, NULL, load_thread, &threads[i]);
+	}
+
+	/* Fire the events on time and watch the healed nodes come back. */
+	while (next < faults.nevent) {
+		now = elapsed_ms(&faults);
+		if (pending && reconnected(&faults, pending->nodes)) {
+			pending->reconnected_ms = now;
+			pending = NULL;
+		}
+		event = &faults.events[next];
+		if (now < event->at_ms) {
+			usleep(TICK_MS * 1000);
+			continue;
+		}
+		event->applied_ms = now;
+		event->reconnected_ms = -1;
+		if (event->action != ACT_END) {
+			apply_event(&faults, event);
+			fprintf(stderr, "%.1fs: %s\n", now / 1000.0, event->text);
+		}
+		if (event->action == ACT_HEAL) {
+			pending = event;
+		}
+		__atomic_store_n(&faults.phase, ++next, __ATOMIC_RELEASE);
+	}
+	faults.end_ms = faults.events[faults.nevent - 1].applied_ms;
+
+	__atomic_store_n(&faults.stop, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < faults.threads; i++) {
+		pthread_join(threads[i].tid, NULL);
+	}
+
+	report(&faults, threads);
+	ret = 0;
+
+free_threads:
+	for (i = 0; i < faults.threads; i++) {
+		hist_destroy(threads[i].phases);
+	}
+	free(threads);
+
+destroy:
+	free(faults.slot_ops);
+	free(faults.slot_errors);
+	dynoc_destroy(&faults.dynoc);
+out:
+	mock_destroy(faults.mock);
+	return ret;
+}
@@ -0,0 +1,124 @@
+/*
+ * Dynoc is a minimalistic C client library for the dynomite.
+ * Copyright (C) 2016-2017 huya.com, Lampman Yao
+ */
+
+/*
+ * Dynomite - A thin, distributed replication layer for multi non-distributed storages.
+ * Copyright (C) 2014 Netflix, Inc.
+ */
+
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "topology.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+static void
+usage(void) {
+	fprintf(stderr,
+		"usage: dynoc-load [options] -n node [-n node ..] file\n"
+		"  -f tsv|hash|resp         input format (default tsv)\n"
+		"  -r rack                  rack to write to (default the first)\n"
+		"  -t threads               worker threads (default 4)\n"
+		"  -w window                commands in flight per node and thread (default 256)\n");
+	topology_usage();
+	exit(1);
+}
+
+int
+main(int argc, char **argv) {
+	struct topology topo;
+	struct load_options opts;
+	struct load_stats stats;
+	struct dynoc dynoc;
+	struct timeval start, end;
+	struct stat st;
+	load_format_t format = LOAD_TSV;
+	double secs;
+	int c, ret;
+
+	memset(&topo, 0, sizeof(topo));
+	memset(&opts, 0, sizeof(opts));
+
+	while ((c = getopt(argc, argv, "n:a:H:f:r:t:w:")) != -1) {
+		switch (c) {
+		case 'n':
+			if (topology_add(&topo, optarg) < 0) {
+				usage();
+			}
+			break;
+		case 'a':
+			topo.pass = optarg;
+			break;
+		case 'H':
+			topo.hash = optarg;
+			break;
+		case 'f':
+			if (strcmp(optarg, "tsv") == 0) {
+				format = LOAD_TSV;
+			} else if (strcmp(optarg, "hash") == 0) {
+				format = LOAD_TSV_HASH;
+			} else if (strcmp(optarg, "resp") == 0) {
+				format = LOAD_RESP;
+			} else {
+				usage();
+			}
+			break;
+		case 'r':
+			opts.rack = optarg;
+			break;
+		case 't':
+			opts.threads = atoi(optarg);
+			break;
+		case 'w':
+			opts.window = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1 || stat(argv[optind], &st) < 0) {
+		usage();
+	}
+
+	dynoc_init(&dynoc);
+	if (topology_connect(&topo, &dynoc) < 0) {
+		return 1;
+	}
+
+	gettimeofday(&start, NULL);
+	ret = dynoc_load(&dynoc, argv[optind], format, &opts, &stats);
+	gettimeofday(&end, NULL);
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+
+	printf("records %llu loaded %llu failed %llu malformed %llu\n",
+		(unsigned long long)stats.records, (unsigned long long)stats.loaded,
+		(unsigned long long)stats.failed, (unsigned long long)stats.malformed);
+	printf("%.2f s, %.0f records/s, %.1f MB/s\n", secs,
+		secs > 0 ? stats.records / secs : 0, secs > 0 ? st.st_size / secs / 1e6 : 0);
+
+	dynoc_destroy(&dynoc);
+	free(topo.nodes);
+	return ret < 0 ? 1 : 0;
+}
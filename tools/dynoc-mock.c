@@ -0,0 +1,191 @@
+/*
+ * Dynoc is a minimalistic C client library for the dynomite.
+ * Copyright (C) 2016-2017 huya.com, Lampman Yao
+ */
+
+/*
+ * Dynomite - A thin, distributed replication layer for multi non-distributed storages.
+ * Copyright (C) 2014 Netflix, Inc.
+ */
+
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mock.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static volatile sig_atomic_t stopped;
+
+static void
+on_signal(int sig) {
+	stopped = 1;
+}
+
+static void
+usage(void) {
+	fprintf(stderr,
+		"usage: dynoc-mock [options] -l port[:rack[:token]] [-l ..]\n"
+		"  -l port[:rack[:token]]   serve a node on 127.0.0.1:port (default rack\n"
+		"                           \"rack\", tokens spread over the ring)\n"
+		"  -a pass                  require AUTH pass\n"
+		"  -L ms                    reply latency\n"
+		"  -J ms                    reply jitter, added uniformly on top of -L\n"
+		"  -x rate                  chance a command drops its connection\n"
+		"  -e rate                  chance a command gets an error reply\n"
+		"  -s secs                  print per-node stats every secs\n"
+		"faults apply to every node. Stops on SIGINT/SIGTERM.\n");
+	exit(1);
+}
+
+struct node_spec {
+	int port;
+	char rack[64];
+	char token[16];
+};
+
+int
+main(int argc, char **argv) {
+	struct node_spec specs[64];
+	struct mock_faults faults;
+	struct mock_stats stats;
+	struct mock *mock;
+	const char *pass = NULL;
+	char *p;
+	int nspec = 0, interval = 0, c, i, n;
+
+	memset(&faults, 0, sizeof(faults));
+	while ((c = getopt(argc, argv, "l:a:L:J:x:e:s:")) != -1) {
+		switch (c) {
+		case 'l':
+			if (nspec == 64) {
+				usage();
+			}
+			memset(&specs[nspec], 0, sizeof(specs[nspec]));
+			specs[nspec].port = atoi(optarg);
+			strcpy(specs[nspec].rack, "rack");
+			if ((p = strchr(optarg, ':'))) {
+				n = strcspn(p + 1, ":");
+				if (n == 0 || n >= (int)sizeof(specs[nspec].rack)) {
+					usage();
+				}
+				memcpy(specs[nspec].rack, p + 1, n);
+				specs[nspec].rack[n] = '\0';
+				if ((p = strchr(p + 1, ':'))) {
+					snprintf(specs[nspec].token, sizeof(specs[nspec].token), "%s", p + 1);
+				}
+			}
+			if (specs[nspec].port <= 0 || specs[nspec].port > 65535) {
+				usage();
+			}
+			nspec++;
+			break;
+		case 'a':
+			pass = optarg;
+			break;
+		case 'L':
+			faults.latency_ms = atoi(optarg);
+			break;
+		case 'J':
+			faults.jitter_ms = atoi(optarg);
+			break;
+		case 'x':
+			faults.drop_rate = atof(optarg);
+			break;
+		case 'e':
+			faults.error_rate = atof(optarg);
+			break;
+		case 's':
+			interval = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (nspec == 0 || optind != argc) {
+		usage();
+	}
+
+	/* Nodes without a token split the ring evenly within their rack. */
+	for (i = 0; i < nspec; i++) {
+		int nrack = 0, nth = 0, j;
+
+		if (specs[i].token[0]) {
+			continue;
+		}
+		for (j = 0; j < nspec; j++) {
+			if (strcmp(specs[j].rack, specs[i].rack) == 0) {
+				if (j < i) {
+					nth++;
+				}
+				nrack++;
+			}
+		}
+		snprintf(specs[i].token, sizeof(specs[i].token), "%u",
+			(unsigned)(((uint64_t)1 << 32) / nrack * nth));
+	}
+
+	mock = mock_create(pass);
+	if (!mock) {
+		fprintf(stderr, "dynoc-mock: out of memory\n");
+		return 1;
+	}
+	for (i = 0; i < nspec; i++) {
+		if (mock_add_node(mock, specs[i].port) < 0) {
+			fprintf(stderr, "dynoc-mock: cannot listen on port %d\n", specs[i].port);
+			mock_destroy(mock);
+			return 1;
+		}
+		mock_set_faults(mock, i, &faults);
+	}
+	if (mock_start(mock) < 0) {
+		fprintf(stderr, "dynoc-mock: cannot start the nodes\n");
+		mock_destroy(mock);
+		return 1;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	printf("nodes:");
+	for (i = 0; i < nspec; i++) {
+		printf(" -n 127.0.0.1:%d:%s:%s", specs[i].port, specs[i].rack, specs[i].token);
+	}
+	printf("\n");
+	fflush(stdout);
+
+	while (!stopped) {
+		sleep(interval ? interval : 1);
+		if (!interval || stopped) {
+			continue;
+		}
+		for (i = 0; i < nspec; i++) {
+			mock_get_stats(mock, i, &stats);
+			printf("%d: connections %llu commands %llu errors %llu drops %llu\n", specs[i].port,
+				(unsigned long long)stats.connections, (unsigned long long)stats.commands,
+				(unsigned long long)stats.errors, (unsigned long long)stats.drops);
+		}
+		fflush(stdout);
+	}
+
+	mock_destroy(mock);
+	return 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * Dynoc is a minimalistic C client library for the dynomite.
+ * Copyright (C) 2016-2017 huya.com, Lampman Yao
+ */
+
+/*
+ * Dynomite - A thin, distributed replication layer for multi non-distributed storages.
+ * Copyright (C) 2014 Netflix, Inc.
+ */
+
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "hist.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#define HIST_MAX_SHIFT 40
+
+struct hist *
+hist_create(int n, int sub_bits) {
+	struct hist *hists;
+	uint64_t *counts;
+	int size = (1 << sub_bits) + HIST_MAX_SHIFT * (1 << (sub_bits - 1)), i;
+
+	hists = calloc(n, sizeof(*hists));
+	counts = calloc((size_t)n * size, sizeof(*counts));
+	if (!hists || !counts) {
+		free(hists);
+		free(counts);
+		return NULL;
+	}
+
+	for (i = 0; i < n; i++) {
+		hists[i].sub_bits = sub_bits;
+		hists[i].size = size;
+		hists[i].counts = counts + (size_t)i * size;
+	}
+	return hists;
+}
+
+void
+hist_destroy(struct hist *hists) {
+	if (hists) {
+		free(hists[0].counts);
+		free(hists);
+	}
+}
+
+static int
+hist_index(const struct hist *hist, uint64_t v) {
+	int half = 1 << (hist->sub_bits - 1), shift;
+
+	if (v < (uint64_t)1 << hist->sub_bits) {
+		return v;
+	}
+	shift = 64 - __builtin_clzll(v) - hist->sub_bits;
+	if (shift > HIST_MAX_SHIFT) {
+		return hist->size - 1;
+	}
+	return shift * half + (v >> shift);
+}
+
+/* Highest value that lands in bucket `index`. */
+static uint64_t
+hist_value(const struct hist *hist, int index) {
+	int half = 1 << (hist->sub_bits - 1), shift;
+
+	if (index < 1 << hist->sub_bits) {
+		return index;
+	}
+	shift = index / half - 1;
+	return (((uint64_t)(index - shift * half) + 1) << shift) - 1;
+}
+
+void
+hist_record(struct hist *hist, uint64_t value) {
+	hist->counts[hist_index(hist, value)]++;
+	hist->total++;
+	if (value > hist->max) {
+		hist->max = value;
+	}
+}
+
+/* Both must have the same precision. */
+void
+hist_merge(struct hist *to, const struct hist *from) {
+	int i;
+
+	for (i = 0; i < to->size; i++) {
+		to->counts[i] += from->counts[i];
+	}
+	to->total += from->total;
+	to->errors += from->errors;
+	if (from->max > to->max) {
+		to->max = from->max;
+	}
+}
+
+uint64_t
+hist_percentile(const struct hist *hist, double p) {
+	uint64_t want = (uint64_t)ceil(hist->total * p / 100.0), seen = 0;
+	int i;
+
+	for (i = 0; i < hist->size; i++) {
+		seen += hist->counts[i];
+		if (seen >= want && seen) {
+			return hist_value(hist, i) < hist->max ? hist_value(hist, i) : hist->max;
+		}
+	}
+	return hist->max;
+}
@@ -0,0 +1,53 @@
+/*
+ * Dynoc is a minimalistic C client library for the dynomite.
+ * Copyright (C) 2016-2017 huya.com, Lampman Yao
+ */
+
+/*
+ * Dynomite - A thin, distributed replication layer for multi non-distributed storages.
+ * Copyright (C) 2014 Netflix, Inc.
+ */
+
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Latency histograms shared by the tools. Values go to log-linear buckets
+ * as in HdrHistogram: the first 2^sub_bits values get a bucket each, every
+ * power of two above them is split into 2^(sub_bits - 1) buckets, so the
+ * error stays under 2^(1 - sub_bits) of the value.
+ */
+struct hist {
+	int sub_bits;
+	int size;
+	uint64_t *counts;
+	uint64_t total;
+	uint64_t max;
+	uint64_t errors;
+};
+
+/* `n` empty histograms of the same precision, NULL if out of memory. */
+struct hist *hist_create(int n, int sub_bits);
+void hist_destroy(struct hist *hists);
+
+void hist_record(struct hist *hist, uint64_t value);
+void hist_merge(struct hist *to, const struct hist *from);
+uint64_t hist_percentile(const struct hist *hist, double p);
@@ -0,0 +1,1209 @@
+/*
+ * Dynoc is a minimalistic C client library for the dynomite.
+ * Copyright (C) 2016-2017 huya.com, Lampman Yao
+ */
+
+/*
+ * Dynomite - A thin, distributed replication layer for multi non-distributed storages.
+ * Copyright (C) 2014 Netflix, Inc.
+ */
+
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mock.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MOCK_NODES   64
+#define MOCK_EVENTS  64
+#define MOCK_READ    (64 * 1024)
+#define MOCK_BUCKETS 4096
+
+enum { ENTRY_STRING, ENTRY_HASH };
+
+struct field {
+	char *name;
+	size_t nlen;
+	char *val;
+	size_t vlen;
+	struct field *next;
+};
+
+struct entry {
+	char *key;
+	size_t klen;
+	int type;
+	char *val;
+	size_t vlen;
+	struct field *fields;
+	int64_t expire;
+	struct entry *next;
+};
+
+struct store {
+	pthread_mutex_t lock;
+	struct entry **buckets;
+	size_t nbucket;
+	size_t count;
+};
+
+struct buf {
+	char *data;
+	size_t len;
+	size_t cap;
+};
+
+/* A reply held back by injected latency. */
+struct delayed {
+	int64_t due;
+	struct buf reply;
+	struct delayed *next;
+};
+
+struct client {
+	int fd;
+	int authed;
+	struct buf in;
+	struct buf out;
+	struct delayed *head;
+	struct delayed *tail;
+	struct client *prev;
+	struct client *next;
+};
+
+struct mock_node {
+	struct mock *mock;
+	int port;
+	int lfd;
+	int epfd;
+	int evfd;
+	int listening;
+	pthread_t tid;
+	int started;
+	pthread_mutex_t lock;
+	struct mock_faults faults;
+	struct mock_stats stats;
+	struct client *clients;
+	uint64_t rand;
+};
+
+struct mock {
+	char *pass;
+	struct store store;
+	struct mock_node nodes[MOCK_NODES];
+	int nnode;
+	int stop;
+};
+
+static int64_t
+mock_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static double
+node_random(struct mock_node *node) {
+	node->rand ^= node->rand >> 12;
+	node->rand ^= node->rand << 25;
+	node->rand ^= node->rand >> 27;
+	return ((node->rand * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void
+buf_append(struct buf *buf, const char *data, size_t len) {
+	if (buf->len + len > buf->cap) {
+		size_t cap = buf->cap ? buf->cap : 256;
+		while (cap < buf->len + len) {
+			cap *= 2;
+		}
+		buf->data = realloc(buf->data, cap);
+		if (!buf->data) {
+			abort();
+		}
+		buf->cap = cap;
+	}
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+}
+
+static void
+buf_printf(struct buf *buf, const char *format, ...) {
+	char tmp[128];
+	va_list ap;
+	int n;
+
+	va_start(ap, format);
+	n = vsnprintf(tmp, sizeof(tmp), format, ap);
+	va_end(ap);
+	buf_append(buf, tmp, n);
+}
+
+static void
+buf_consume(struct buf *buf, size_t len) {
+	memmove(buf->data, buf->data + len, buf->len - len);
+	buf->len -= len;
+}
+
+static void
+reply_bulk(struct buf *out, const char *data, size_t len) {
+	if (!data) {
+		buf_append(out, "$-1\r\n", 5);
+		return;
+	}
+	buf_printf(out, "$%zu\r\n", len);
+	buf_append(out, data, len);
+	buf_append(out, "\r\n", 2);
+}
+
+/*
+ * Store
+ */
+
+static uint32_t
+store_hash(const char *key, size_t len) {
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h = (h ^ (unsigned char)key[i]) * 16777619u;
+	}
+	return h;
+}
+
+static char *
+dup_bytes(const char *data, size_t len) {
+	char *copy = malloc(len + 1);
+
+	if (!copy) {
+		abort();
+	}
+	memcpy(copy, data, len);
+	copy[len] = '\0';
+	return copy;
+}
+
+static void
+entry_free(struct entry *entry) {
+	while (entry->fields) {
+		struct field *field = entry->fields;
+		entry->fields = field->next;
+		free(field->name);
+		free(field->val);
+		free(field);
+	}
+	free(entry->key);
+	free(entry->val);
+	free(entry);
+}
+
+static void
+store_grow(struct store *store) {
+	struct entry **buckets, *entry;
+	size_t nbucket = store->nbucket * 2, i;
+
+	buckets = calloc(nbucket, sizeof(*buckets));
+	if (!buckets) {
+		return;
+	}
+	for (i = 0; i < store->nbucket; i++) {
+		while ((entry = store->buckets[i])) {
+			size_t b = store_hash(entry->key, entry->klen) & (nbucket - 1);
+			store->buckets[i] = entry->next;
+			entry->next = buckets[b];
+			buckets[b] = entry;
+		}
+	}
+	free(store->buckets);
+	store->buckets = buckets;
+	store->nbucket = nbucket;
+}
+
+/* The live entry for `key`, expired ones are removed on the way. */
+static struct entry *
+store_find(struct store *store, const char *key, size_t len) {
+	struct entry **link = &store->buckets[store_hash(key, len) & (store->nbucket - 1)];
+	struct entry *entry;
+
+	while ((entry = *link)) {
+		if (entry->klen == len && memcmp(entry->key, key, len) == 0) {
+			if (entry->expire && entry->expire <= mock_now()) {
+				*link = entry->next;
+				entry_free(entry);
+				store->count--;
+				return NULL;
+			}
+			return entry;
+		}
+		link = &entry->next;
+	}
+	return NULL;
+}
+
+static struct entry *
+store_add(struct store *store, const char *key, size_t len, int type) {
+	struct entry *entry = calloc(1, sizeof(*entry));
+	size_t b;
+
+	if (!entry) {
+		abort();
+	}
+	if (store->count >= store->nbucket) {
+		store_grow(store);
+	}
+	entry->key = dup_bytes(key, len);
+	entry->klen = len;
+	entry->type = type;
+	b = store_hash(key, len) & (store->nbucket - 1);
+	entry->next = store->buckets[b];
+	store->buckets[b] = entry;
+	store->count++;
+	return entry;
+}
+
+static int
+store_del(struct store *store, const char *key, size_t len) {
+	struct entry **link = &store->buckets[store_hash(key, len) & (store->nbucket - 1)];
+	struct entry *entry;
+
+	if (!store_find(store, key, len)) {
+		return 0;
+	}
+	while ((entry = *link)) {
+		if (entry->klen == len && memcmp(entry->key, key, len) == 0) {
+			*link = entry->next;
+			entry_free(entry);
+			store->count--;
+			return 1;
+		}
+		link = &entry->next;
+	}
+	return 0;
+}
+
+static void
+store_flush(struct store *store) {
+	struct entry *entry;
+	size_t i;
+
+	for (i = 0; i < store->nbucket; i++) {
+		while ((entry = store->buckets[i])) {
+			store->buckets[i] = entry->next;
+			entry_free(entry);
+		}
+	}
+	store->count = 0;
+}
+
+/*
+ * Commands
+ */
+
+struct command {
+	int argc;
+	const char **argv;
+	size_t *lens;
+};
+
+static int
+arg_is(const struct command *cmd, int i, const char *name) {
+	return strlen(name) == cmd->lens[i] && strncasecmp(cmd->argv[i], name, cmd->lens[i]) == 0;
+}
+
+static int
+arg_int(const struct command *cmd, int i, long long *value) {
+	char tmp[32], *end;
+
+	if (cmd->lens[i] == 0 || cmd->lens[i] >= sizeof(tmp)) {
+		return -1;
+	}
+	memcpy(tmp, cmd->argv[i], cmd->lens[i]);
+	tmp[cmd->lens[i]] = '\0';
+	errno = 0;
+	*value = strtoll(tmp, &end, 10);
+	return *end || errno ? -1 : 0;
+}
+
+static void
+set_string(struct store *store, const char *key, size_t klen, const char *val, size_t vlen, int64_t expire) {
+	struct entry *entry;
+
+	store_del(store, key, klen);
+	entry = store_add(store, key, klen, ENTRY_STRING);
+	entry->val = dup_bytes(val, vlen);
+	entry->vlen = vlen;
+	entry->expire = expire;
+}
+
+static void
+cmd_set(struct store *store, const struct command *cmd, struct buf *out) {
+	int64_t expire = 0;
+	long long n;
+	int nx = 0, xx = 0, i;
+	struct entry *entry;
+
+	for (i = 3; i < cmd->argc; i++) {
+		if (arg_is(cmd, i, "NX")) {
+			nx = 1;
+		} else if (arg_is(cmd, i, "XX")) {
+			xx = 1;
+		} else if ((arg_is(cmd, i, "EX") || arg_is(cmd, i, "PX")) && i + 1 < cmd->argc &&
+		           arg_int(cmd, i + 1, &n) == 0 && n > 0) {
+			expire = mock_now() + (arg_is(cmd, i, "EX") ? n * 1000 : n);
+			i++;
+		} else {
+			buf_printf(out, "-ERR syntax error\r\n");
+			return;
+		}
+	}
+
+	entry = store_find(store, cmd->argv[1], cmd->lens[1]);
+	if ((nx && entry) || (xx && !entry)) {
+		buf_append(out, "$-1\r\n", 5);
+		return;
+	}
+	set_string(store, cmd->argv[1], cmd->lens[1], cmd->argv[2], cmd->lens[2], expire);
+	buf_append(out, "+OK\r\n", 5);
+}
+
+static void
+cmd_setex(struct store *store, const struct command *cmd, struct buf *out, int ms) {
+	long long n;
+
+	if (arg_int(cmd, 2, &n) < 0 || n <= 0) {
+		buf_printf(out, "-ERR invalid expire time\r\n");
+		return;
+	}
+	set_string(store, cmd->argv[1], cmd->lens[1], cmd->argv[3], cmd->lens[3], mock_now() + (ms ? n : n * 1000));
+	buf_append(out, "+OK\r\n", 5);
+}
+
+static void
+cmd_incr(struct store *store, const struct command *cmd, struct buf *out, long long delta) {
+	struct entry *entry = store_find(store, cmd->argv[1], cmd->lens[1]);
+	char num[32], *end;
+	long long value = 0;
+
+	if (entry && entry->type != ENTRY_STRING) {
+		buf_printf(out, "-WRONGTYPE Operation against a key holding the wrong kind of value\r\n");
+		return;
+	}
+	if (entry) {
+		errno = 0;
+		value = strtoll(entry->val, &end, 10);
+		if (!entry->vlen || *end || errno) {
+			buf_printf(out, "-ERR value is not an integer or out of range\r\n");
+			return;
+		}
+	}
+	value += delta;
+	snprintf(num, sizeof(num), "%lld", value);
+	if (entry) {
+		free(entry->val);
+		entry->val = dup_bytes(num, strlen(num));
+		entry->vlen = strlen(num);
+	} else {
+		set_string(store, cmd->argv[1], cmd->lens[1], num, strlen(num), 0);
+	}
+	buf_printf(out, ":%lld\r\n", value);
+}
+
+static void
+cmd_hset(struct store *store, const struct command *cmd, struct buf *out) {
+	struct entry *entry = store_find(store, cmd->argv[1], cmd->lens[1]);
+	struct field *field;
+	int added = 0, i;
+
+	if ((cmd->argc - 2) % 2) {
+		buf_printf(out, "-ERR wrong number of arguments for 'hset' command\r\n");
+		return;
+	}
+	if (entry && entry->type != ENTRY_HASH) {
+		buf_printf(out, "-WRONGTYPE Operation against a key holding the wrong kind of value\r\n");
+		return;
+	}
+	if (!entry) {
+		entry = store_add(store, cmd->argv[1], cmd->lens[1], ENTRY_HASH);
+	}
+
+	for (i = 2; i < cmd->argc; i += 2) {
+		for (field = entry->fields; field; field = field->next) {
+			if (field->nlen == cmd->lens[i] && memcmp(field->name, cmd->argv[i], field->nlen) == 0) {
+				break;
+			}
+		}
+		if (!field) {
+			field = calloc(1, sizeof(*field));
+			if (!field) {
+				abort();
+			}
+			field->name = dup_bytes(cmd->argv[i], cmd->lens[i]);
+			field->nlen = cmd->lens[i];
+			field->next = entry->fields;
+			entry->fields = field;
+			added++;
+		}
+		free(field->val);
+		field->val = dup_bytes(cmd->argv[i + 1], cmd->lens[i + 1]);
+		field->vlen = cmd->lens[i + 1];
+	}
+	buf_printf(out, ":%d\r\n", added);
+}
+
+static void
+cmd_hget(struct store *store, const struct command *cmd, struct buf *out) {
+	struct entry *entry = store_find(store, cmd->argv[1], cmd->lens[1]);
+	struct field *field;
+
+	if (entry && entry->type != ENTRY_HASH) {
+		buf_printf(out, "-WRONGTYPE Operation against a key holding the wrong kind of value\r\n");
+		return;
+	}
+	for (field = entry ? entry->fields : NULL; field; field = field->next) {
+		if (field->nlen == cmd->lens[2] && memcmp(field->name, cmd->argv[2], field->nlen) == 0) {
+			reply_bulk(out, field->val, field->vlen);
+			return;
+		}
+	}
+	reply_bulk(out, NULL, 0);
+}
+
+/* The cursor is a bucket index; keys moved by a resize may be seen twice or missed. */
+static void
+cmd_scan(struct store *store, const struct command *cmd, struct buf *out) {
+	struct buf keys = { NULL, 0, 0 };
+	struct entry *entry;
+	char pattern[256] = "", next[32];
+	long long cursor, count = 10, n;
+	size_t bucket, nkey = 0;
+	int i;
+
+	if (arg_int(cmd, 1, &cursor) < 0 || cursor < 0) {
+		buf_printf(out, "-ERR invalid cursor\r\n");
+		return;
+	}
+	for (i = 2; i + 1 < cmd->argc; i += 2) {
+		if (arg_is(cmd, i, "COUNT") && arg_int(cmd, i + 1, &n) == 0 && n > 0) {
+			count = n;
+		} else if (arg_is(cmd, i, "MATCH") && cmd->lens[i + 1] < sizeof(pattern)) {
+			memcpy(pattern, cmd->argv[i + 1], cmd->lens[i + 1]);
+			pattern[cmd->lens[i + 1]] = '\0';
+		} else {
+			buf_printf(out, "-ERR syntax error\r\n");
+			return;
+		}
+	}
+
+	for (bucket = cursor; bucket < store->nbucket && count > 0; bucket++, count--) {
+		for (entry = store->buckets[bucket]; entry; entry = entry->next) {
+			if (entry->expire && entry->expire <= mock_now()) {
+				continue;
+			}
+			if (pattern[0] && fnmatch(pattern, entry->key, 0) != 0) {
+				continue;
+			}
+			reply_bulk(&keys, entry->key, entry->klen);
+			nkey++;
+		}
+	}
+
+	snprintf(next, sizeof(next), "%zu", bucket < store->nbucket ? bucket : 0);
+	buf_printf(out, "*2\r\n");
+	reply_bulk(out, next, strlen(next));
+	buf_printf(out, "*%zu\r\n", nkey);
+	if (keys.len) {
+		buf_append(out, keys.data, keys.len);
+	}
+	free(keys.data);
+}
+
+static void
+cmd_ttl(struct store *store, const struct command *cmd, struct buf *out) {
+	struct entry *entry = store_find(store, cmd->argv[1], cmd->lens[1]);
+
+	if (!entry) {
+		buf_append(out, ":-2\r\n", 5);
+	} else if (!entry->expire) {
+		buf_append(out, ":-1\r\n", 5);
+	} else {
+		buf_printf(out, ":%lld\r\n", (long long)(entry->expire - mock_now()));
+	}
+}
+
+static void
+cmd_expire(struct store *store, const struct command *cmd, struct buf *out, int persist) {
+	struct entry *entry = store_find(store, cmd->argv[1], cmd->lens[1]);
+	long long n = 0;
+
+	if (!persist && (arg_int(cmd, 2, &n) < 0)) {
+		buf_printf(out, "-ERR value is not an integer or out of range\r\n");
+		return;
+	}
+	if (!entry || (persist && !entry->expire)) {
+		buf_append(out, ":0\r\n", 4);
+		return;
+	}
+	if (persist) {
+		entry->expire = 0;
+	} else if (n <= 0) {
+		store_del(store, cmd->argv[1], cmd->lens[1]);
+	} else {
+		entry->expire = mock_now() + n * 1000;
+	}
+	buf_append(out, ":1\r\n", 4);
+}
+
+struct command_def {
+	const char *name;
+	int arity;              /* negative: at least -arity */
+};
+
+static const struct command_def commands[] = {
+	{ "GET", 2 }, { "SET", -3 }, { "SETEX", 4 }, { "PSETEX", 4 }, { "DEL", -2 },
+	{ "UNLINK", -2 }, { "HSET", -4 }, { "HGET", 3 }, { "INCR", 2 }, { "INCRBY", 3 },
+	{ "DECR", 2 }, { "DECRBY", 3 }, { "EXPIRE", 3 }, { "PERSIST", 2 }, { "PTTL", 2 },
+	{ "SCAN", -2 }, { "DBSIZE", 1 }, { "FLUSHALL", 1 }, { NULL, 0 }
+};
+
+static void
+execute(struct mock *mock, struct client *client, const struct command *cmd, struct buf *out) {
+	const struct command_def *def;
+	struct store *store = &mock->store;
+	struct entry *entry;
+	long long n;
+	int i, count;
+
+	if (arg_is(cmd, 0, "PING")) {
+		buf_append(out, "+PONG\r\n", 7);
+		return;
+	}
+	if (mock->pass && !client->authed) {
+		buf_printf(out, "-NOAUTH Authentication required.\r\n");
+		return;
+	}
+
+	for (def = commands; def->name && !arg_is(cmd, 0, def->name); def++);
+	if (!def->name) {
+		buf_printf(out, "-ERR unknown command '%.*s'\r\n", (int)(cmd->lens[0] < 32 ? cmd->lens[0] : 32), cmd->argv[0]);
+		return;
+	}
+	if ((def->arity > 0 && cmd->argc != def->arity) || (def->arity < 0 && cmd->argc < -def->arity)) {
+		buf_printf(out, "-ERR wrong number of arguments for '%s' command\r\n", def->name);
+		return;
+	}
+
+	pthread_mutex_lock(&store->lock);
+	if (arg_is(cmd, 0, "GET")) {
+		entry = store_find(store, cmd->argv[1], cmd->lens[1]);
+		if (entry && entry->type != ENTRY_STRING) {
+			buf_printf(out, "-WRONGTYPE Operation against a key holding the wrong kind of value\r\n");
+		} else {
+			reply_bulk(out, entry ? entry->val : NULL, entry ? entry->vlen : 0);
+		}
+	} else if (arg_is(cmd, 0, "SET")) {
+		cmd_set(store, cmd, out);
+	} else if (arg_is(cmd, 0, "SETEX") || arg_is(cmd, 0, "PSETEX")) {
+		cmd_setex(store, cmd, out, arg_is(cmd, 0, "PSETEX"));
+	} else if (arg_is(cmd, 0, "DEL") || arg_is(cmd, 0, "UNLINK")) {
+		for (i = 1, count = 0; i < cmd->argc; i++) {
+			count += store_del(store, cmd->argv[i], cmd->lens[i]);
+		}
+		buf_printf(out, ":%d\r\n", count);
+	} else if (arg_is(cmd, 0, "HSET")) {
+		cmd_hset(store, cmd, out);
+	} else if (arg_is(cmd, 0, "HGET")) {
+		cmd_hget(store, cmd, out);
+	} else if (arg_is(cmd, 0, "INCR") || arg_is(cmd, 0, "DECR")) {
+		cmd_incr(store, cmd, out, arg_is(cmd, 0, "INCR") ? 1 : -1);
+	} else if (arg_is(cmd, 0, "INCRBY") || arg_is(cmd, 0, "DECRBY")) {
+		if (arg_int(cmd, 2, &n) < 0) {
+			buf_printf(out, "-ERR value is not an integer or out of range\r\n");
+		} else {
+			cmd_incr(store, cmd, out, arg_is(cmd, 0, "INCRBY") ? n : -n);
+		}
+	} else if (arg_is(cmd, 0, "EXPIRE") || arg_is(cmd, 0, "PERSIST")) {
+		cmd_expire(store, cmd, out, arg_is(cmd, 0, "PERSIST"));
+	} else if (arg_is(cmd, 0, "PTTL")) {
+		cmd_ttl(store, cmd, out);
+	} else if (arg_is(cmd, 0, "SCAN")) {
+		cmd_scan(store, cmd, out);
+	} else if (arg_is(cmd, 0, "DBSIZE")) {
+		buf_printf(out, ":%zu\r\n", store->count);
+	} else if (arg_is(cmd, 0, "FLUSHALL")) {
+		store_flush(store);
+		buf_append(out, "+OK\r\n", 5);
+	}
+	pthread_mutex_unlock(&store->lock);
+}
+
+/*
+ * Parse one command, RESP array or inline, from the start of `in`.
+ * Returns its length, 0 if incomplete and -1 on a protocol error.
+ */
+static long
+parse_command(const struct buf *in, struct command *cmd) {
+	const char *p = in->data, *end = in->data + in->len, *eol;
+	long argc, len, i;
+
+	if (p == end) {
+		return 0;
+	}
+
+	if (*p != '*') {
+		/* Inline command, for people typing at the port. */
+		eol = memchr(p, '\n', end - p);
+		if (!eol) {
+			return 0;
+		}
+		cmd->argc = 0;
+		cmd->argv = malloc(16 * sizeof(*cmd->argv));
+		cmd->lens = malloc(16 * sizeof(*cmd->lens));
+		while (p < eol && cmd->argc < 16) {
+			while (p < eol && (*p == ' ' || *p == '\r')) {
+				p++;
+			}
+			if (p == eol) {
+				break;
+			}
+			cmd->argv[cmd->argc] = p;
+			while (p < eol && *p != ' ' && *p != '\r') {
+				p++;
+			}
+			cmd->lens[cmd->argc] = p - cmd->argv[cmd->argc];
+			cmd->argc++;
+		}
+		return eol + 1 - in->data;
+	}
+
+	eol = memchr(p, '\n', end - p);
+	if (!eol) {
+		return 0;
+	}
+	argc = strtol(p + 1, NULL, 10);
+	if (argc < 1 || argc > 1024 * 1024) {
+		return -1;
+	}
+	p = eol + 1;
+
+	cmd->argc = argc;
+	cmd->argv = malloc(argc * sizeof(*cmd->argv));
+	cmd->lens = malloc(argc * sizeof(*cmd->lens));
+	for (i = 0; i < argc; i++) {
+		if (p >= end) {
+			goto incomplete;
+		}
+		if (*p != '$') {
+			free(cmd->argv);
+			free(cmd->lens);
+			return -1;
+		}
+		eol = memchr(p, '\n', end - p);
+		if (!eol) {
+			goto incomplete;
+		}
+		len = strtol(p + 1, NULL, 10);
+		if (len < 0 || len > 512L * 1024 * 1024) {
+			free(cmd->argv);
+			free(cmd->lens);
+			return -1;
+		}
+		p = eol + 1;
+		if (end - p < len + 2) {
+			goto incomplete;
+		}
+		cmd->argv[i] = p;
+		cmd->lens[i] = len;
+		p += len + 2;
+	}
+	return p - in->data;
+
+incomplete:
+	free(cmd->argv);
+	free(cmd->lens);
+	return 0;
+}
+
+/*
+ * Connections
+ */
+
+static void
+client_close(struct mock_node *node, struct client *client) {
+	struct delayed *delayed;
+
+	epoll_ctl(node->epfd, EPOLL_CTL_DEL, client->fd, NULL);
+	close(client->fd);
+	while ((delayed = client->head)) {
+		client->head = delayed->next;
+		free(delayed->reply.data);
+		free(delayed);
+	}
+	if (client->prev) {
+		client->prev->next = client->next;
+	} else {
+		node->clients = client->next;
+	}
+	if (client->next) {
+		client->next->prev = client->prev;
+	}
+	free(client->in.data);
+	free(client->out.data);
+	free(client);
+}
+
+/* Returns -1 if the connection broke and was closed. */
+static int
+client_flush(struct mock_node *node, struct client *client) {
+	struct epoll_event ev;
+	ssize_t n;
+
+	while (client->out.len) {
+		n = write(client->fd, client->out.data, client->out.len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN) {
+				break;
+			}
+			client_close(node, client);
+			return -1;
+		}
+		buf_consume(&client->out, n);
+	}
+
+	ev.events = EPOLLIN | (client->out.len ? EPOLLOUT : 0);
+	ev.data.ptr = client;
+	epoll_ctl(node->epfd, EPOLL_CTL_MOD, client->fd, &ev);
+	return 0;
+}
+
+/* Move the replies whose latency has passed to the output buffer. */
+static int64_t
+client_release(struct client *client, int64_t now) {
+	struct delayed *delayed;
+
+	while ((delayed = client->head) && delayed->due <= now) {
+		buf_append(&client->out, delayed->reply.data, delayed->reply.len);
+		client->head = delayed->next;
+		if (!client->head) {
+			client->tail = NULL;
+		}
+		free(delayed->reply.data);
+		free(delayed);
+	}
+	return client->head ? client->head->due : -1;
+}
+
+static int
+client_read(struct mock_node *node, struct client *client) {
+	struct mock_faults faults;
+	struct command cmd;
+	struct buf reply;
+	char data[MOCK_READ];
+	ssize_t n;
+	long len;
+	int64_t due;
+
+	n = read(client->fd, data, sizeof(data));
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+		client_close(node, client);
+		return -1;
+	}
+	if (n < 0) {
+		return 0;
+	}
+	buf_append(&client->in, data, n);
+
+	while ((len = parse_command(&client->in, &cmd)) != 0) {
+		if (len < 0) {
+			client_close(node, client);
+			return -1;
+		}
+
+		pthread_mutex_lock(&node->lock);
+		faults = node->faults;
+		node->stats.commands++;
+		pthread_mutex_unlock(&node->lock);
+
+		if (cmd.argc == 0 || faults.hang) {
+			free(cmd.argv);
+			free(cmd.lens);
+			buf_consume(&client->in, len);
+			continue;
+		}
+
+		if (faults.drop_rate > 0 && node_random(node) < faults.drop_rate) {
+			pthread_mutex_lock(&node->lock);
+			node->stats.drops++;
+			pthread_mutex_unlock(&node->lock);
+			free(cmd.argv);
+			free(cmd.lens);
+			client_close(node, client);
+			return -1;
+		}
+
+		memset(&reply, 0, sizeof(reply));
+		if (faults.error_rate > 0 && node_random(node) < faults.error_rate) {
+			buf_printf(&reply, "-ERR injected\r\n");
+			pthread_mutex_lock(&node->lock);
+			node->stats.errors++;
+			pthread_mutex_unlock(&node->lock);
+		} else if (arg_is(&cmd, 0, "AUTH")) {
+			if (cmd.argc == 2 && !faults.auth_fail &&
+			    (!node->mock->pass || (strlen(node->mock->pass) == cmd.lens[1] &&
+			     memcmp(node->mock->pass, cmd.argv[1], cmd.lens[1]) == 0))) {
+				client->authed = 1;
+				buf_append(&reply, "+OK\r\n", 5);
+			} else {
+				buf_printf(&reply, "-ERR invalid password\r\n");
+			}
+		} else {
+			execute(node->mock, client, &cmd, &reply);
+		}
+		free(cmd.argv);
+		free(cmd.lens);
+		buf_consume(&client->in, len);
+
+		if (faults.latency_ms || faults.jitter_ms) {
+			struct delayed *delayed = calloc(1, sizeof(*delayed));
+
+			if (!delayed) {
+				abort();
+			}
+			due = mock_now() + faults.latency_ms;
+			if (faults.jitter_ms) {
+				due += (int64_t)(node_random(node) * (faults.jitter_ms + 1));
+			}
+			/* A connection answers in order, whatever the jitter. */
+			if (client->tail && client->tail->due > due) {
+				due = client->tail->due;
+			}
+			delayed->due = due;
+			delayed->reply = reply;
+			if (client->tail) {
+				client->tail->next = delayed;
+			} else {
+				client->head = delayed;
+			}
+			client->tail = delayed;
+		} else {
+			buf_append(&client->out, reply.data, reply.len);
+			free(reply.data);
+		}
+	}
+
+	return client_flush(node, client);
+}
+
+static int
+node_listen(struct mock_node *node) {
+	struct sockaddr_in addr;
+	struct epoll_event ev;
+	int fd, on = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(node->port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 512) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	node->lfd = fd;
+	node->listening = 1;
+	if (node->epfd >= 0) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = &node->lfd;
+		epoll_ctl(node->epfd, EPOLL_CTL_ADD, fd, &ev);
+	}
+	return 0;
+}
+
+static void
+node_accept(struct mock_node *node) {
+	struct epoll_event ev;
+	struct client *client;
+	int fd, on = 1;
+
+	while ((fd = accept(node->lfd, NULL, NULL)) >= 0) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		client = calloc(1, sizeof(*client));
+		if (!client) {
+			close(fd);
+			continue;
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		client->fd = fd;
+		client->authed = !node->mock->pass;
+		client->next = node->clients;
+		if (node->clients) {
+			node->clients->prev = client;
+		}
+		node->clients = client;
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = client;
+		epoll_ctl(node->epfd, EPOLL_CTL_ADD, fd, &ev);
+
+		pthread_mutex_lock(&node->lock);
+		node->stats.connections++;
+		pthread_mutex_unlock(&node->lock);
+	}
+}
+
+/* Take a node down or bring it back, as its faults say. */
+static void
+node_apply(struct mock_node *node) {
+	int down;
+
+	pthread_mutex_lock(&node->lock);
+	down = node->faults.down;
+	pthread_mutex_unlock(&node->lock);
+
+	if (down && node->listening) {
+		epoll_ctl(node->epfd, EPOLL_CTL_DEL, node->lfd, NULL);
+		close(node->lfd);
+		node->lfd = -1;
+		node->listening = 0;
+		while (node->clients) {
+			client_close(node, node->clients);
+		}
+	} else if (!down && !node->listening) {
+		if (node_listen(node) < 0) {
+			fprintf(stderr, "mock: cannot listen on %d again\n", node->port);
+		}
+	}
+}
+
+static void *
+node_thread(void *arg) {
+	struct mock_node *node = arg;
+	struct epoll_event events[MOCK_EVENTS];
+	struct client *client, *next;
+	int64_t now, due, next_due;
+	uint64_t wake;
+	int n, i, timeout = -1;
+
+	/* Faults set before mock_start. */
+	node_apply(node);
+
+	while (!__atomic_load_n(&node->mock->stop, __ATOMIC_ACQUIRE)) {
+		n = epoll_wait(node->epfd, events, MOCK_EVENTS, timeout);
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == &node->lfd) {
+				node_accept(node);
+			} else if (events[i].data.ptr == &node->evfd) {
+				if (read(node->evfd, &wake, sizeof(wake)) < 0) {
+					continue;
+				}
+				node_apply(node);
+				/* Connections may be gone, skip the rest of this batch. */
+				break;
+			} else {
+				client = events[i].data.ptr;
+				if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+					if (client_read(node, client) < 0) {
+						/* Later events of this batch may point to it. */
+						break;
+					}
+				} else if (events[i].events & EPOLLOUT) {
+					client_flush(node, client);
+				}
+			}
+		}
+
+		now = mock_now();
+		next_due = -1;
+		for (client = node->clients; client; client = next) {
+			next = client->next;
+			if (!client->head) {
+				continue;
+			}
+			due = client_release(client, now);
+			if (client->out.len && client_flush(node, client) < 0) {
+				continue;
+			}
+			if (due >= 0 && (next_due < 0 || due < next_due)) {
+				next_due = due;
+			}
+		}
+		timeout = next_due < 0 ? -1 : (int)(next_due - now);
+	}
+	return NULL;
+}
+
+struct mock *
+mock_create(const char *pass) {
+	struct mock *mock = calloc(1, sizeof(*mock));
+
+	if (!mock) {
+		return NULL;
+	}
+	mock->pass = pass ? strdup(pass) : NULL;
+	mock->store.nbucket = MOCK_BUCKETS;
+	mock->store.buckets = calloc(MOCK_BUCKETS, sizeof(*mock->store.buckets));
+	if (!mock->store.buckets) {
+		free(mock);
+		return NULL;
+	}
+	pthread_mutex_init(&mock->store.lock, NULL);
+	return mock;
+}
+
+int
+mock_add_node(struct mock *mock, int port) {
+	struct mock_node *node;
+
+	if (mock->nnode == MOCK_NODES) {
+		return -1;
+	}
+	node = &mock->nodes[mock->nnode];
+	memset(node, 0, sizeof(*node));
+	node->mock = mock;
+	node->port = port;
+	node->epfd = -1;
+	node->evfd = -1;
+	node->rand = 0x9e3779b97f4a7c15ULL * (port + 1);
+	if (node_listen(node) < 0) {
+		return -1;
+	}
+	pthread_mutex_init(&node->lock, NULL);
+	return mock->nnode++;
+}
+
+int
+mock_start(struct mock *mock) {
+	struct epoll_event ev;
+	struct mock_node *node;
+	int i;
+
+	for (i = 0; i < mock->nnode; i++) {
+		node = &mock->nodes[i];
+		node->epfd = epoll_create1(EPOLL_CLOEXEC);
+		node->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (node->epfd < 0 || node->evfd < 0) {
+			return -1;
+		}
+		ev.events = EPOLLIN;
+		ev.data.ptr = &node->lfd;
+		epoll_ctl(node->epfd, EPOLL_CTL_ADD, node->lfd, &ev);
+		ev.data.ptr = &node->evfd;
+		epoll_ctl(node->epfd, EPOLL_CTL_ADD, node->evfd, &ev);
+
+		if (pthread_create(&node->tid, NULL, node_thread, node) != 0) {
+			return -1;
+		}
+		node->started = 1;
+	}
+	return 0;
+}
+
+static void
+node_wake(struct mock_node *node) {
+	uint64_t one = 1;
+
+	if (node->evfd >= 0 && write(node->evfd, &one, sizeof(one)) < 0) {
+		fprintf(stderr, "mock: cannot wake node %d\n", node->port);
+	}
+}
+
+void
+mock_set_faults(struct mock *mock, int index, const struct mock_faults *faults) {
+	struct mock_node *node = &mock->nodes[index];
+
+	pthread_mutex_lock(&node->lock);
+	node->faults = *faults;
+	pthread_mutex_unlock(&node->lock);
+	node_wake(node);
+}
+
+void
+mock_get_faults(struct mock *mock, int index, struct mock_faults *faults) {
+	struct mock_node *node = &mock->nodes[index];
+
+	pthread_mutex_lock(&node->lock);
+	*faults = node->faults;
+	pthread_mutex_unlock(&node->lock);
+}
+
+void
+mock_get_stats(struct mock *mock, int index, struct mock_stats *stats) {
+	struct mock_node *node = &mock->nodes[index];
+
+	pthread_mutex_lock(&node->lock);
+	*stats = node->stats;
+	pthread_mutex_unlock(&node->lock);
+}
+
+void
+mock_destroy(struct mock *mock) {
+	struct mock_node *node;
+	int i;
+
+	__atomic_store_n(&mock->stop, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < mock->nnode; i++) {
+		node = &mock->nodes[i];
+		if (node->started) {
+			node_wake(node);
+			pthread_join(node->tid, NULL);
+		}
+		while (node->clients) {
+			client_close(node, node->clients);
+		}
+		if (node->listening) {
+			close(node->lfd);
+		}
+		if (node->epfd >= 0) {
+			close(node->epfd);
+		}
+		if (node->evfd >= 0) {
+			close(node->evfd);
+		}
+		pthread_mutex_destroy(&node->lock);
+	}
+	store_flush(&mock->store);
+	free(mock->store.buckets);
+	pthread_mutex_destroy(&mock->store.lock);
+	free(mock->pass);
+	free(mock);
+}
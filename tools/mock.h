@@ -0,0 +1,78 @@
+/*
+ * Dynoc is a minimalistic C client library for the dynomite.
+ * Copyright (C) 2016-2017 huya.com, Lampman Yao
+ */
+
+/*
+ * Dynomite - A thin, distributed replication layer for multi non-distributed storages.
+ * Copyright (C) 2014 Netflix, Inc.
+ */
+
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * A RESP server standing in for dynomite nodes, for benchmarks and
+ * failover tests on one box. Every node listens on its own port of
+ * 127.0.0.1 and is served by its own thread; all nodes of a mock share
+ * one store, as if dynomite replicated every write everywhere. It speaks
+ * the commands dynoc sends: PING AUTH GET SET SETEX PSETEX DEL UNLINK
+ * HSET HGET INCR INCRBY DECR DECRBY EXPIRE PERSIST PTTL SCAN DBSIZE
+ * FLUSHALL.
+ */
+struct mock;
+
+/*
+ * Faults of one node, all off when 0:
+ * - latency_ms, jitter_ms: every reply is held back latency_ms plus a
+ *   uniform 0..jitter_ms; replies of a connection stay in order.
+ * - drop_rate: chance that a command closes its connection instead.
+ * - error_rate: chance that a command gets "-ERR injected" instead.
+ * - down: the node stops listening and closes its connections.
+ * - hang: commands are read but never answered.
+ * - auth_fail: AUTH is refused whatever the password.
+ */
+struct mock_faults {
+	int latency_ms;
+	int jitter_ms;
+	double drop_rate;
+	double error_rate;
+	int down;
+	int hang;
+	int auth_fail;
+};
+
+struct mock_stats {
+	uint64_t connections;
+	uint64_t commands;
+	uint64_t errors;
+	uint64_t drops;
+};
+
+/* `pass`, if not NULL, is required with AUTH. */
+struct mock *mock_create(const char *pass);
+/* Returns the index of the new node, or -1 if `port` cannot be bound. */
+int mock_add_node(struct mock *mock, int port);
+int mock_start(struct mock *mock);
+void mock_set_faults(struct mock *mock, int node, const struct mock_faults *faults);
+void mock_get_faults(struct mock *mock, int node, struct mock_faults *faults);
+void mock_get_stats(struct mock *mock, int node, struct mock_stats *stats);
+void mock_destroy(struct mock *mock);
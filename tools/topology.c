@@ -0,0 +1,159 @@
+/*
+ * Dynoc is a minimalistic C client library for the dynomite.
+ * Copyright (C) 2016-2017 huya.com, Lampman Yao
+ */
+
+/*
+ * Dynomite - A thin, distributed replication layer for multi non-distributed storages.
+ * Copyright (C) 2014 Netflix, Inc.
+ */
+
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "topology.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TOPOLOGY_DC "dc"
+
+struct node_spec {
+	char *host;
+	int port;
+	char *rack;
+	char *token;
+};
+
+/* Split "host:port:rack:token" from the right, the host may hold colons. */
+static int
+node_parse(char *spec, struct node_spec *node) {
+	char *colon;
+
+	if (!(colon = strrchr(spec, ':'))) {
+		return -1;
+	}
+	node->token = colon + 1;
+	*colon = '\0';
+	if (!(colon = strrchr(spec, ':'))) {
+		return -1;
+	}
+	node->rack = colon + 1;
+	*colon = '\0';
+	if (!(colon = strrchr(spec, ':'))) {
+		return -1;
+	}
+	node->port = atoi(colon + 1);
+	*colon = '\0';
+	node->host = spec;
+	return *node->host && *node->rack && *node->token ? 0 : -1;
+}
+
+int
+topology_add(struct topology *topo, const char *spec) {
+	struct node_spec node;
+	char **nodes, *copy;
+
+	copy = strdup(spec);
+	if (!copy) {
+		return -1;
+	}
+	if (node_parse(copy, &node) < 0) {
+		fprintf(stderr, "bad node %s\n", spec);
+		free(copy);
+		return -1;
+	}
+	free(copy);
+
+	nodes = realloc(topo->nodes, (topo->nnode + 1) * sizeof(*nodes));
+	if (!nodes) {
+		return -1;
+	}
+	topo->nodes = nodes;
+	topo->nodes[topo->nnode++] = (char *)spec;
+	return 0;
+}
+
+int
+topology_connect(struct topology *topo, struct dynoc *dynoc) {
+	struct node_spec *nodes;
+	char **racks;
+	int *counts;
+	int nrack = 0, i, j, ret = -1;
+
+	if (topo->nnode == 0) {
+		fprintf(stderr, "no nodes given\n");
+		return -1;
+	}
+
+	nodes = calloc(topo->nnode, sizeof(*nodes));
+	racks = calloc(topo->nnode, sizeof(*racks));
+	counts = calloc(topo->nnode, sizeof(*counts));
+	if (!nodes || !racks || !counts) {
+		goto out;
+	}
+
+	for (i = 0; i < topo->nnode; i++) {
+		char *copy = strdup(topo->nodes[i]);
+		if (!copy || node_parse(copy, &nodes[i]) < 0) {
+			free(copy);
+			goto out;
+		}
+		for (j = 0; j < nrack && strcmp(racks[j], nodes[i].rack) != 0; j++);
+		if (j == nrack) {
+			racks[nrack++] = nodes[i].rack;
+		}
+		counts[j]++;
+	}
+
+	if (topo->hash && dynoc_hash_type_init(dynoc, topo->hash) < 0) {
+		fprintf(stderr, "unknown hash %s\n", topo->hash);
+		goto out;
+	}
+	dynoc_datacenter_init(dynoc, nrack, TOPOLOGY_DC, LOCAL_DC);
+	for (j = 0; j < nrack; j++) {
+		dynoc_rack_init(dynoc, counts[j], racks[j], LOCAL_DC);
+	}
+	for (i = 0; i < topo->nnode; i++) {
+		if (dynoc_add_node(dynoc, nodes[i].host, nodes[i].port, topo->pass,
+		                   nodes[i].token, nodes[i].rack, LOCAL_DC) < 0) {
+			fprintf(stderr, "cannot add node %s\n", topo->nodes[i]);
+			goto out;
+		}
+	}
+	ret = dynoc_start(dynoc);
+
+out:
+	if (nodes) {
+		for (i = 0; i < topo->nnode; i++) {
+			free(nodes[i].host);
+		}
+	}
+	free(nodes);
+	free(racks);
+	free(counts);
+	return ret;
+}
+
+void
+topology_usage(void) {
+	fprintf(stderr,
+		"  -n host:port:rack:token  a dynomite node, repeat for every node\n"
+		"  -a password              password of the nodes\n"
+		"  -H hash                  key hash algorithm (default murmur)\n");
+}
@@ -0,0 +1,47 @@
+/*
+ * Dynoc is a minimalistic C client library for the dynomite.
+ * Copyright (C) 2016-2017 huya.com, Lampman Yao
+ */
+
+/*
+ * Dynomite - A thin, distributed replication layer for multi non-distributed storages.
+ * Copyright (C) 2014 Netflix, Inc.
+ */
+
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "dynoc-core.h"
+
+/*
+ * Command line topology shared by the tools. Every node is given as
+ * "host:port:rack:token" (host may be "unix:/path"), all in one local
+ * datacenter. topology_connect() adds them to a client set up with
+ * dynoc_init() and starts it.
+ */
+struct topology {
+	char **nodes;
+	int nnode;
+	const char *pass;
+	const char *hash;
+};
+
+int topology_add(struct topology *topo, const char *spec);
+int topology_connect(struct topology *topo, struct dynoc *dynoc);
+void topology_usage(void);